@@ -78,6 +78,8 @@ typedef union {
 #define TELIT_ID_VENDOR 0x1BC7
 #define TELIT_ID_PRODUCT 0x36
 
+#define TELIT_WRITE_TIMEOUT_US 1000000
+
 enum { TELIT_STATE_INSERTED, TELIT_STATE_REMOVED };
 
 
@@ -136,14 +138,14 @@ int _telit_write(ttyacm_t *acm, char *data, size_t size)
 {
 	FUN_TRACE;
 	int err;
-	usb_urb_t urb;
+	usb_urb_t urb = { 0 };
 
-	memset(&urb.setup, 0, sizeof(usb_setup_packet_t));
 	urb.device_id = telit_common.device_id;
 	urb.type = usb_transfer_bulk;
 	urb.pipe = acm->pipe_out;
 	urb.direction = usb_transfer_out;
 	urb.async = 0;
+	urb.timeout_us = TELIT_WRITE_TIMEOUT_US;
 
 	if (acm->error || hostproxy_write(&urb, data, size) < 0) {
 		TRACE_FAIL("write");
@@ -382,23 +384,28 @@ int open_ttyacm(ttyacm_t *acm, int bulk_iface, int intr_iface, usb_endpoint_desc
 int _telit_init_read_buffers(ttyacm_t *acm)
 {
 	FUN_TRACE;
-	int err;
-
-	usb_urb_t urb = { 0 };
+	int i, n, err = EOK;
+
+	usb_urb_t urbs[8];
+	void *buffers[8] = { NULL };
+
+	/* All missing read-aheads are queued with a single message */
+	for (n = 0; acm->read_buffers + n < 8; ++n) {
+		memset(&urbs[n], 0, sizeof(urbs[n]));
+		urbs[n].type = usb_transfer_bulk;
+		urbs[n].device_id = telit_common.device_id;
+		urbs[n].pipe = acm->pipe_in;
+		urbs[n].transfer_size = 0x1000;
+		urbs[n].direction = usb_transfer_in;
+		urbs[n].async = 1;
+	}
 
-	urb.type = usb_transfer_bulk;
-	urb.device_id = telit_common.device_id;
-	urb.pipe = acm->pipe_in;
-	urb.transfer_size = 0x1000;
-	urb.direction = usb_transfer_in;
-	urb.async = 1;
+	if (n && hostproxy_submitv(urbs, buffers, n) < 0)
+		err = -EIO;
 
-	while (acm->read_buffers < 8) {
-		if (hostproxy_read(&urb, NULL, 0) < 0) {
-			err = -EIO;
-			break;
-		}
-		acm->read_buffers++;
+	for (i = 0; i < n; ++i) {
+		if (urbs[i].tag)
+			acm->read_buffers++;
 	}
 
 	return err;
@@ -418,6 +425,7 @@ int _telit_init_intr_buffers(ttyacm_t *acm)
 	urb.transfer_size = 0x1000;
 	urb.direction = usb_transfer_in;
 	urb.async = 1;
+	urb.periodic = 1;
 
 	while (acm->intr_buffers < 2) {
 		if (hostproxy_read(&urb, NULL, 0) < 0) {
@@ -662,21 +670,6 @@ void telit_resubmitThread(void *arg)
 }
 
 
-void telit_intrresubmitThread(void *arg)
-{
-	FUN_TRACE;
-	ttyacm_t *acm = arg;
-
-	mutexLock(acm->lock);
-	for (;;) {
-		while (acm->intr_buffers >= 2)
-			condWait(acm->cond, acm->lock, 0);
-
-		_telit_init_intr_buffers(acm);
-	}
-}
-
-
 void event_cb(usb_event_t *usb_event, char *data, size_t size)
 {
 	FUN_TRACE;
@@ -722,7 +715,10 @@ void event_cb(usb_event_t *usb_event, char *data, size_t size)
 		mutexLock(acm->lock);
 		if (usb_event->completion.pipe == acm->pipe_intr) {
 			TRACE("GOT INTERRUPT");
-			acm->intr_buffers--;
+
+			/* Interrupt URBs stay queued until they fail */
+			if (usb_event->completion.error < 0)
+				acm->intr_buffers--;
 		}
 		else if (usb_event->completion.pipe == acm->pipe_in) {
 			_telit_input(acm, data, size, usb_event->completion.error);
@@ -935,6 +931,10 @@ int main(int argc, char **argv)
 	if (usb_connect() < 0)
 		return -1;
 
+	/* Read-ahead URBs are posted through shared rings instead of messages */
+	if (hostproxy_rings(64) < 0)
+		TRACE_FAIL("rings setup, falling back to messages");
+
 	TRACE("Started gsm, log 4");
 
 	telit_start();
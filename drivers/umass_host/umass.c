@@ -249,33 +249,18 @@ int umass_open_endpoints(void)
 }
 
 
-int umass_transmit_out(void *buffer, int size)
+void umass_bulk_urb(usb_urb_t *urb, void **buffer, int direction, void *data, int size)
 {
-	usb_urb_t urb = {
-		.type = usb_transfer_bulk,
-		.direction = usb_transfer_out,
-		.device_id = umass_common.device_id,
-		.pipe = umass_common.out_pipe,
-		.transfer_size = size,
-		.async = 0,
-	};
+	memset(urb, 0, sizeof(*urb));
 
-	return hostproxy_write(&urb, buffer, size);
-}
+	urb->type = usb_transfer_bulk;
+	urb->direction = direction;
+	urb->device_id = umass_common.device_id;
+	urb->pipe = direction == usb_transfer_in ? umass_common.in_pipe : umass_common.out_pipe;
+	urb->transfer_size = size;
+	urb->async = 0;
 
-
-int umass_transmit_in(void *buffer, int size)
-{
-	usb_urb_t urb = {
-		.type = usb_transfer_bulk,
-		.direction = usb_transfer_in,
-		.device_id = umass_common.device_id,
-		.pipe = umass_common.in_pipe,
-		.transfer_size = size,
-		.async = 0,
-	};
-
-	return hostproxy_read(&urb, buffer, size);
+	*buffer = data;
 }
 
 
@@ -331,9 +316,11 @@ void umass_print_csw(bulk_csw_t *csw)
 
 int bulk_transport(char *cmd, int clen, void *data, int dlen, int dir)
 {
-	int retry;
+	int retry, n;
 	bulk_cbw_t cbw = {0};
 	bulk_csw_t csw = {0};
+	usb_urb_t urbs[3];
+	void *buffers[3];
 
 	if (clen > 16)
 		return -1;
@@ -346,26 +333,22 @@ int bulk_transport(char *cmd, int clen, void *data, int dlen, int dir)
 	cbw.clen = clen;
 	memcpy(cbw.cmd, cmd, clen);
 
-	for (retry = MAX_USB_RETRIES; retry; --retry) {
-		TRACE("CBW");
-		if (umass_transmit_out(&cbw, sizeof(cbw)))
-			continue;
+	/* CBW, data and CSW are queued together, the device NAKs until it is ready */
+	n = 0;
+	umass_bulk_urb(&urbs[n], &buffers[n], usb_transfer_out, &cbw, sizeof(cbw));
+	n++;
 
-		if (dlen) {
-			if (dir == BULK_READ) {
-				TRACE("READ");
-				if (umass_transmit_in(data, dlen))
-					continue;
-			}
-			else {
-				TRACE("WRITE");
-				if (umass_transmit_out(data, dlen))
-					continue;
-			}
-		}
+	if (dlen) {
+		umass_bulk_urb(&urbs[n], &buffers[n], dir == BULK_READ ? usb_transfer_in : usb_transfer_out, data, dlen);
+		n++;
+	}
+
+	umass_bulk_urb(&urbs[n], &buffers[n], usb_transfer_in, &csw, sizeof(csw));
+	n++;
 
-		TRACE("CSW");
-		if (umass_transmit_in(&csw, sizeof(csw)))
+	for (retry = MAX_USB_RETRIES; retry; --retry) {
+		TRACE("CBW/%s/CSW", dlen ? (dir == BULK_READ ? "READ" : "WRITE") : "-");
+		if (hostproxy_submitv(urbs, buffers, n))
 			continue;
 
 		umass_print_csw(&csw);
@@ -467,13 +450,17 @@ int main(int argc, char **argv)
 	TRACE("set configuration");
 	umass_set_configuration();
 
-	char *buffer = calloc(readsz, UMASS_SECSZ);
+	/* Shared with hostsrv, so bulk reads land in the buffer without copies */
+	char *buffer = hostproxy_alloc(readsz * UMASS_SECSZ);
 
 	if (buffer == NULL) {
 		TRACE("buffer fail");
 		return -1;
 	}
 
+	if (hostproxy_register(buffer, readsz * UMASS_SECSZ) < 0)
+		TRACE("buffer not registered, falling back to copying");
+
 	umass_check();
 	umass_reset();
 	for (int j = 0; 1 /*j < 10000*/; ++j) {
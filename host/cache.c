@@ -0,0 +1,334 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Server - descriptor cache
+ *
+ * host/cache.c
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/threads.h>
+
+#include "cache.h"
+
+
+#define CACHE_MAGIC 0x43425355 /* "USBC" */
+#define CACHE_VERSION 1
+
+/* Longest wait before retrying a failed save */
+#define CACHE_RETRY_MAX_US 60000000
+
+
+typedef struct {
+	cache_key_t key;
+	usb_device_desc_t desc;
+	size_t size;
+	void *configuration; /* NULL - unused entry */
+	unsigned stamp;
+} cache_entry_t;
+
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+} cache_header_t;
+
+
+static struct {
+	handle_t lock;
+	handle_t cond;
+	cache_entry_t *entries;
+	unsigned capacity;
+	unsigned stamp;
+	int dirty;
+	unsigned failures;
+	const char *path;
+} cache_common;
+
+
+static cache_entry_t *cache_find(const cache_key_t *key)
+{
+	unsigned i;
+
+	for (i = 0; i < cache_common.capacity; ++i) {
+		if (cache_common.entries[i].configuration != NULL && !memcmp(&cache_common.entries[i].key, key, sizeof(*key)))
+			return &cache_common.entries[i];
+	}
+
+	return NULL;
+}
+
+
+static cache_entry_t *cache_victim(void)
+{
+	cache_entry_t *entry, *victim = cache_common.entries;
+	unsigned i;
+
+	for (i = 0; i < cache_common.capacity; ++i) {
+		entry = &cache_common.entries[i];
+
+		if (entry->configuration == NULL)
+			return entry;
+
+		if (cache_common.stamp - entry->stamp > cache_common.stamp - victim->stamp)
+			victim = entry;
+	}
+
+	return victim;
+}
+
+
+static int cache_put(const cache_key_t *key, const usb_device_desc_t *desc, const void *configuration, size_t size)
+{
+	cache_entry_t *entry;
+	void *copy;
+
+	if (size > CACHE_MAX_CONFIG || (copy = malloc(size)) == NULL)
+		return -ENOMEM;
+
+	if ((entry = cache_find(key)) == NULL)
+		entry = cache_victim();
+
+	free(entry->configuration);
+	memcpy(copy, configuration, size);
+
+	entry->key = *key;
+	entry->desc = *desc;
+	entry->size = size;
+	entry->configuration = copy;
+	entry->stamp = ++cache_common.stamp;
+
+	return EOK;
+}
+
+
+/* Copies the entries in their file format, must be called with the cache lock held */
+static void *cache_serialize(size_t *size)
+{
+	cache_header_t header = { CACHE_MAGIC, CACHE_VERSION, 0 };
+	cache_entry_t *entry;
+	uint16_t length;
+	char *buffer, *ptr;
+	unsigned i;
+
+	*size = sizeof(header);
+
+	for (i = 0; i < cache_common.capacity; ++i) {
+		entry = &cache_common.entries[i];
+
+		if (entry->configuration != NULL) {
+			header.count++;
+			*size += sizeof(entry->key) + sizeof(entry->desc) + sizeof(length) + entry->size;
+		}
+	}
+
+	if ((buffer = malloc(*size)) == NULL)
+		return NULL;
+
+	memcpy(buffer, &header, sizeof(header));
+	ptr = buffer + sizeof(header);
+
+	for (i = 0; i < cache_common.capacity; ++i) {
+		entry = &cache_common.entries[i];
+		length = entry->size;
+
+		if (entry->configuration == NULL)
+			continue;
+
+		memcpy(ptr, &entry->key, sizeof(entry->key));
+		ptr += sizeof(entry->key);
+		memcpy(ptr, &entry->desc, sizeof(entry->desc));
+		ptr += sizeof(entry->desc);
+		memcpy(ptr, &length, sizeof(length));
+		ptr += sizeof(length);
+		memcpy(ptr, entry->configuration, length);
+		ptr += length;
+	}
+
+	return buffer;
+}
+
+
+/* Written to a temporary file first, a torn write never replaces a good cache */
+static int cache_save(const void *buffer, size_t size)
+{
+	char tmp[256];
+	FILE *file;
+	int err = EOK;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", cache_common.path);
+
+	if ((file = fopen(tmp, "w")) == NULL)
+		return -errno;
+
+	if (fwrite(buffer, size, 1, file) != 1)
+		err = -EIO;
+
+	if (fclose(file) != 0 && err == EOK)
+		err = -EIO;
+
+	if (err == EOK && rename(tmp, cache_common.path) < 0)
+		err = -errno;
+
+	if (err < 0)
+		remove(tmp);
+
+	return err;
+}
+
+
+static void cache_load(void)
+{
+	char buffer[CACHE_MAX_CONFIG];
+	cache_header_t header;
+	cache_key_t key;
+	usb_device_desc_t desc;
+	uint16_t size;
+	FILE *file;
+
+	if ((file = fopen(cache_common.path, "r")) == NULL)
+		return;
+
+	if (fread(&header, sizeof(header), 1, file) == 1 && header.magic == CACHE_MAGIC && header.version == CACHE_VERSION) {
+		while (header.count--) {
+			if (fread(&key, sizeof(key), 1, file) != 1 || fread(&desc, sizeof(desc), 1, file) != 1 ||
+				fread(&size, sizeof(size), 1, file) != 1 || size > sizeof(buffer) || fread(buffer, size, 1, file) != 1)
+				break;
+
+			cache_put(&key, &desc, buffer, size);
+		}
+	}
+
+	fclose(file);
+}
+
+
+int cache_init(unsigned capacity, const char *path)
+{
+	if (!capacity)
+		capacity = 1;
+
+	if ((cache_common.entries = calloc(capacity, sizeof(cache_entry_t))) == NULL)
+		return -ENOMEM;
+
+	mutexCreate(&cache_common.lock);
+	condCreate(&cache_common.cond);
+	cache_common.capacity = capacity;
+	cache_common.stamp = 0;
+	cache_common.dirty = 0;
+	cache_common.path = path;
+
+	if (path != NULL)
+		cache_load();
+
+	return EOK;
+}
+
+
+void cache_key(cache_key_t *key, const usb_device_desc_t *desc, const usb_string_desc_t *serial)
+{
+	int i, c, len = 0;
+
+	memset(key, 0, sizeof(*key));
+	key->idVendor = desc->idVendor;
+	key->idProduct = desc->idProduct;
+	key->bcdDevice = desc->bcdDevice;
+
+	/* Serial numbers are plain ASCII in practice, anything else is folded */
+	if (serial != NULL && serial->bLength >= 2)
+		len = (serial->bLength - 2) / 2;
+
+	for (i = 0; i < len && i < CACHE_SERIAL_LEN - 1; ++i) {
+		c = serial->wData[2 * i] | serial->wData[2 * i + 1] << 8;
+		key->serial[i] = c < 0x80 ? c : '?';
+	}
+}
+
+
+int cache_lookup(const cache_key_t *key, const usb_device_desc_t *desc, void *configuration, size_t size)
+{
+	cache_entry_t *entry;
+	int err = -ENOENT;
+
+	mutexLock(cache_common.lock);
+	if ((entry = cache_find(key)) != NULL && !memcmp(&entry->desc, desc, sizeof(*desc)) && entry->size <= size) {
+		memcpy(configuration, entry->configuration, entry->size);
+		entry->stamp = ++cache_common.stamp;
+		err = entry->size;
+	}
+	mutexUnlock(cache_common.lock);
+
+	return err;
+}
+
+
+int cache_store(const cache_key_t *key, const usb_device_desc_t *desc, const void *configuration, size_t size)
+{
+	int err;
+
+	mutexLock(cache_common.lock);
+	if ((err = cache_put(key, desc, configuration, size)) == EOK && cache_common.path != NULL) {
+		cache_common.dirty = 1;
+		condSignal(cache_common.cond);
+	}
+	mutexUnlock(cache_common.lock);
+
+	return err;
+}
+
+
+int cache_flush(unsigned delay_us)
+{
+	void *buffer;
+	size_t size;
+	unsigned i;
+	int err;
+
+	mutexLock(cache_common.lock);
+	while (!cache_common.dirty)
+		condWait(cache_common.cond, cache_common.lock, 0);
+	mutexUnlock(cache_common.lock);
+
+	/* Devices enumerated together are written out at once, after failures the wait doubles each time */
+	for (i = 0; i < cache_common.failures && delay_us < CACHE_RETRY_MAX_US / 2; ++i)
+		delay_us *= 2;
+
+	usleep(delay_us);
+
+	mutexLock(cache_common.lock);
+	if ((buffer = cache_serialize(&size)) != NULL)
+		cache_common.dirty = 0;
+	mutexUnlock(cache_common.lock);
+
+	if (buffer == NULL)
+		return -ENOMEM;
+
+	/* Left dirty to be tried again with the next flush, only the first failure in a row is reported */
+	if ((err = cache_save(buffer, size)) < 0) {
+		if (!cache_common.failures++)
+			syslog(LOG_WARNING, "cache: saving %s failed (%d), retrying", cache_common.path, err);
+
+		mutexLock(cache_common.lock);
+		cache_common.dirty = 1;
+		mutexUnlock(cache_common.lock);
+	}
+	else if (cache_common.failures) {
+		syslog(LOG_INFO, "cache: saved %s after %u failures", cache_common.path, cache_common.failures);
+		cache_common.failures = 0;
+	}
+
+	free(buffer);
+	return err;
+}
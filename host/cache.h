@@ -0,0 +1,56 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Server - descriptor cache
+ *
+ * host/cache.h
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _USB_HOST_CACHE_H_
+#define _USB_HOST_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <usb.h>
+
+
+#define CACHE_SERIAL_LEN 32
+#define CACHE_MAX_CONFIG 4096
+
+
+typedef struct {
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t bcdDevice;
+	char serial[CACHE_SERIAL_LEN];
+} cache_key_t;
+
+
+/* Loads entries persisted in path (NULL - kept in memory only) */
+int cache_init(unsigned capacity, const char *path);
+
+
+/* Builds the key of a device, serial may be NULL */
+void cache_key(cache_key_t *key, const usb_device_desc_t *desc, const usb_string_desc_t *serial);
+
+
+/* Copies the cached configuration if desc still matches, returns its size or -ENOENT */
+int cache_lookup(const cache_key_t *key, const usb_device_desc_t *desc, void *configuration, size_t size);
+
+
+/* Replaces the entry of key, the least recently used one is evicted when full. The file is written by cache_flush */
+int cache_store(const cache_key_t *key, const usb_device_desc_t *desc, const void *configuration, size_t size);
+
+
+/* Waits for a store, lets further ones gather for delay_us and writes the file, meant for a thread of its own.
+ * After failed writes the delay doubles with each one, up to a minute */
+int cache_flush(unsigned delay_us);
+
+
+#endif
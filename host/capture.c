@@ -0,0 +1,118 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Server - usbmon style URB capture
+ *
+ * host/capture.c
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "capture.h"
+
+
+static void capture_put(capture_t *capture, const void *data, size_t length)
+{
+	size_t offset = capture->head % capture->size;
+	size_t first = length < capture->size - offset ? length : capture->size - offset;
+
+	memcpy(capture->ring + offset, data, first);
+	memcpy(capture->ring, (const char *)data + first, length - first);
+	capture->head += length;
+}
+
+
+static void capture_get(capture_t *capture, size_t at, void *data, size_t length)
+{
+	size_t offset = at % capture->size;
+	size_t first = length < capture->size - offset ? length : capture->size - offset;
+
+	memcpy(data, capture->ring + offset, first);
+	memcpy((char *)data + first, capture->ring, length - first);
+}
+
+
+int capture_start(capture_t *capture, size_t size, int device_id, int endpoint, unsigned snaplen)
+{
+	capture_stop(capture);
+
+	if (size < sizeof(capture_record_t) + sizeof(capture_usbmon_t) || size > CAPTURE_MAX_SIZE)
+		return -EINVAL;
+
+	if ((capture->ring = malloc(size)) == NULL)
+		return -ENOMEM;
+
+	capture->size = size;
+	capture->head = 0;
+	capture->tail = 0;
+	capture->device_id = device_id;
+	capture->endpoint = endpoint;
+	capture->snaplen = snaplen;
+	capture->drops = 0;
+
+	return EOK;
+}
+
+
+void capture_stop(capture_t *capture)
+{
+	free(capture->ring);
+	capture->ring = NULL;
+}
+
+
+void capture_record(capture_t *capture, capture_usbmon_t *usbmon, const void *data, size_t length)
+{
+	capture_record_t record;
+
+	usbmon->len_cap = data == NULL ? 0 : (length < capture->snaplen ? length : capture->snaplen);
+
+	record.ts_sec = usbmon->ts_sec;
+	record.ts_usec = usbmon->ts_usec;
+	record.incl_len = sizeof(*usbmon) + usbmon->len_cap;
+	record.orig_len = sizeof(*usbmon) + usbmon->length;
+
+	/* Older records are the interesting ones, new ones are dropped rather than overwriting them */
+	if (capture->size - (capture->head - capture->tail) < sizeof(record) + record.incl_len) {
+		capture->drops++;
+		return;
+	}
+
+	capture_put(capture, &record, sizeof(record));
+	capture_put(capture, usbmon, sizeof(*usbmon));
+
+	if (usbmon->len_cap)
+		capture_put(capture, data, usbmon->len_cap);
+}
+
+
+size_t capture_read(capture_t *capture, void *buffer, size_t size)
+{
+	capture_record_t record;
+	size_t length, copied = 0;
+
+	if (capture->ring == NULL)
+		return 0;
+
+	while (capture->tail != capture->head) {
+		capture_get(capture, capture->tail, &record, sizeof(record));
+		length = sizeof(record) + record.incl_len;
+
+		if (copied + length > size)
+			break;
+
+		capture_get(capture, capture->tail, (char *)buffer + copied, length);
+		capture->tail += length;
+		copied += length;
+	}
+
+	return copied;
+}
@@ -0,0 +1,99 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Server - usbmon style URB capture
+ *
+ * host/capture.h
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _USB_HOST_CAPTURE_H_
+#define _USB_HOST_CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* pcap link type of the Linux usbmon header below */
+#define CAPTURE_LINKTYPE 189
+
+/* Largest ring a client may ask for */
+#define CAPTURE_MAX_SIZE (1024 * 1024)
+
+
+/* Transfer types and status codes as Linux reports them */
+enum { capture_iso, capture_interrupt, capture_control, capture_bulk };
+
+#define CAPTURE_EINPROGRESS (-115)
+#define CAPTURE_EIO (-5)
+#define CAPTURE_EOVERFLOW (-75)
+#define CAPTURE_ETIMEDOUT (-110)
+#define CAPTURE_ECONNRESET (-104)
+
+
+typedef struct {
+	uint64_t id;
+	uint8_t type;      /* 'S'ubmission or 'C'ompletion */
+	uint8_t xfer_type;
+	uint8_t epnum;     /* Endpoint number, 0x80 for IN */
+	uint8_t devnum;
+	uint16_t busnum;
+	int8_t flag_setup; /* 0 if setup is valid */
+	int8_t flag_data;  /* 0 if data follows */
+	int64_t ts_sec;
+	int32_t ts_usec;
+	int32_t status;
+	uint32_t length;
+	uint32_t len_cap;
+	uint8_t setup[8];
+} __attribute__((packed)) capture_usbmon_t;
+
+
+/* pcap record header, followed by the usbmon header and len_cap bytes of data */
+typedef struct {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+} capture_record_t;
+
+
+/* Byte ring of whole pcap records, head and tail run freely. Not locked, callers serialise access */
+typedef struct {
+	char *ring;
+	size_t size;
+	size_t head, tail;
+
+	int device_id, endpoint; /* -1 matches any */
+	unsigned snaplen;
+	unsigned drops;
+} capture_t;
+
+
+int capture_start(capture_t *capture, size_t size, int device_id, int endpoint, unsigned snaplen);
+
+
+void capture_stop(capture_t *capture);
+
+
+/* Records the header and the first snaplen bytes of data, drops the record if the ring is full */
+void capture_record(capture_t *capture, capture_usbmon_t *usbmon, const void *data, size_t length);
+
+
+/* Moves as many whole records as fit into buffer, returns the number of bytes */
+size_t capture_read(capture_t *capture, void *buffer, size_t size);
+
+
+static inline int capture_wants(const capture_t *capture, int device_id, int endpoint)
+{
+	return capture->ring != NULL && (capture->device_id < 0 || capture->device_id == device_id) &&
+		(capture->endpoint < 0 || capture->endpoint == endpoint);
+}
+
+
+#endif
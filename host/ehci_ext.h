@@ -0,0 +1,59 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Server - optional EHCI entry points
+ *
+ * host/ehci_ext.h
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _USB_HOST_EHCI_EXT_H_
+#define _USB_HOST_EHCI_EXT_H_
+
+#include <ehci.h>
+
+
+/* Not every libusbehci provides these, callers check for NULL and fall back */
+
+
+/* Removes first..last from the queue of a qh unlinked from the schedule */
+extern void ehci_dequeue(struct qh *qh, struct qtd *first, struct qtd *last) __attribute__((weak));
+
+
+/* Routes a full/low speed qh through the transaction translator of a high speed hub */
+extern void ehci_qhSetTT(struct qh *qh, int hub_address, int port) __attribute__((weak));
+
+
+/* Sets the number of packets per microframe of a high bandwidth interrupt qh */
+extern void ehci_qhSetMult(struct qh *qh, int mult) __attribute__((weak));
+
+
+/* Speed of the device on the root port after a reset */
+extern int ehci_portSpeed(void) __attribute__((weak));
+
+
+/* Links qh into every period-th frame starting at phase, polled in smask microframes (complete splits in cmask) */
+extern void ehci_linkPeriodicQh(struct qh *qh, unsigned period, unsigned phase, unsigned smask, unsigned cmask) __attribute__((weak));
+
+
+extern void ehci_unlinkPeriodicQh(struct qh *qh) __attribute__((weak));
+
+
+/* Reinitialises a qh dropped by the controller for another endpoint, as ehci_allocQh would set it up */
+extern void ehci_qhInit(struct qh *qh, int address, int endpoint, int transfer, int speed, int max_packet_len) __attribute__((weak));
+
+
+/* Rings the async advance doorbell, returns the ehci_doorbells count after which the controller
+ * no longer caches any qh unlinked so far */
+extern unsigned ehci_ringDoorbell(void) __attribute__((weak));
+
+
+extern unsigned ehci_doorbells(void) __attribute__((weak));
+
+
+#endif
@@ -19,6 +19,7 @@
 #include <unistd.h>
 #include <sys/threads.h>
 #include <sys/msg.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <string.h>
 
@@ -29,6 +30,8 @@
 #define HOSTPROXY_RUNNING 0x1
 #define HOSTPROXY_CONNECTED 0x2
 
+#define HOSTPROXY_REGIONS 8
+
 static struct {
 	hostproxy_event_cb event_cb;
 	handle_t cond;
@@ -36,16 +39,125 @@ static struct {
 	uint32_t hostsrv_port;
 	uint32_t port;
 	int state;
+
+	handle_t region_lock;
+	struct {
+		char *base;
+		size_t size;
+		int id;
+	} regions[HOSTPROXY_REGIONS];
+
+	/* Submission and completion rings shared with hostsrv (NULL - messages only) */
+	handle_t ring_lock;
+	usb_rings_t *rings;
+	usb_urb_t *sqes;
+	usb_event_t *cqes;
+	unsigned tag;
 } hostproxy_common;
 
 
 static char event_loop_stack[4096] __attribute__((aligned(8)));
 
 
+static size_t hostproxy_pageAlign(size_t size)
+{
+	return (size + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1);
+}
+
+
+/* Returns id of the registered region holding data or 0 */
+static int hostproxy_findRegion(void *data, size_t size, unsigned *offset)
+{
+	int i, id = 0;
+
+	if (data == NULL)
+		return 0;
+
+	mutexLock(hostproxy_common.region_lock);
+	for (i = 0; i < HOSTPROXY_REGIONS; ++i) {
+		if (!hostproxy_common.regions[i].id || (char *)data < hostproxy_common.regions[i].base)
+			continue;
+
+		*offset = (char *)data - hostproxy_common.regions[i].base;
+
+		if (*offset < hostproxy_common.regions[i].size && size <= hostproxy_common.regions[i].size - *offset) {
+			id = hostproxy_common.regions[i].id;
+			break;
+		}
+	}
+	mutexUnlock(hostproxy_common.region_lock);
+
+	return id;
+}
+
+
+static void *hostproxy_regionData(int id, unsigned offset)
+{
+	int i;
+	void *data = NULL;
+
+	mutexLock(hostproxy_common.region_lock);
+	for (i = 0; i < HOSTPROXY_REGIONS; ++i) {
+		if (hostproxy_common.regions[i].id == id) {
+			data = hostproxy_common.regions[i].base + offset;
+			break;
+		}
+	}
+	mutexUnlock(hostproxy_common.region_lock);
+
+	return data;
+}
+
+
+/* Must be called with hostproxy_common.lock held */
+static void hostproxy_complete(usb_event_t *event, char *batch)
+{
+	void *data = NULL;
+
+	if (event->completion.region)
+		data = hostproxy_regionData(event->completion.region, event->completion.offset);
+	else if (event->completion.size)
+		data = batch + event->completion.offset;
+
+	if (hostproxy_common.event_cb != NULL)
+		hostproxy_common.event_cb(event, data, event->completion.size);
+}
+
+
+/* Must be called with hostproxy_common.lock held */
+static void hostproxy_reap(void)
+{
+	usb_ring_t *cq = &hostproxy_common.rings->cq;
+	usb_event_t event;
+	unsigned head;
+
+	for (;;) {
+		while ((head = cq->head) != cq->tail) {
+			__sync_synchronize();
+			event = hostproxy_common.cqes[head & (cq->size - 1)];
+			__sync_synchronize();
+			cq->head = head + 1;
+
+			hostproxy_complete(&event, NULL);
+		}
+
+		/* hostsrv sends usb_event_kick only if it finds the ring idle */
+		cq->idle = 1;
+		__sync_synchronize();
+
+		if (cq->head == cq->tail)
+			break;
+
+		cq->idle = 0;
+	}
+}
+
+
 void hostproxy_event_loop(void *arg)
 {
 	msg_t msg;
-	unsigned int rid;
+	unsigned int rid, i;
+	usb_event_t *event = (usb_event_t *)msg.i.raw;
 
 	mutexLock(hostproxy_common.lock);
 	while (hostproxy_common.state & HOSTPROXY_RUNNING) {
@@ -59,8 +171,19 @@ void hostproxy_event_loop(void *arg)
 			condSignal(hostproxy_common.cond);
 		}
 
-		if (hostproxy_common.event_cb != NULL)
-			hostproxy_common.event_cb((usb_event_t *)&msg.i.raw, msg.i.data, msg.i.size);
+		if (event->type == usb_event_kick) {
+			msgRespond(hostproxy_common.port, &msg, rid);
+			hostproxy_reap();
+			continue;
+		}
+
+		if (event->type == usb_event_completions) {
+			for (i = 0; i < event->batch.count; ++i)
+				hostproxy_complete((usb_event_t *)msg.i.data + i, msg.i.data);
+		}
+		else if (hostproxy_common.event_cb != NULL) {
+			hostproxy_common.event_cb(event, msg.i.data, msg.i.size);
+		}
 
 		msgRespond(hostproxy_common.port, &msg, rid);
 	}
@@ -85,6 +208,8 @@ int hostproxy_init(void)
 	ret |= portCreate(&hostproxy_common.port);
 	ret |= condCreate(&hostproxy_common.cond);
 	ret |= mutexCreate(&hostproxy_common.lock);
+	ret |= mutexCreate(&hostproxy_common.region_lock);
+	ret |= mutexCreate(&hostproxy_common.ring_lock);
 
 	if (ret)
 		return -1;
@@ -154,6 +279,62 @@ int hostproxy_open_(int device, usb_endpoint_desc_t endpoint)
 
 
 
+/* Posts all count async URBs to the submission ring or none if they do not fit */
+static int hostproxy_postv(usb_urb_t *urbs, unsigned count)
+{
+	msg_t msg = { 0 };
+	usb_ring_t *sq;
+	unsigned tail, i;
+	int kick;
+
+	mutexLock(hostproxy_common.ring_lock);
+	sq = &hostproxy_common.rings->sq;
+
+	if (sq->size - ((tail = sq->tail) - sq->head) < count) {
+		mutexUnlock(hostproxy_common.ring_lock);
+		return -ENOSPC;
+	}
+
+	for (i = 0; i < count; ++i) {
+		/* Tags stay apart from transfer ids assigned by hostsrv */
+		if (!(hostproxy_common.tag = (hostproxy_common.tag + 1) & (USB_TAG - 1)))
+			hostproxy_common.tag = 1;
+		urbs[i].tag = USB_TAG | hostproxy_common.tag;
+
+		hostproxy_common.sqes[(tail + i) & (sq->size - 1)] = urbs[i];
+	}
+
+	__sync_synchronize();
+	sq->tail = tail + count;
+	__sync_synchronize();
+
+	/* hostsrv needs a message only when it has gone idle on an empty ring */
+	if ((kick = sq->idle))
+		sq->idle = 0;
+	mutexUnlock(hostproxy_common.ring_lock);
+
+	if (kick) {
+		msg.type = mtDevCtl;
+		((usb_msg_t *)msg.i.raw)->type = usb_msg_kick;
+		msgSend(hostproxy_common.hostsrv_port, &msg);
+	}
+
+	return EOK;
+}
+
+
+/* Posts an async URB to the submission ring, returns its transfer id */
+static int hostproxy_post(usb_urb_t *urb)
+{
+	int err;
+
+	if ((err = hostproxy_postv(urb, 1)) < 0)
+		return err;
+
+	return urb->tag;
+}
+
+
 int hostproxy_write(usb_urb_t *urb, void *data, size_t size)
 {
 	msg_t msg = { 0 };
@@ -164,11 +345,18 @@ int hostproxy_write(usb_urb_t *urb, void *data, size_t size)
 	usb_msg->type = usb_msg_urb;
 	urb->transfer_size = size;
 	urb->direction = usb_transfer_out;
+	urb->tag = 0;
 
-	memcpy(&usb_msg->urb, urb, sizeof(usb_urb_t));
+	/* Data from a registered region is accessed by hostsrv in place */
+	if ((urb->region = hostproxy_findRegion(data, size, &urb->offset)) == 0) {
+		msg.i.data = data;
+		msg.i.size = size;
+	}
+
+	if (urb->async && hostproxy_common.rings != NULL && (urb->region || !size) && (ret = hostproxy_post(urb)) != -ENOSPC)
+		return ret;
 
-	msg.i.data = data;
-	msg.i.size = size;
+	memcpy(&usb_msg->urb, urb, sizeof(usb_urb_t));
 
 	ret = msgSend(hostproxy_common.hostsrv_port, &msg);
 	if (ret)
@@ -191,12 +379,183 @@ int hostproxy_read(usb_urb_t *urb, void *data, size_t size)
 	if (!urb->async)
 		urb->transfer_size = size;
 
+	urb->tag = 0;
+
+	if ((urb->region = hostproxy_findRegion(data, urb->transfer_size, &urb->offset)) == 0) {
+		msg.o.data = data;
+		msg.o.size = size;
+	}
+
+	if (urb->async && hostproxy_common.rings != NULL && (ret = hostproxy_post(urb)) != -ENOSPC)
+		return ret;
+
 	memcpy(&usb_msg->urb, urb, sizeof(usb_urb_t));
 
-	msg.o.data = data;
-	msg.o.size = size;
+	ret = msgSend(hostproxy_common.hostsrv_port, &msg);
+	if (ret)
+		return ret;
+
+	return msg.o.io.err;
+}
+
+
+int hostproxy_submitv(usb_urb_t *urbs, void **data, unsigned count)
+{
+	msg_t msg = { 0 };
+	size_t in_size, out_size, size;
+	char *buffer, *in, *out;
+	usb_urb_t *urb;
+	int *results;
+	unsigned i;
+	int ret = 0;
+
+	/* Request: URBs and OUT data, response: results and IN data of synchronous URBs */
+	in_size = count * sizeof(usb_urb_t);
+	out_size = count * sizeof(int);
+
+	for (i = 0; i < count; ++i) {
+		urbs[i].tag = 0;
+		urbs[i].segments = 0;
+		urbs[i].region = hostproxy_findRegion(data[i], urbs[i].transfer_size, &urbs[i].offset);
+
+		if (urbs[i].region || urbs[i].transfer_size <= 0)
+			continue;
+
+		if (urbs[i].direction == usb_transfer_out)
+			in_size += urbs[i].transfer_size;
+		else if (!urbs[i].async)
+			out_size += urbs[i].transfer_size;
+	}
+
+	/* Async URBs without data in the message go to the submission ring, all together so that they keep their order */
+	if (hostproxy_common.rings != NULL) {
+		for (i = 0; i < count && urbs[i].async && (urbs[i].region || urbs[i].transfer_size <= 0 || urbs[i].direction == usb_transfer_in); ++i)
+			;
+
+		if (i == count && hostproxy_postv(urbs, count) == EOK)
+			return EOK;
+	}
+
+	if ((buffer = malloc(in_size + out_size)) == NULL)
+		return -ENOMEM;
+
+	urb = (usb_urb_t *)buffer;
+	memcpy(urb, urbs, count * sizeof(usb_urb_t));
+	in = (char *)(urb + count);
+
+	for (i = 0; i < count; ++i) {
+		if (urbs[i].region || urbs[i].transfer_size <= 0 || urbs[i].direction != usb_transfer_out)
+			continue;
+
+		if (data[i] != NULL)
+			memcpy(in, data[i], urbs[i].transfer_size);
+		else
+			memset(in, 0, urbs[i].transfer_size);
+		in += urbs[i].transfer_size;
+	}
+
+	results = (int *)(buffer + in_size);
+	for (i = 0; i < count; ++i)
+		results[i] = -EIO;
+
+	msg.type = mtDevCtl;
+	usb_msg_t *usb_msg = (usb_msg_t *)msg.i.raw;
+	usb_msg->type = usb_msg_submitv;
+	usb_msg->submitv.count = count;
+
+	msg.i.data = buffer;
+	msg.i.size = in_size;
+	msg.o.data = buffer + in_size;
+	msg.o.size = out_size;
+
+	if ((ret = msgSend(hostproxy_common.hostsrv_port, &msg)) == 0)
+		ret = msg.o.io.err;
+
+	out = (char *)(results + count);
+
+	for (i = 0; i < count; ++i) {
+		/* Async URBs get the transfer id their completion will carry */
+		if (urbs[i].async && results[i] >= 0)
+			urbs[i].tag = results[i];
+
+		if (urbs[i].region || urbs[i].transfer_size <= 0 || urbs[i].direction != usb_transfer_in || urbs[i].async)
+			continue;
+
+		size = urbs[i].transfer_size;
+		if (results[i] == 0 && data[i] != NULL)
+			memcpy(data[i], out, size);
+		out += size;
+	}
+
+	free(buffer);
+
+	return ret;
+}
+
+
+int hostproxy_submitsg(usb_urb_t *urb, void **buffers, size_t *sizes, unsigned count)
+{
+	msg_t msg = { 0 };
+	usb_segment_t *segments;
+	unsigned i, offset;
+	int region = 0, ret = 0;
+
+	if (!count)
+		return -EINVAL;
+
+	if ((segments = malloc(count * sizeof(*segments))) == NULL)
+		return -ENOMEM;
+
+	urb->transfer_size = 0;
+
+	/* Offsets are relative to the start of the one region all segments lie in */
+	for (i = 0; i < count; ++i) {
+		if ((ret = hostproxy_findRegion(buffers[i], sizes[i], &offset)) == 0 || (region && ret != region)) {
+			free(segments);
+			return -EINVAL;
+		}
+
+		region = ret;
+		segments[i].offset = offset;
+		segments[i].size = sizes[i];
+		urb->transfer_size += sizes[i];
+	}
+
+	urb->region = region;
+	urb->offset = 0;
+	urb->segments = count;
+	urb->tag = 0;
+
+	msg.type = mtDevCtl;
+	usb_msg_t *usb_msg = (usb_msg_t *)msg.i.raw;
+	usb_msg->type = usb_msg_urb;
+	memcpy(&usb_msg->urb, urb, sizeof(usb_urb_t));
+
+	msg.i.data = segments;
+	msg.i.size = count * sizeof(*segments);
+
+	ret = msgSend(hostproxy_common.hostsrv_port, &msg);
+	free(segments);
+
+	if (ret)
+		return ret;
+
+	return msg.o.io.err;
+}
+
+
+int hostproxy_cancel(int handle)
+{
+	msg_t msg = { 0 };
+	int ret = 0;
+
+	msg.type = mtDevCtl;
+	usb_msg_t *usb_msg = (usb_msg_t *)msg.i.raw;
+	usb_msg->type = usb_msg_cancel;
+	usb_msg->cancel.handle = handle;
 
 	ret = msgSend(hostproxy_common.hostsrv_port, &msg);
+
 	if (ret)
 		return ret;
 
@@ -223,6 +582,223 @@ int hostproxy_reset(int deviceId)
 }
 
 
+int hostproxy_stats(usb_stats_t *stats)
+{
+	msg_t msg = { 0 };
+	int ret = 0;
+
+	msg.type = mtDevCtl;
+	usb_msg_t *usb_msg = (usb_msg_t *)msg.i.raw;
+	usb_msg->type = usb_msg_stats;
+
+	msg.o.data = stats;
+	msg.o.size = sizeof(usb_stats_t);
+
+	ret = msgSend(hostproxy_common.hostsrv_port, &msg);
+
+	if (ret)
+		return ret;
+
+	return msg.o.io.err;
+}
+
+
+int hostproxy_deviceStats(int deviceId, usb_device_stats_t *stats, size_t size)
+{
+	msg_t msg = { 0 };
+	int ret = 0;
+
+	msg.type = mtDevCtl;
+	usb_msg_t *usb_msg = (usb_msg_t *)msg.i.raw;
+	usb_msg->type = usb_msg_devstats;
+	usb_msg->devstats.device_id = deviceId;
+
+	msg.o.data = stats;
+	msg.o.size = size;
+
+	ret = msgSend(hostproxy_common.hostsrv_port, &msg);
+
+	if (ret)
+		return ret;
+
+	return msg.o.io.err;
+}
+
+
+int hostproxy_capture(usb_capture_t *capture, void *buffer, size_t size)
+{
+	msg_t msg = { 0 };
+	int ret = 0;
+
+	msg.type = mtDevCtl;
+	usb_msg_t *usb_msg = (usb_msg_t *)msg.i.raw;
+	usb_msg->type = usb_msg_capture;
+	usb_msg->capture = *capture;
+
+	msg.o.data = buffer;
+	msg.o.size = size;
+
+	ret = msgSend(hostproxy_common.hostsrv_port, &msg);
+
+	if (ret)
+		return ret;
+
+	return msg.o.io.err;
+}
+
+
+int hostproxy_trace(usb_trace_t *trace, void *buffer, size_t size)
+{
+	msg_t msg = { 0 };
+	int ret = 0;
+
+	msg.type = mtDevCtl;
+	usb_msg_t *usb_msg = (usb_msg_t *)msg.i.raw;
+	usb_msg->type = usb_msg_trace;
+	usb_msg->trace = *trace;
+
+	msg.o.data = buffer;
+	msg.o.size = size;
+
+	ret = msgSend(hostproxy_common.hostsrv_port, &msg);
+
+	if (ret)
+		return ret;
+
+	return msg.o.io.err;
+}
+
+
+void *hostproxy_alloc(size_t size)
+{
+	void *buffer;
+
+	buffer = mmap(NULL, hostproxy_pageAlign(size), PROT_WRITE | PROT_READ, MAP_ANONYMOUS | MAP_UNCACHED | MAP_CONTIGUOUS, OID_NULL, 0);
+
+	return buffer == MAP_FAILED ? NULL : buffer;
+}
+
+
+void hostproxy_free(void *buffer, size_t size)
+{
+	munmap(buffer, hostproxy_pageAlign(size));
+}
+
+
+int hostproxy_register(void *buffer, size_t size)
+{
+	msg_t msg = { 0 };
+	int ret = 0, i;
+
+	mutexLock(hostproxy_common.region_lock);
+	for (i = 0; i < HOSTPROXY_REGIONS; ++i) {
+		if (hostproxy_common.regions[i].base == NULL)
+			break;
+	}
+
+	if (i == HOSTPROXY_REGIONS) {
+		mutexUnlock(hostproxy_common.region_lock);
+		return -ENOSPC;
+	}
+
+	/* Reserve the slot, the region becomes visible once it has an id */
+	hostproxy_common.regions[i].base = buffer;
+	hostproxy_common.regions[i].size = hostproxy_pageAlign(size);
+	mutexUnlock(hostproxy_common.region_lock);
+
+	msg.type = mtDevCtl;
+	usb_msg_t *usb_msg = (usb_msg_t *)msg.i.raw;
+	usb_msg->type = usb_msg_register;
+	usb_msg->region.paddr = va2pa(buffer);
+	usb_msg->region.size = hostproxy_pageAlign(size);
+
+	if ((ret = msgSend(hostproxy_common.hostsrv_port, &msg)) == 0)
+		ret = msg.o.io.err;
+
+	mutexLock(hostproxy_common.region_lock);
+	if (ret > 0)
+		hostproxy_common.regions[i].id = ret;
+	else
+		hostproxy_common.regions[i].base = NULL;
+	mutexUnlock(hostproxy_common.region_lock);
+
+	return ret;
+}
+
+
+int hostproxy_unregister(int region)
+{
+	msg_t msg = { 0 };
+	int ret = 0, i;
+
+	msg.type = mtDevCtl;
+	usb_msg_t *usb_msg = (usb_msg_t *)msg.i.raw;
+	usb_msg->type = usb_msg_unregister;
+	usb_msg->region.id = region;
+
+	if ((ret = msgSend(hostproxy_common.hostsrv_port, &msg)) == 0)
+		ret = msg.o.io.err;
+
+	if (ret < 0)
+		return ret;
+
+	mutexLock(hostproxy_common.region_lock);
+	for (i = 0; i < HOSTPROXY_REGIONS; ++i) {
+		if (hostproxy_common.regions[i].id == region) {
+			hostproxy_common.regions[i].id = 0;
+			hostproxy_common.regions[i].base = NULL;
+			break;
+		}
+	}
+	mutexUnlock(hostproxy_common.region_lock);
+
+	return 0;
+}
+
+
+int hostproxy_rings(unsigned entries)
+{
+	msg_t msg = { 0 };
+	usb_rings_t *rings;
+	size_t size;
+	int ret = 0;
+
+	if (!entries || (entries & (entries - 1)))
+		return -EINVAL;
+
+	size = hostproxy_pageAlign(sizeof(usb_rings_t) + entries * (sizeof(usb_urb_t) + sizeof(usb_event_t)));
+
+	if ((rings = hostproxy_alloc(size)) == NULL)
+		return -ENOMEM;
+
+	memset(rings, 0, size);
+	rings->sq.size = rings->cq.size = entries;
+	rings->sq.idle = rings->cq.idle = 1;
+
+	msg.type = mtDevCtl;
+	usb_msg_t *usb_msg = (usb_msg_t *)msg.i.raw;
+	usb_msg->type = usb_msg_rings;
+	usb_msg->region.paddr = va2pa(rings);
+	usb_msg->region.size = size;
+
+	if ((ret = msgSend(hostproxy_common.hostsrv_port, &msg)) == 0)
+		ret = msg.o.io.err;
+
+	if (ret < 0) {
+		hostproxy_free(rings, size);
+		return ret;
+	}
+
+	mutexLock(hostproxy_common.ring_lock);
+	hostproxy_common.sqes = (usb_urb_t *)(rings + 1);
+	hostproxy_common.cqes = (usb_event_t *)(hostproxy_common.sqes + entries);
+	hostproxy_common.rings = rings;
+	mutexUnlock(hostproxy_common.ring_lock);
+
+	return 0;
+}
+
+
 int hostproxy_exit(void)
 {
 	msg_t msg = { 0 };
@@ -245,6 +821,8 @@ int hostproxy_exit(void)
 
 	ret |= resourceDestroy(hostproxy_common.cond);
 	ret |= resourceDestroy(hostproxy_common.lock);
+	ret |= resourceDestroy(hostproxy_common.region_lock);
+	ret |= resourceDestroy(hostproxy_common.ring_lock);
 
 	return ret ? -1 : 0;
 }
@@ -38,12 +38,59 @@ int hostproxy_write(usb_urb_t *urb, void *data, size_t size);
 int hostproxy_read(usb_urb_t *urb, void *data, size_t size);
 
 
+/* Queues count URBs in one message, urbs[i] data is data[i]. Waits for synchronous ones.
+ * With rings set up a vector of async URBs not carrying data in the message is posted to them instead */
+int hostproxy_submitv(usb_urb_t *urbs, void **data, unsigned count);
+
+
+/* Submits urb with its data scattered over count buffers of one registered region, no data is copied.
+ * All buffers but the last must be a multiple of the endpoint's wMaxPacketSize long */
+int hostproxy_submitsg(usb_urb_t *urb, void **buffers, size_t *sizes, unsigned count);
+
+
+/* Cancels an async URB by the transfer id returned on submission, it completes with error 1 */
+int hostproxy_cancel(int handle);
+
+
 int hostproxy_reset(int deviceId);
 
 
 int hostproxy_clear(void);
 
 
+int hostproxy_stats(usb_stats_t *stats);
+
+
+/* Fills stats with the device totals followed by per pipe statistics as far as size allows, returns the number of pipes */
+int hostproxy_deviceStats(int deviceId, usb_device_stats_t *stats, size_t size);
+
+
+/* Optionally starts or stops URB capture, moves pending pcap records to buffer and returns their size in bytes */
+int hostproxy_capture(usb_capture_t *capture, void *buffer, size_t size);
+
+
+/* Optionally sets the trace mask and copies the trace dump (usb_trace_header_t and rings) to buffer */
+int hostproxy_trace(usb_trace_t *trace, void *buffer, size_t size);
+
+
+/* Allocates memory suitable for registering with hostsrv */
+void *hostproxy_alloc(size_t size);
+
+
+void hostproxy_free(void *buffer, size_t size);
+
+
+/* Shares buffer with hostsrv, URB data inside it is not copied. Returns region id */
+int hostproxy_register(void *buffer, size_t size);
+
+
+int hostproxy_unregister(int region);
+
+
+/* Sets up submission/completion rings with hostsrv, async URBs are posted through them */
+int hostproxy_rings(unsigned entries);
+
+
 int hostproxy_exit(void);
 
 
@@ -24,46 +24,144 @@
 #include <string.h>
 #include <errno.h>
 #include <syslog.h>
+#include <unistd.h>
 
 #include <posix/idtree.h>
 #include <posix/utils.h>
 
 #include <dma.h>
 #include <ehci.h>
+#include "ehci_ext.h"
 
 #include <usb.h>
 #include "hostsrv.h"
+#include "pool.h"
+#include "wheel.h"
+#include "hub.h"
+#include "cache.h"
+#include "match.h"
+#include "periodic.h"
+#include "trace.h"
+#include "capture.h"
 
 
 #define FUN_TRACE  //fprintf(stderr, "hostsrv trace: %s\n", __PRETTY_FUNCTION__)
 #define TRACE(x, ...) //fprintf(stderr, "hostsrv: " x "\n", ##__VA_ARGS__)
 #define TRACE_FAIL(x, ...) syslog(LOG_WARNING, x, ##__VA_ARGS__)
 
+#define HOSTSRV_TRANSFERS 64
+#define HOSTSRV_QTDS 256
+#define HOSTSRV_REQUESTS 64
+#define HOSTSRV_QHS 32
+
+/* Trace events recorded from start, every event type where stamps are cheap, none where each one is a syscall */
+#define HOSTSRV_TRACE_MASK (TRACE_CYCLES ? (1u << usb_trace_types) - 1 : 0)
+
+/* Retired QHs kept for reuse where the controller has a doorbell, periodic ones are reclaimed after a grace period of a few frames */
+#define HOSTSRV_QH_WARM 16
+#define HOSTSRV_QH_GRACE_US 2000
+
+#define HOSTSRV_BUFFERS_64 32
+#define HOSTSRV_BUFFERS_512 16
+#define HOSTSRV_BUFFERS_4K 16
+#define HOSTSRV_BUFFERS_16K 4
+
+#define HOSTSRV_TICK_US 1000
+#define HOSTSRV_CONTROL_TIMEOUT_US 5000000
+
+#define HOSTSRV_ENUM_THREADS 2
+#define HOSTSRV_STACK_SIZE 0x4000
+#define HOSTSRV_DEBOUNCE_US 100000
+#define HOSTSRV_RESET_POLLS 10
+#define HOSTSRV_RESET_POLL_US 10000
+#define HOSTSRV_HUB_PORTS 255
+#define HOSTSRV_CACHE_ENTRIES 16
+#define HOSTSRV_CACHE_FLUSH_US 1000000
+#define HOSTSRV_MATCH_BUCKETS 64
+#define HOSTSRV_TAG_BUCKETS 64
+
+/* Transfer type in bmAttributes of an endpoint descriptor */
+#define HOSTSRV_EP_ISOCHRONOUS 1
+#define HOSTSRV_EP_INTERRUPT 3
+#define HOSTSRV_LANGID_EN_US 0x0409
+
+/* Transfer handle is generation << HOSTSRV_HANDLE_BITS | index, never 0 and below USB_TAG */
+#define HOSTSRV_HANDLE_BITS 12
+#define HOSTSRV_HANDLE_NONE ((unsigned)-1)
+#define HOSTSRV_GENERATION_MASK ((1u << (30 - HOSTSRV_HANDLE_BITS)) - 1)
+
 
 pid_t telit = 0;
 
+typedef struct {
+	idnode_t linkage;
+	void *vaddr;
+	size_t size;
+	unsigned pending;
+} usb_shm_t;
+
+
 typedef struct {
 	rbnode_t linkage;
 	unsigned pid;
 	unsigned port;
 	usb_device_id_t filter;
 	struct usb_device *devices;
+	idtree_t regions;
+
+	/* Shared submission/completion rings (NULL - messages only) */
+	usb_rings_t *rings;
+	usb_urb_t *sqes;
+	usb_event_t *cqes;
+	unsigned sq_size, cq_size;
+	handle_t sq_lock, cq_lock;
 } usb_driver_t;
 
 
 typedef struct usb_endpoint {
 	struct usb_endpoint *next, *prev;
+	struct usb_endpoint *active_next, *active_prev;
 	idnode_t linkage;
 
 	struct usb_device *device;
 
 	int max_packet_len;
 	int number;
+	int type;
+	int in;
+
+	/* Interrupt endpoints only (period 0 - not in the periodic schedule) */
+	periodic_slot_t slot;
+
+	/* Packets per microframe and bytes per service interval, above 1 for high bandwidth endpoints only */
+	int mult;
+	unsigned stride;
 
 	struct qh *qh;
+
+	/* In-flight transfers in submission order, protected by sched_lock */
+	struct usb_transfer *transfers;
+
+	/* Cancelled transfers wait with the QH out of the schedule until the controller lets go of it */
+	struct usb_endpoint *abort_next, *abort_prev;
+	int aborting;
+	unsigned doorbell;
+	time_t expires;
+	usb_pipe_stats_t stats;
 } usb_endpoint_t;
 
 
+typedef struct {
+	int pipe;
+	int nports;
+	size_t status_size;
+	uint8_t status[(HOSTSRV_HUB_PORTS + 8) / 8];
+
+	/* Protected by hostsrv_common.lock */
+	struct usb_device *children[];
+} usb_hub_t;
+
+
 typedef struct usb_device {
 	struct usb_device *next, *prev;
 	idnode_t linkage;
@@ -76,9 +174,55 @@ typedef struct usb_device {
 	char address;
 	idtree_t pipes;
 	int speed;
+
+	/* Upstream hub and its port (NULL - root port) */
+	struct usb_device *parent;
+	int port;
+
+	/* Transaction translator for full/low speed behind a high speed hub (0 - none) */
+	int tt_address, tt_port;
+
+	/* Downstream ports (NULL - not a hub) */
+	usb_hub_t *hub;
+
+	cache_key_t key;
+
+	int attached;
+	handle_t lock;
+	int refs;
 } usb_device_t;
 
 
+/* Deferred response, shared by all synchronous URBs of a message */
+typedef struct {
+	msg_t msg;
+	unsigned port;
+	unsigned rid;
+	unsigned pending;
+	int err;
+
+	/* Internal requests call back instead of responding */
+	void (*callback)(void *arg, int err);
+	void *arg;
+} usb_request_t;
+
+
+/* Where the outcome of a synchronous URB goes */
+typedef struct {
+	usb_request_t *request;
+	void *data;
+	size_t size;
+	int *result;
+} usb_reply_t;
+
+
+typedef struct {
+	struct usb_transfer *transfer;
+	unsigned generation;
+	unsigned next;
+} usb_handle_t;
+
+
 typedef struct usb_qtd_list {
 	struct usb_qtd_list *next, *prev;
 	struct qtd *qtd;
@@ -89,13 +233,24 @@ typedef struct usb_qtd_list {
 typedef struct usb_transfer {
 	struct usb_transfer *next, *prev;
 	struct usb_transfer *finished_next, *finished_prev;
+	struct usb_transfer *tag_next, *tag_prev;
 	struct usb_endpoint *endpoint;
 
 	unsigned async;
 	unsigned id;
-	handle_t cond;
+	int handle;
+	usb_driver_t *driver;
+	usb_request_t *request;
+	usb_reply_t reply;
+	usb_shm_t *shm;
+	handle_t cond, sync_cond;
 	volatile int finished;
-	volatile int aborted;
+	volatile int aborted; /* 1 - aborted, -ETIMEDOUT - timed out */
+	int cancel; /* Value of aborted once the QH is safe to edit */
+	int posted;
+	int periodic;
+	unsigned segments;
+	time_t submitted;
 
 	void *transfer_buffer;
 	size_t transfer_size;
@@ -104,22 +259,88 @@ typedef struct usb_transfer {
 	usb_setup_packet_t *setup;
 
 	usb_qtd_list_t *qtds;
+	wheel_timer_t timer;
 } usb_transfer_t;
 
 
+/* QH waiting for the controller to drop it, or kept warm for reuse */
+typedef struct usb_qh {
+	struct usb_qh *next, *prev;
+	struct qh *qh;
+	time_t expires;
+	unsigned doorbell;
+} usb_qh_t;
+
+
+
+enum { enum_acquire, enum_reset, enum_resetWait, enum_resetPoll, enum_resetStatus, enum_resetDone,
+	enum_descriptor, enum_descriptorDone, enum_address, enum_addressDone, enum_readdress, enum_readdressDone,
+	enum_serial, enum_config, enum_store, enum_connect,
+	enum_hubConfigure, enum_hubOpen, enum_hubPower, enum_hubPowerPort, enum_hubListen,
+	enum_hubEvent, enum_hubOverCurrent, enum_hubPort, enum_hubPortStatus, enum_hubPortClear, enum_hubPortConnect };
+
+
+/* Enumeration of a connected device, reset of an addressed one or a hub status change,
+ * advanced one control stage at a time */
+typedef struct usb_enum {
+	struct usb_enum *next, *prev;
+	usb_device_t *device;
+	usb_driver_t *driver;
+
+	int state;
+	int err;
+	int resets, polls;
+	int readdress, port, pipe;
+	wheel_timer_t timer;
+
+	usb_port_status_t status;
+	usb_endpoint_desc_t endpoint;
+	usb_configuration_desc_t header;
+	usb_string_desc_t serial;
+	void *configuration;
+} usb_enum_t;
+
+
 static struct {
-	usb_transfer_t *active_transfers;
-	usb_transfer_t *finished_transfers;
+	usb_endpoint_t *active_endpoints;
+	usb_transfer_t *finished_transfers, *replies;
+	usb_endpoint_t *aborting;
 	usb_device_t *orphan_devices;
+	usb_device_t *root;
 
 	rbtree_t drivers;
+	match_t matches;
 	idtree_t devices;
 	unsigned port;
 
-	handle_t common_lock;
-	handle_t async_cond, port_cond, reset_cond;
+	/* Lock order: lock -> usb_device_t.lock -> sched_lock */
+	handle_t lock;
+	handle_t sched_lock;
+	handle_t async_cond, reply_cond, port_cond, reset_cond, timer_cond, job_cond;
 
+	int port_change;
 	usb_device_t *reset_device;
+
+	pool_buf_t buffers;
+
+	/* Protected by sched_lock */
+	pool_t transfers, qtds, requests, qhs;
+	usb_qh_t *qhs_retired, *qhs_warm;
+	unsigned qhs_warm_count;
+	unsigned completions, batches;
+	usb_handle_t *handles;
+	unsigned handles_size, free_handle;
+	usb_transfer_t *tags[HOSTSRV_TAG_BUCKETS];
+	wheel_t timers, delays;
+	periodic_t periodic;
+	int async_interrupt;
+	capture_t capture;
+	usb_enum_t *enum_ready, *enum_waiting;
+	void *default_owner;
+
+	/* Used by hostsrv_signalThread only */
+	char *batch;
+	size_t batch_size;
 } hostsrv_common;
 
 
@@ -127,794 +348,3020 @@ usb_qtd_list_t *hostsrv_allocQtd(int token, char *buffer, size_t *size, int data
 {
 	//FUN_TRACE;
 
-	usb_qtd_list_t *element = malloc(sizeof(usb_qtd_list_t));
+	usb_qtd_list_t *element;
 
-	if ((element->qtd = ehci_allocQtd(token, buffer, size, datax)) == NULL)
+	if ((element = pool_alloc(&hostsrv_common.qtds)) == NULL)
 		return NULL;
 
+	if ((element->qtd = ehci_allocQtd(token, buffer, size, datax)) == NULL) {
+		pool_free(&hostsrv_common.qtds, element);
+		return NULL;
+	}
+
 	element->size = ehci_qtdRemainingBytes(element->qtd);
 
 	return element;
 }
 
 
-void hostsrv_addQtd(usb_transfer_t *transfer, int token, void *buffer, size_t *size, int datax)
+int hostsrv_addQtd(usb_transfer_t *transfer, int token, void *buffer, size_t *size, int datax)
 {
 	//FUN_TRACE;
 
-	usb_qtd_list_t *el = hostsrv_allocQtd(token, buffer, size, datax);
+	usb_qtd_list_t *el;
+
+	if ((el = hostsrv_allocQtd(token, buffer, size, datax)) == NULL)
+		return -ENOMEM;
 
 	TRACE("allocated %p qtd", el->qtd);
 	LIST_ADD(&transfer->qtds, el);
+
+	return EOK;
+}
+
+
+/* Adds data qTDs for size bytes at buffer, datax follows the toggle over every packet */
+int hostsrv_addData(usb_transfer_t *transfer, int token, char *buffer, size_t size, int *datax)
+{
+	size_t remaining_size = size, chunk;
+	int max_packet = transfer->endpoint->max_packet_len, err = EOK;
+
+	while (remaining_size && err == EOK) {
+		chunk = remaining_size;
+		err = hostsrv_addQtd(transfer, token, buffer + size - remaining_size, &remaining_size, *datax);
+		chunk -= remaining_size;
+
+		if (((chunk + max_packet - 1) / max_packet) & 1)
+			*datax = !*datax;
+	}
+
+	return err;
+}
+
+
+void hostsrv_transferCtor(void *object)
+{
+	condCreate(&((usb_transfer_t *)object)->sync_cond);
+}
+
+
+void hostsrv_transferDtor(void *object)
+{
+	resourceDestroy(((usb_transfer_t *)object)->sync_cond);
+}
+
+
+/* Must be called with sched_lock held */
+int hostsrv_allocHandle(usb_transfer_t *transfer)
+{
+	usb_handle_t *handles;
+	unsigned i, size;
+
+	if (hostsrv_common.free_handle == HOSTSRV_HANDLE_NONE) {
+		if ((size = 2 * hostsrv_common.handles_size) < 64)
+			size = 64;
+
+		if (size > 1u << HOSTSRV_HANDLE_BITS)
+			size = 1u << HOSTSRV_HANDLE_BITS;
+
+		if (size == hostsrv_common.handles_size || (handles = realloc(hostsrv_common.handles, size * sizeof(*handles))) == NULL)
+			return -ENOMEM;
+
+		for (i = hostsrv_common.handles_size; i < size; ++i) {
+			handles[i].transfer = NULL;
+			handles[i].generation = 1;
+			handles[i].next = i + 1 < size ? i + 1 : HOSTSRV_HANDLE_NONE;
+		}
+
+		hostsrv_common.free_handle = hostsrv_common.handles_size;
+		hostsrv_common.handles = handles;
+		hostsrv_common.handles_size = size;
+	}
+
+	i = hostsrv_common.free_handle;
+	hostsrv_common.free_handle = hostsrv_common.handles[i].next;
+	hostsrv_common.handles[i].transfer = transfer;
+	transfer->handle = hostsrv_common.handles[i].generation << HOSTSRV_HANDLE_BITS | i;
+
+	return EOK;
+}
+
+
+/* Must be called with sched_lock held */
+void hostsrv_freeHandle(int handle)
+{
+	usb_handle_t *entry = &hostsrv_common.handles[handle & ((1 << HOSTSRV_HANDLE_BITS) - 1)];
+
+	/* Stale handles stop matching once the generation moves on */
+	entry->transfer = NULL;
+	if (!(entry->generation = (entry->generation + 1) & HOSTSRV_GENERATION_MASK))
+		entry->generation = 1;
+
+	entry->next = hostsrv_common.free_handle;
+	hostsrv_common.free_handle = entry - hostsrv_common.handles;
+}
+
+
+/* Must be called with sched_lock held */
+usb_transfer_t *hostsrv_findHandle(int handle)
+{
+	unsigned i = handle & ((1 << HOSTSRV_HANDLE_BITS) - 1);
+
+	if (handle <= 0 || i >= hostsrv_common.handles_size || hostsrv_common.handles[i].generation != (unsigned)handle >> HOSTSRV_HANDLE_BITS)
+		return NULL;
+
+	return hostsrv_common.handles[i].transfer;
+}
+
+
+/* Tagged transfers are hashed by tag for cancels */
+usb_transfer_t **hostsrv_tagBucket(unsigned tag)
+{
+	return &hostsrv_common.tags[tag * 0x9e3779b1 % HOSTSRV_TAG_BUCKETS];
 }
 
 
-usb_transfer_t *hostsrv_allocTransfer(usb_endpoint_t *endpoint, int direction, int transfer_type, void *buffer, size_t size, int async)
+/* Must be called with sched_lock held */
+void hostsrv_addTag(usb_transfer_t *transfer)
+{
+	LIST_ADD_EX(hostsrv_tagBucket(transfer->id), transfer, tag_next, tag_prev);
+}
+
+
+/* Must be called with sched_lock held */
+usb_transfer_t *hostsrv_findTag(usb_driver_t *driver, int tag)
+{
+	usb_transfer_t *transfer, *first = *hostsrv_tagBucket(tag);
+
+	if ((transfer = first) != NULL) {
+		do {
+			if (transfer->id == (unsigned)tag && transfer->driver == driver)
+				return transfer;
+		}
+		while ((transfer = transfer->tag_next) != first);
+	}
+
+	return NULL;
+}
+
+
+usb_transfer_t *hostsrv_allocTransfer(usb_endpoint_t *endpoint, int direction, int transfer_type, void *buffer, size_t size, int async, usb_reply_t *reply)
 {
 	//FUN_TRACE;
 
 	usb_transfer_t *result;
 
-	result = malloc(sizeof(usb_transfer_t));
+	if ((result = pool_alloc(&hostsrv_common.transfers)) == NULL)
+		return NULL;
+
+	if (hostsrv_allocHandle(result) < 0) {
+		pool_free(&hostsrv_common.transfers, result);
+		return NULL;
+	}
+
+	if (reply != NULL) {
+		result->reply = *reply;
+		result->request = reply->request;
+	}
+	else {
+		result->request = NULL;
+	}
 
 	result->next = result->prev = NULL;
 	result->finished_next = result->finished_prev = NULL;
+	result->tag_next = result->tag_prev = NULL;
 	result->endpoint = endpoint;
 	result->async = async;
-	result->id = (unsigned)result;
+	result->id = result->handle;
+	result->driver = NULL;
 	result->transfer_type = transfer_type;
 	result->direction = direction;
 	result->finished = 0;
 	result->aborted = 0;
+	result->cancel = 0;
+	result->periodic = 0;
+	result->segments = 0;
 
-	if (async)
+	if (reply != NULL)
+		result->cond = hostsrv_common.reply_cond;
+	else if (async)
 		result->cond = hostsrv_common.async_cond;
 	else
-		condCreate(&result->cond);
+		result->cond = result->sync_cond;
 
 	result->transfer_buffer = buffer;
 	result->transfer_size = size;
+	result->shm = NULL;
 	result->setup = NULL;
 	result->qtds = NULL;
+	result->timer.slot = NULL;
 	return result;
 }
 
 
-void hostsrv_deleteTransfer(usb_transfer_t *transfer)
+void hostsrv_freeQtds(usb_transfer_t *transfer)
 {
-	//FUN_TRACE;
-
 	usb_qtd_list_t *element, *next;
 
-	if (transfer->setup != NULL)
-		dma_free64(transfer->setup);
-
 	if ((element = transfer->qtds) != NULL) {
 		do {
 			next = element->next;
 			ehci_freeQtd(element->qtd);
-			free(element);
+			pool_free(&hostsrv_common.qtds, element);
 		}
 		while ((element = next) != transfer->qtds);
 	}
 
-	if (!transfer->async)
-		resourceDestroy(transfer->cond);
-
-	free(transfer);
+	transfer->qtds = NULL;
 }
 
 
-void hostsrv_linkTransfer(usb_endpoint_t *endpoint, usb_transfer_t *transfer)
+void hostsrv_deleteTransfer(usb_transfer_t *transfer)
 {
-	FUN_TRACE;
-
-	usb_qtd_list_t *qtd = transfer->qtds;
-	int address, speed;
+	//FUN_TRACE;
 
-	address = endpoint->device == NULL ? 0 : endpoint->device->address;
-	speed = endpoint->device == NULL ? full_speed : endpoint->device->speed;
+	if (transfer->setup != NULL)
+		dma_free64(transfer->setup);
 
-	do {
-		TRACE("linking : %p to %p", qtd->qtd, qtd->next->qtd);
-		ehci_linkQtd(qtd->qtd, qtd->next->qtd);
-		qtd = qtd->next;
-	} while (qtd != transfer->qtds);
+	hostsrv_freeQtds(transfer);
 
-	if (endpoint->qh == NULL) {
-		endpoint->qh = ehci_allocQh(address, endpoint->number, transfer->transfer_type, speed, endpoint->max_packet_len);
-		ehci_linkQh(endpoint->qh);
-	}
+	if (transfer->tag_next != NULL)
+		LIST_REMOVE_EX(hostsrv_tagBucket(transfer->id), transfer, tag_next, tag_prev);
 
-	TRACE("first: %p last: %p", transfer->qtds->qtd, transfer->qtds->prev->qtd);
-	LIST_ADD(&hostsrv_common.active_transfers, transfer);
-	ehci_enqueue(endpoint->qh, transfer->qtds->qtd, transfer->qtds->prev->qtd);
+	if (transfer->handle)
+		hostsrv_freeHandle(transfer->handle);
+	pool_free(&hostsrv_common.transfers, transfer);
 }
 
 
-int hostsrv_finished(usb_transfer_t *transfer)
+/* Must be called with sched_lock held */
+void hostsrv_armTimer(wheel_t *wheel, wheel_timer_t *timer, unsigned timeout_us)
 {
-	if (transfer->aborted)
-		return 1;
-
-	usb_qtd_list_t *qtd = transfer->qtds;
-	int finished = ehci_qtdFinished(qtd->prev->qtd);
-	int error = 0;
-
-	do {
-		if (ehci_qtdError(qtd->qtd)) {
-			TRACE_FAIL("transaction error");
-			error++;
-		}
+	time_t now;
 
-		if (ehci_qtdBabble(qtd->qtd)) {
-			TRACE_FAIL("babble");
-			error++;
-		}
+	gettime(&now, NULL);
 
-		qtd = qtd->next;
-	} while (qtd != transfer->qtds);
+	/* An empty wheel is not ticking, bring it up to date and wake the timer thread */
+	if (!wheel->count) {
+		wheel_advance(wheel, now / HOSTSRV_TICK_US, NULL);
+		condSignal(hostsrv_common.timer_cond);
+	}
 
-	return error ? -1 : finished;
+	wheel_add(wheel, timer, (now + timeout_us + HOSTSRV_TICK_US - 1) / HOSTSRV_TICK_US);
 }
 
 
-int hostsrv_handleUrb(usb_urb_t *urb, usb_driver_t *driver, usb_device_t *device, usb_endpoint_t *endpoint, void *buffer)
+/* Must be called with sched_lock held */
+void hostsrv_linkQh(usb_endpoint_t *endpoint)
 {
-	FUN_TRACE;
+	periodic_slot_t *slot = &endpoint->slot;
 
-	usb_transfer_t *transfer;
-	size_t remaining_size;
-	int datax = 1;
-	char *transfer_buffer;
-	int data_token = urb->direction == usb_transfer_out ? out_token : in_token;
-	int control_token = data_token == out_token ? in_token : out_token;
+	/* Without periodic schedule support interrupt QHs are polled like bulk ones */
+	if (slot->period && ehci_linkPeriodicQh != NULL)
+		ehci_linkPeriodicQh(endpoint->qh, periodic_frames(slot), periodic_frame(slot), slot->smask, slot->cmask);
+	else
+		ehci_linkQh(endpoint->qh);
+}
 
 
-	transfer = hostsrv_allocTransfer(endpoint, urb->direction, urb->type /* FIXME: should explicitly use enum from ehci.h */, buffer, urb->transfer_size, urb->async);
+/* Must be called with sched_lock held */
+void hostsrv_unlinkQh(usb_endpoint_t *endpoint)
+{
+	if (endpoint->slot.period && ehci_unlinkPeriodicQh != NULL)
+		ehci_unlinkPeriodicQh(endpoint->qh);
+	else
+		ehci_unlinkQh(endpoint->qh);
+}
 
-	if (urb->type == usb_transfer_control) {
-		transfer->setup = dma_alloc64();
-		*transfer->setup = urb->setup;
-		remaining_size = sizeof(usb_setup_packet_t);
-		hostsrv_addQtd(transfer, setup_token, transfer->setup, &remaining_size, 0);
-	}
 
-	remaining_size = transfer->transfer_size;
+int hostsrv_countBytes(usb_transfer_t *transfer);
 
-	while (remaining_size) {
-		transfer_buffer = (char *)transfer->transfer_buffer + transfer->transfer_size - remaining_size;
-		hostsrv_addQtd(transfer, data_token, transfer_buffer, &remaining_size, datax);
-		datax = !datax;
-	}
 
-	if (urb->type == usb_transfer_control) {
-		hostsrv_addQtd(transfer, control_token, NULL, NULL, 1);
-	}
+/* Must be called with sched_lock held */
+void hostsrv_captureUrb(usb_transfer_t *transfer, char type, int status)
+{
+	static const uint8_t types[] = { capture_control, capture_interrupt, capture_bulk, capture_iso };
+	usb_endpoint_t *endpoint = transfer->endpoint;
+	usb_device_t *device = endpoint->device;
+	int in = transfer->direction == usb_transfer_in;
+	capture_usbmon_t usbmon;
+	const void *data = NULL;
+	time_t now;
+
+	if (!capture_wants(&hostsrv_common.capture, device == NULL ? -1 : idtree_id(&device->linkage), endpoint->number))
+		return;
 
-	if (transfer->qtds == NULL) {
-		hostsrv_deleteTransfer(transfer);
-		return EOK;
+	gettime(&now, NULL);
+
+	memset(&usbmon, 0, sizeof(usbmon));
+	usbmon.id = transfer->handle;
+	usbmon.type = type;
+	usbmon.xfer_type = types[transfer->transfer_type];
+	usbmon.epnum = endpoint->number | (in ? 0x80 : 0);
+	usbmon.devnum = device == NULL ? 0 : device->address;
+	usbmon.busnum = 1;
+	usbmon.ts_sec = now / 1000000;
+	usbmon.ts_usec = now % 1000000;
+	usbmon.flag_setup = '-';
+
+	if (type == 'S') {
+		usbmon.status = CAPTURE_EINPROGRESS;
+		usbmon.length = transfer->transfer_size;
+
+		if (transfer->setup != NULL) {
+			usbmon.flag_setup = 0;
+			memcpy(usbmon.setup, transfer->setup, sizeof(usbmon.setup));
+		}
+	}
+	else {
+		if (transfer->aborted == -ETIMEDOUT)
+			usbmon.status = CAPTURE_ETIMEDOUT;
+		else if (transfer->aborted)
+			usbmon.status = CAPTURE_ECONNRESET;
+		else if (status == -EOVERFLOW)
+			usbmon.status = CAPTURE_EOVERFLOW;
+		else if (status < 0)
+			usbmon.status = CAPTURE_EIO;
+		else
+			usbmon.length = hostsrv_countBytes(transfer) - (transfer->setup != NULL ? sizeof(usb_setup_packet_t) : 0);
 	}
 
-	hostsrv_linkTransfer(endpoint, transfer);
-
-	/* TODO; dont wait here */
-	if (!transfer->async) {
-		while (!transfer->finished && !transfer->aborted)
-			condWait(transfer->cond, hostsrv_common.common_lock, 0);
-
-		LIST_REMOVE(&hostsrv_common.active_transfers, transfer);
-		hostsrv_deleteTransfer(transfer);
+	/* Data goes with OUT submissions and IN completions, scattered buffers are not captured */
+	if ((type == 'S' ? !in : in && usbmon.status == 0) && !transfer->segments)
+		data = transfer->transfer_buffer;
 
-		if (transfer->aborted || transfer->finished < 0)
-			return -EIO;
+	usbmon.flag_data = data != NULL ? 0 : (in ? '<' : '>');
 
-		return EOK;
-	}
-	else {
-		return transfer->id;
-	}
+	capture_record(&hostsrv_common.capture, &usbmon, data, usbmon.length);
 }
 
 
-int hostsrv_submitUrb(int pid, usb_urb_t *urb, void *inbuf, void *outbuf)
+/* Recycles retired QHs the controller is done with, must be called with sched_lock held */
+void hostsrv_reclaimQhs(void)
 {
-	FUN_TRACE;
+	usb_qh_t *entry;
+	time_t now;
 
-	usb_driver_t find, *driver;
-	usb_device_t *device;
-	usb_endpoint_t *endpoint;
+	if (hostsrv_common.qhs_retired == NULL)
+		return;
 
-	void *buffer = NULL;
+	gettime(&now, NULL);
 
-	find.pid = pid;
+	/* Retired in order, the first one not ready holds up the rest */
+	while ((entry = hostsrv_common.qhs_retired) != NULL) {
+		if (entry->doorbell ? (int)(ehci_doorbells() - entry->doorbell) < 0 : now < entry->expires)
+			break;
 
-	if ((driver = lib_treeof(usb_driver_t, linkage, lib_rbFind(&hostsrv_common.drivers, &find.linkage))) == NULL) {
-		TRACE("no driver");
-		return -EINVAL;
-	}
+		LIST_REMOVE(&hostsrv_common.qhs_retired, entry);
 
-	if ((device = lib_treeof(usb_device_t, linkage, idtree_find(&hostsrv_common.devices, urb->device_id))) == NULL) {
-		TRACE("no device");
-		return -EINVAL;
-	}
+		/* Without the doorbell an async QH may still be cached after the grace period, only a new one is safe to set up */
+		if (ehci_qhInit != NULL && ehci_ringDoorbell != NULL && ehci_doorbells != NULL && hostsrv_common.qhs_warm_count < HOSTSRV_QH_WARM) {
+			LIST_ADD(&hostsrv_common.qhs_warm, entry);
+			hostsrv_common.qhs_warm_count++;
+			continue;
+		}
 
-	if ((endpoint = lib_treeof(usb_endpoint_t, linkage, idtree_find(&device->pipes, urb->pipe))) == NULL) {
-		TRACE("no endpoint");
-		return -EINVAL;
+		ehci_freeQh(entry->qh);
+		pool_free(&hostsrv_common.qhs, entry);
 	}
+}
 
-	if (urb->transfer_size) {
-		buffer = mmap(NULL, (urb->transfer_size + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1), PROT_WRITE | PROT_READ, MAP_ANONYMOUS | MAP_UNCACHED, OID_NULL, 0);
-
-		if (buffer == MAP_FAILED) {
-			TRACE("no mem");
-			return -ENOMEM;
-		}
 
-		if (inbuf != NULL)
-			memcpy(buffer, inbuf, urb->transfer_size);
-	}
+/* Must be called with sched_lock held */
+struct qh *hostsrv_allocQh(usb_endpoint_t *endpoint, int transfer_type)
+{
+	usb_device_t *device = endpoint->device;
+	int address = device == NULL ? 0 : device->address;
+	int speed = device == NULL ? full_speed : device->speed;
+	usb_qh_t *entry;
+	struct qh *qh;
 
-	int err = hostsrv_handleUrb(urb, driver, device, endpoint, buffer);
+	hostsrv_reclaimQhs();
 
-	if (outbuf != NULL && urb->direction == usb_transfer_in)
-		memcpy(outbuf, buffer, urb->transfer_size);
+	/* A warm QH only needs to be set up for its new endpoint */
+	if ((entry = hostsrv_common.qhs_warm) != NULL) {
+		LIST_REMOVE(&hostsrv_common.qhs_warm, entry);
+		hostsrv_common.qhs_warm_count--;
 
-	if (buffer != NULL && !urb->async)
-		munmap(buffer, (urb->transfer_size + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1));
+		qh = entry->qh;
+		pool_free(&hostsrv_common.qhs, entry);
+		ehci_qhInit(qh, address, endpoint->number, transfer_type, speed, endpoint->max_packet_len);
+	}
+	else if ((qh = ehci_allocQh(address, endpoint->number, transfer_type, speed, endpoint->max_packet_len)) == NULL) {
+		return NULL;
+	}
 
-	return err;
-}
+	if (endpoint->mult > 1 && ehci_qhSetMult != NULL)
+		ehci_qhSetMult(qh, endpoint->mult);
 
+	if (device != NULL && device->tt_address && ehci_qhSetTT != NULL)
+		ehci_qhSetTT(qh, device->tt_address, device->tt_port);
 
-int hostsrv_setAddress(usb_device_t *dev, unsigned char address);
+	return qh;
+}
 
 
-void hostsrv_resetDevice(usb_device_t *device)
+/* Unlinks the endpoint's QH and queues it for reclamation, must be called with sched_lock held */
+void hostsrv_retireQh(usb_endpoint_t *endpoint)
 {
-	FUN_TRACE;
+	usb_qh_t *entry;
+	time_t now;
 
-	usb_endpoint_t *ep;
-	ehci_unlinkQh(device->control_endpoint->qh);
-	device->control_endpoint->qh = NULL; /* FIXME: leak */
+	if (endpoint->qh == NULL)
+		return;
 
-	if ((ep = device->endpoints) != NULL) {
-		do {
-			if (ep->qh != NULL)
-				ehci_unlinkQh(ep->qh);
-			ep->qh = NULL; /* FIXME: leak */
-		}
-		while ((ep = ep->next) != device->endpoints);
+	/* A QH with aborts pending is already out of the schedule, its transfers go with the endpoint */
+	if (endpoint->aborting) {
+		LIST_REMOVE_EX(&hostsrv_common.aborting, endpoint, abort_next, abort_prev);
+		endpoint->aborting = 0;
+	}
+	else {
+		hostsrv_unlinkQh(endpoint);
 	}
 
-	usb_transfer_t *transfer;
-	if ((transfer = hostsrv_common.active_transfers) != NULL) {
-		do {
-			transfer->aborted = 1;
-			condSignal(transfer->cond);
-		}
-		while ((transfer = transfer->next) != hostsrv_common.active_transfers);
+	if ((entry = pool_alloc(&hostsrv_common.qhs)) == NULL) {
+		TRACE_FAIL("no memory to reclaim a QH");
+		endpoint->qh = NULL;
+		return;
 	}
 
-	ehci_resetPort();
+	gettime(&now, NULL);
+	entry->qh = endpoint->qh;
+	entry->expires = now + HOSTSRV_QH_GRACE_US;
+	entry->doorbell = 0;
 
-	device->address = 0;
-	hostsrv_setAddress(device, 1 + idtree_id(&device->linkage));
-	TRACE("reset: address is set");
-	device->address = 1 + idtree_id(&device->linkage);
-	ehci_qhSetAddress(device->control_endpoint->qh, device->address);
+	/* An async QH may be cached by the controller until the doorbell is answered, a periodic one until the frame ends */
+	if (!endpoint->slot.period && ehci_ringDoorbell != NULL && ehci_doorbells != NULL)
+		entry->doorbell = ehci_ringDoorbell();
+
+	LIST_ADD(&hostsrv_common.qhs_retired, entry);
+	endpoint->qh = NULL;
 }
 
 
-void hostsrv_resetThread(void *arg)
+int hostsrv_linkTransfer(usb_endpoint_t *endpoint, usb_transfer_t *transfer)
 {
-	mutexLock(hostsrv_common.common_lock);
+	FUN_TRACE;
 
-	for (;;) {
-		condWait(hostsrv_common.reset_cond, hostsrv_common.common_lock, 0);
+	usb_qtd_list_t *qtd = transfer->qtds;
+
+	if (endpoint->qh == NULL) {
+		if ((endpoint->qh = hostsrv_allocQh(endpoint, transfer->transfer_type)) == NULL)
+			return -ENOMEM;
+
+		hostsrv_linkQh(endpoint);
+	}
+
+	do {
+		TRACE("linking : %p to %p", qtd->qtd, qtd->next->qtd);
+		ehci_linkQtd(qtd->qtd, qtd->next->qtd);
+		qtd = qtd->next;
+	} while (qtd != transfer->qtds);
+
+	trace_event(usb_trace_link, transfer->handle, endpoint->number);
+
+	gettime(&transfer->submitted, NULL);
+	endpoint->stats.submitted++;
+	if (++endpoint->stats.depth > endpoint->stats.depth_hwm)
+		endpoint->stats.depth_hwm = endpoint->stats.depth;
+
+	hostsrv_captureUrb(transfer, 'S', EOK);
+
+	TRACE("first: %p last: %p", transfer->qtds->qtd, transfer->qtds->prev->qtd);
+	if (endpoint->transfers == NULL)
+		LIST_ADD_EX(&hostsrv_common.active_endpoints, endpoint, active_next, active_prev);
+
+	LIST_ADD(&endpoint->transfers, transfer);
+	ehci_enqueue(endpoint->qh, transfer->qtds->qtd, transfer->qtds->prev->qtd);
+
+	return EOK;
+}
+
+
+int hostsrv_finished(usb_transfer_t *transfer)
+{
+	usb_qtd_list_t *qtd = transfer->qtds;
+
+	/* qTDs are executed in order, nothing past an active one has been touched */
+	do {
+		if (ehci_qtdError(qtd->qtd)) {
+			TRACE_FAIL("transaction error");
+			return -EIO;
+		}
+
+		if (ehci_qtdBabble(qtd->qtd)) {
+			TRACE_FAIL("babble");
+			return -EOVERFLOW;
+		}
+
+		if (!ehci_qtdFinished(qtd->qtd))
+			return 0;
+
+		/* A short packet ends an IN data stage, the qTDs left are skipped by ehci_continue */
+		if (transfer->direction == usb_transfer_in && transfer->transfer_type != usb_transfer_control && qtd != transfer->qtds->prev &&
+			ehci_qtdRemainingBytes(qtd->qtd))
+			return 1;
+
+		qtd = qtd->next;
+	} while (qtd != transfer->qtds);
+
+	return 1;
+}
+
+
+/* Must be called with sched_lock held */
+void hostsrv_countCompletion(usb_pipe_stats_t *stats, usb_transfer_t *transfer, int status)
+{
+	time_t now, latency;
+	unsigned bucket;
+
+	gettime(&now, NULL);
+
+	stats->completed++;
+	stats->depth--;
+
+	if (transfer->aborted == -ETIMEDOUT)
+		stats->timeouts++;
+	else if (transfer->aborted)
+		stats->aborted++;
+	else if (status == -EOVERFLOW)
+		stats->babbles++;
+	else if (status < 0)
+		stats->errors++;
+	else
+		stats->bytes += hostsrv_countBytes(transfer) - (transfer->setup != NULL ? sizeof(usb_setup_packet_t) : 0);
+
+	for (latency = now - transfer->submitted, bucket = 0; latency > 1 && bucket < USB_LATENCY_BUCKETS - 1; latency >>= 1)
+		bucket++;
+
+	stats->latency[bucket]++;
+}
+
+
+/* Puts a completed periodic transfer straight back on its endpoint, returns the copy to deliver the completion from.
+ * The copy takes over the qTDs and the data, it has no handle. Must be called with sched_lock held */
+usb_transfer_t *hostsrv_requeueTransfer(usb_transfer_t *transfer)
+{
+	usb_transfer_t *copy;
+	handle_t cond;
+	void *buffer;
+	int datax = 1;
+
+	if ((copy = pool_alloc(&hostsrv_common.transfers)) == NULL)
+		return NULL;
+
+	if ((buffer = pool_bufAlloc(&hostsrv_common.buffers, transfer->transfer_size)) == NULL) {
+		pool_free(&hostsrv_common.transfers, copy);
+		return NULL;
+	}
+
+	cond = copy->sync_cond;
+	*copy = *transfer;
+	copy->sync_cond = cond;
+	copy->handle = 0;
+	copy->periodic = 0;
+	copy->next = copy->prev = NULL;
+	copy->tag_next = copy->tag_prev = NULL;
+	copy->timer.slot = NULL;
+
+	transfer->qtds = NULL;
+	transfer->transfer_buffer = buffer;
+	transfer->finished = 0;
+
+	if (hostsrv_addData(transfer, in_token, buffer, transfer->transfer_size, &datax) < 0 || hostsrv_linkTransfer(transfer->endpoint, transfer) < 0) {
+		hostsrv_freeQtds(transfer);
+		transfer->qtds = copy->qtds;
+		transfer->transfer_buffer = copy->transfer_buffer;
+		transfer->finished = copy->finished;
+		pool_bufFree(&hostsrv_common.buffers, buffer, transfer->transfer_size);
+		pool_free(&hostsrv_common.transfers, copy);
+		return NULL;
+	}
+
+	return copy;
+}
+
+
+/* Must be called with sched_lock held */
+void hostsrv_retireTransfer(usb_transfer_t *transfer, int status)
+{
+	usb_endpoint_t *endpoint = transfer->endpoint;
+	usb_transfer_t *copy;
+
+	transfer->finished = status;
+	hostsrv_countCompletion(&endpoint->stats, transfer, status);
+	hostsrv_captureUrb(transfer, 'C', status);
+
+	if (wheel_armed(&transfer->timer))
+		wheel_remove(&hostsrv_common.timers, &transfer->timer);
+
+	LIST_REMOVE(&endpoint->transfers, transfer);
+	if (endpoint->transfers == NULL)
+		LIST_REMOVE_EX(&hostsrv_common.active_endpoints, endpoint, active_next, active_prev);
+
+	/* Requeued as soon as it is reaped, so that no poll is missed while the completion is delivered.
+	 * Detach and reset abort the device's transfers under sched_lock, a transfer requeued before that goes with them */
+	if (transfer->periodic && status > 0 && !transfer->aborted && !transfer->cancel) {
+		if ((copy = hostsrv_requeueTransfer(transfer)) != NULL) {
+			LIST_ADD_EX(&hostsrv_common.finished_transfers, copy, finished_next, finished_prev);
+			condBroadcast(transfer->cond);
+			return;
+		}
+
+		TRACE_FAIL("no memory to requeue transfer %x", transfer->id);
+		transfer->periodic = 0;
+	}
+
+	if (transfer->request != NULL)
+		LIST_ADD_EX(&hostsrv_common.replies, transfer, finished_next, finished_prev);
+	else if (transfer->async)
+		LIST_ADD_EX(&hostsrv_common.finished_transfers, transfer, finished_next, finished_prev);
+
+	condBroadcast(transfer->cond);
+}
+
+
+/* With segments the data is scattered over urb->segments parts at offsets from buffer */
+int hostsrv_handleUrb(usb_urb_t *urb, usb_driver_t *driver, usb_device_t *device, usb_endpoint_t *endpoint, void *buffer,
+	const usb_segment_t *segments, usb_shm_t *shm, usb_reply_t *reply)
+{
+	FUN_TRACE;
+
+	usb_transfer_t *transfer;
+	size_t remaining_size;
+	int datax = 1, err = EOK;
+	unsigned i;
+	int data_token = urb->direction == usb_transfer_out ? out_token : in_token;
+	int control_token = data_token == out_token ? in_token : out_token;
+
+	/* Isochronous endpoints need iTDs, which libusbehci does not provide */
+	if (urb->type == usb_transfer_isochronous)
+		return -ENOSYS;
+
+	mutexLock(hostsrv_common.sched_lock);
+	if ((transfer = hostsrv_allocTransfer(endpoint, urb->direction, urb->type /* FIXME: should explicitly use enum from ehci.h */, buffer, urb->transfer_size, urb->async, reply)) == NULL) {
+		mutexUnlock(hostsrv_common.sched_lock);
+		return -ENOMEM;
+	}
+
+	trace_event(usb_trace_urb, transfer->handle, urb->transfer_size);
+
+	transfer->shm = shm;
+	transfer->driver = driver;
+	transfer->segments = segments != NULL ? urb->segments : 0;
+	/* Requeueing polls into a fresh buffer, data in a driver's region would be overwritten before it is read */
+	transfer->periodic = urb->periodic && urb->async && urb->type == usb_transfer_interrupt && urb->direction == usb_transfer_in && shm == NULL;
+
+	if (urb->tag) {
+		transfer->id = urb->tag | USB_TAG;
+		hostsrv_addTag(transfer);
+	}
+
+	if (urb->type == usb_transfer_control) {
+		transfer->setup = dma_alloc64();
+		*transfer->setup = urb->setup;
+		remaining_size = sizeof(usb_setup_packet_t);
+		err = hostsrv_addQtd(transfer, setup_token, transfer->setup, &remaining_size, 0);
+	}
+
+	if (segments == NULL && err == EOK)
+		err = hostsrv_addData(transfer, data_token, transfer->transfer_buffer, transfer->transfer_size, &datax);
+
+	/* Each segment gets its own qTDs, the toggle carries on across them */
+	for (i = 0; segments != NULL && i < urb->segments && err == EOK; ++i)
+		err = hostsrv_addData(transfer, data_token, (char *)buffer + segments[i].offset, segments[i].size, &datax);
+
+	if (urb->type == usb_transfer_control && err == EOK) {
+		err = hostsrv_addQtd(transfer, control_token, NULL, NULL, 1);
+	}
+	/* An empty bulk or interrupt URB is a zero-length packet */
+	else if (transfer->qtds == NULL && err == EOK) {
+		err = hostsrv_addQtd(transfer, data_token, NULL, NULL, datax);
+	}
+
+	if (transfer->qtds == NULL || err < 0) {
+		hostsrv_deleteTransfer(transfer);
+		mutexUnlock(hostsrv_common.sched_lock);
+		return err < 0 ? err : -EINVAL;
+	}
+
+	if ((err = hostsrv_linkTransfer(endpoint, transfer)) < 0) {
+		hostsrv_deleteTransfer(transfer);
+		mutexUnlock(hostsrv_common.sched_lock);
+		return err;
+	}
+
+	if (urb->timeout_us)
+		hostsrv_armTimer(&hostsrv_common.timers, &transfer->timer, urb->timeout_us);
+
+	if (reply != NULL) {
+		/* Response is sent by hostsrv_replyThread once the transfer retires */
+		reply->request->pending++;
+		err = -EINPROGRESS;
+	}
+	else if (!transfer->async) {
+		while (!transfer->finished)
+			condWait(transfer->cond, hostsrv_common.sched_lock, 0);
+
+		if (transfer->aborted < 0)
+			err = transfer->aborted;
+		else if (transfer->aborted || transfer->finished < 0)
+			err = -EIO;
+		else
+			err = EOK;
+
+		hostsrv_deleteTransfer(transfer);
+	}
+	else {
+		err = transfer->id;
+	}
+	mutexUnlock(hostsrv_common.sched_lock);
+
+	return err;
+}
+
+
+usb_device_t *hostsrv_getDevice(int device_id)
+{
+	usb_device_t *device;
+
+	mutexLock(hostsrv_common.lock);
+	if ((device = lib_treeof(usb_device_t, linkage, idtree_find(&hostsrv_common.devices, device_id))) != NULL)
+		device->refs++;
+	mutexUnlock(hostsrv_common.lock);
+
+	return device;
+}
+
+
+void hostsrv_putDevice(usb_device_t *device);
+
+
+void hostsrv_freeDevice(usb_device_t *device)
+{
+	usb_endpoint_t *ep;
+
+	mutexLock(hostsrv_common.sched_lock);
+	while ((ep = device->endpoints) != NULL) {
+		LIST_REMOVE(&device->endpoints, ep);
+		hostsrv_retireQh(ep);
+
+		if (ep->slot.period)
+			periodic_release(&hostsrv_common.periodic, &ep->slot);
+
+		free(ep);
+	}
+
+	if (device->control_endpoint != NULL)
+		hostsrv_retireQh(device->control_endpoint);
+	mutexUnlock(hostsrv_common.sched_lock);
+
+	free(device->control_endpoint);
+	if (device->descriptor != NULL)
+		dma_free64(device->descriptor);
+	free(device->hub);
+	resourceDestroy(device->lock);
+
+	if (device->parent != NULL)
+		hostsrv_putDevice(device->parent);
+
+	free(device);
+}
+
+
+void hostsrv_putDevice(usb_device_t *device)
+{
+	int refs;
+
+	mutexLock(hostsrv_common.lock);
+	refs = --device->refs;
+	mutexUnlock(hostsrv_common.lock);
+
+	if (!refs)
+		hostsrv_freeDevice(device);
+}
+
+
+/* Must be called with hostsrv_common.lock held */
+usb_shm_t *hostsrv_findRegion(usb_driver_t *driver, int region)
+{
+	return lib_treeof(usb_shm_t, linkage, idtree_find(&driver->regions, region - 1));
+}
+
+
+void hostsrv_putRegion(usb_shm_t *shm)
+{
+	if (shm == NULL)
+		return;
+
+	mutexLock(hostsrv_common.lock);
+	shm->pending--;
+	mutexUnlock(hostsrv_common.lock);
+}
+
+
+int hostsrv_register(usb_region_t *region, unsigned pid)
+{
+	FUN_TRACE;
+
+	usb_driver_t find, *driver;
+	usb_shm_t *shm;
+	int id = -EINVAL;
+
+	if (!region->size || ((region->paddr | region->size) & (_PAGE_SIZE - 1)))
+		return -EINVAL;
+
+	if ((shm = malloc(sizeof(*shm))) == NULL)
+		return -ENOMEM;
+
+	shm->size = region->size;
+	shm->pending = 0;
+
+	if ((shm->vaddr = mmap(NULL, shm->size, PROT_WRITE | PROT_READ, MAP_DEVICE | MAP_UNCACHED, OID_PHYSMEM, region->paddr)) == MAP_FAILED) {
+		free(shm);
+		return -ENOMEM;
+	}
+
+	find.pid = pid;
+
+	mutexLock(hostsrv_common.lock);
+	if ((driver = lib_treeof(usb_driver_t, linkage, lib_rbFind(&hostsrv_common.drivers, &find.linkage))) != NULL)
+		id = idtree_alloc(&driver->regions, &shm->linkage);
+	mutexUnlock(hostsrv_common.lock);
+
+	if (id < 0) {
+		munmap(shm->vaddr, shm->size);
+		free(shm);
+		return id;
+	}
+
+	return id + 1;
+}
+
+
+int hostsrv_unregister(usb_region_t *region, unsigned pid)
+{
+	FUN_TRACE;
+
+	usb_driver_t find, *driver;
+	usb_shm_t *shm = NULL;
+	int err = EOK;
+
+	find.pid = pid;
+
+	mutexLock(hostsrv_common.lock);
+	if ((driver = lib_treeof(usb_driver_t, linkage, lib_rbFind(&hostsrv_common.drivers, &find.linkage))) == NULL || (shm = hostsrv_findRegion(driver, region->id)) == NULL)
+		err = -EINVAL;
+	else if (shm->pending)
+		err = -EBUSY;
+	else
+		idtree_remove(&driver->regions, &shm->linkage);
+	mutexUnlock(hostsrv_common.lock);
+
+	if (err < 0)
+		return err;
+
+	munmap(shm->vaddr, shm->size);
+	free(shm);
+
+	return EOK;
+}
+
+
+usb_driver_t *hostsrv_getDriver(unsigned pid)
+{
+	usb_driver_t find, *driver;
+
+	find.pid = pid;
+
+	mutexLock(hostsrv_common.lock);
+	driver = lib_treeof(usb_driver_t, linkage, lib_rbFind(&hostsrv_common.drivers, &find.linkage));
+	mutexUnlock(hostsrv_common.lock);
+
+	return driver;
+}
+
+
+/* Segments must lie in the region, add up to the transfer size and all but the last end on a packet boundary */
+int hostsrv_checkSegments(usb_urb_t *urb, const usb_segment_t *segments, usb_shm_t *shm, usb_endpoint_t *endpoint)
+{
+	size_t size = shm->size - urb->offset, total = 0;
+	unsigned i;
+
+	/* No more segments than packets, transfer_size is not negative past hostsrv_submit */
+	if (urb->segments > (size_t)urb->transfer_size / endpoint->max_packet_len + 1)
+		return -EINVAL;
+
+	for (i = 0; i < urb->segments; ++i) {
+		if (segments[i].offset > size || segments[i].size > size - segments[i].offset)
+			return -EINVAL;
+
+		if (i + 1 < urb->segments && segments[i].size % endpoint->max_packet_len)
+			return -EINVAL;
+
+		total += segments[i].size;
+	}
+
+	return total == (size_t)urb->transfer_size ? EOK : -EINVAL;
+}
+
+
+/* Takes over the device reference and shm, they are released on failure. Data holds the segments of a scatter-gather URB */
+int hostsrv_submitDevice(usb_driver_t *driver, usb_device_t *device, usb_endpoint_t *endpoint, usb_urb_t *urb, void *data, usb_shm_t *shm, usb_reply_t *reply)
+{
+	void *buffer = NULL;
+	int err;
+
+	if (shm != NULL) {
+		/* Zero-copy: the controller accesses the driver's memory directly */
+		buffer = (char *)shm->vaddr + urb->offset;
+	}
+	else if (urb->transfer_size) {
+		if ((buffer = pool_bufAlloc(&hostsrv_common.buffers, urb->transfer_size)) == NULL) {
+			TRACE("no mem");
+			hostsrv_putDevice(device);
+			return -ENOMEM;
+		}
+
+		if (data != NULL && urb->direction == usb_transfer_out)
+			memcpy(buffer, data, urb->transfer_size);
+	}
+
+	/* On success the transfer owns the buffer and the device reference */
+	if ((err = hostsrv_handleUrb(urb, driver, device, endpoint, buffer, urb->segments ? data : NULL, shm, reply)) == -EINPROGRESS || (urb->async && err >= 0))
+		return err;
+
+	if (shm != NULL)
+		hostsrv_putRegion(shm);
+	else if (buffer != NULL)
+		pool_bufFree(&hostsrv_common.buffers, buffer, urb->transfer_size);
+
+	hostsrv_putDevice(device);
+
+	return err;
+}
+
+
+int hostsrv_submit(usb_driver_t *driver, usb_urb_t *urb, void *data, usb_reply_t *reply)
+{
+	FUN_TRACE;
+
+	usb_device_t *device;
+	usb_endpoint_t *endpoint;
+	usb_shm_t *shm = NULL;
+
+	if (urb->transfer_size < 0) {
+		TRACE("bad size");
+		return -EINVAL;
+	}
+
+	if (urb->region) {
+		mutexLock(hostsrv_common.lock);
+		if ((shm = hostsrv_findRegion(driver, urb->region)) != NULL &&
+			urb->offset <= shm->size && (size_t)urb->transfer_size <= shm->size - urb->offset)
+			shm->pending++;
+		else
+			shm = NULL;
+		mutexUnlock(hostsrv_common.lock);
+
+		if (shm == NULL) {
+			TRACE("bad region");
+			return -EINVAL;
+		}
+	}
+
+	if ((device = hostsrv_getDevice(urb->device_id)) == NULL) {
+		TRACE("no device");
+		hostsrv_putRegion(shm);
+		return -EINVAL;
+	}
+
+	mutexLock(device->lock);
+	endpoint = lib_treeof(usb_endpoint_t, linkage, idtree_find(&device->pipes, urb->pipe));
+	mutexUnlock(device->lock);
+
+	if (endpoint == NULL || (urb->segments && (shm == NULL || data == NULL || hostsrv_checkSegments(urb, data, shm, endpoint) < 0))) {
+		TRACE("no endpoint or bad segments");
+		hostsrv_putRegion(shm);
+		hostsrv_putDevice(device);
+		return -EINVAL;
+	}
+
+	return hostsrv_submitDevice(driver, device, endpoint, urb, data, shm, reply);
+}
+
+
+usb_request_t *hostsrv_allocRequest(msg_t *msg, unsigned port, unsigned rid)
+{
+	usb_request_t *request;
+
+	mutexLock(hostsrv_common.sched_lock);
+	request = pool_alloc(&hostsrv_common.requests);
+	mutexUnlock(hostsrv_common.sched_lock);
+
+	if (request == NULL)
+		return NULL;
+
+	/* The submitter holds a reference until all URBs are queued */
+	request->msg = *msg;
+	request->port = port;
+	request->rid = rid;
+	request->pending = 1;
+	request->err = EOK;
+	request->callback = NULL;
+
+	return request;
+}
+
+
+usb_request_t *hostsrv_allocNotify(void (*callback)(void *, int), void *arg)
+{
+	usb_request_t *request;
+
+	mutexLock(hostsrv_common.sched_lock);
+	request = pool_alloc(&hostsrv_common.requests);
+	mutexUnlock(hostsrv_common.sched_lock);
+
+	if (request == NULL)
+		return NULL;
+
+	request->pending = 1;
+	request->err = EOK;
+	request->callback = callback;
+	request->arg = arg;
+
+	return request;
+}
+
+
+/* Responds once the last reference is dropped, err is reported unless an earlier error was */
+void hostsrv_putRequest(usb_request_t *request, int err)
+{
+	unsigned pending;
+
+	mutexLock(hostsrv_common.sched_lock);
+	if (request->err == EOK)
+		request->err = err;
+	pending = --request->pending;
+	mutexUnlock(hostsrv_common.sched_lock);
+
+	if (pending)
+		return;
+
+	if (request->callback != NULL) {
+		request->callback(request->arg, request->err);
+	}
+	else {
+		request->msg.o.io.err = request->err;
+		msgRespond(request->port, &request->msg, request->rid);
+	}
+
+	mutexLock(hostsrv_common.sched_lock);
+	pool_free(&hostsrv_common.requests, request);
+	mutexUnlock(hostsrv_common.sched_lock);
+}
+
+
+int hostsrv_submitUrb(unsigned port, msg_t *msg, unsigned rid)
+{
+	usb_urb_t *urb = &((usb_msg_t *)msg->i.raw)->urb;
+	usb_driver_t *driver;
+	usb_reply_t reply;
+	int err;
+
+	if ((driver = hostsrv_getDriver(msg->pid)) == NULL) {
+		TRACE("no driver");
+		return -EINVAL;
+	}
+
+	if (urb->segments > msg->i.size / sizeof(usb_segment_t))
+		return -EINVAL;
+
+	if (urb->async)
+		return hostsrv_submit(driver, urb, msg->i.data, NULL);
+
+	if ((reply.request = hostsrv_allocRequest(msg, port, rid)) == NULL)
+		return -ENOMEM;
+
+	reply.data = msg->o.data;
+	reply.size = msg->o.size;
+	reply.result = NULL;
+
+	err = hostsrv_submit(driver, urb, msg->i.data, &reply);
+	hostsrv_putRequest(reply.request, err == -EINPROGRESS ? EOK : err);
+
+	return -EINPROGRESS;
+}
+
+
+/*
+ * Message data holds count usb_urb_t followed by OUT data of URBs not using regions
+ * and segments of scatter-gather URBs.
+ * The response holds count results (error or async transfer id) followed by IN data
+ * of synchronous URBs not using regions.
+ */
+int hostsrv_submitv(unsigned port, msg_t *msg, unsigned rid)
+{
+	FUN_TRACE;
+
+	unsigned i, count = ((usb_msg_t *)msg->i.raw)->submitv.count;
+	usb_urb_t *urb = msg->i.data;
+	int *results = msg->o.data;
+	usb_driver_t *driver;
+	usb_reply_t reply;
+	size_t out_size, in_size, size;
+	char *out, *in;
+	void *data;
+	int err, first = EOK;
+
+	if (!count || msg->i.size < count * sizeof(usb_urb_t) || msg->o.size < count * sizeof(int))
+		return -EINVAL;
+
+	if ((driver = hostsrv_getDriver(msg->pid)) == NULL)
+		return -EINVAL;
+
+	if ((reply.request = hostsrv_allocRequest(msg, port, rid)) == NULL)
+		return -ENOMEM;
+
+	out = (char *)(urb + count);
+	out_size = msg->i.size - count * sizeof(usb_urb_t);
+	in = (char *)(results + count);
+	in_size = msg->o.size - count * sizeof(int);
+
+	for (i = 0; i < count; ++i, ++urb) {
+		size = urb->region || urb->transfer_size < 0 ? 0 : urb->transfer_size;
+		data = NULL;
+		err = EOK;
+
+		reply.data = NULL;
+		reply.size = 0;
+		reply.result = &results[i];
+
+		/* Segments of a scatter-gather URB come in place of its OUT data */
+		if (urb->segments) {
+			if (urb->segments > out_size / sizeof(usb_segment_t)) {
+				err = -EINVAL;
+			}
+			else {
+				size = urb->segments * sizeof(usb_segment_t);
+				data = out;
+				out += size;
+				out_size -= size;
+			}
+		}
+		else if (urb->direction == usb_transfer_out && size) {
+			if (size > out_size) {
+				err = -EINVAL;
+			}
+			else {
+				data = out;
+				out += size;
+				out_size -= size;
+			}
+		}
+		else if (urb->direction == usb_transfer_in && size && !urb->async) {
+			if (size > in_size) {
+				err = -EINVAL;
+			}
+			else {
+				reply.data = in;
+				reply.size = size;
+				in += size;
+				in_size -= size;
+			}
+		}
+
+		if (err == EOK && (err = hostsrv_submit(driver, urb, data, urb->async ? NULL : &reply)) == -EINPROGRESS)
+			continue;
+
+		results[i] = err;
+
+		if (err < 0 && first == EOK)
+			first = err;
+	}
+
+	hostsrv_putRequest(reply.request, first);
+
+	return -EINPROGRESS;
+}
+
+
+/* Must be called with driver->cq_lock held */
+int hostsrv_postEvent(usb_driver_t *driver, usb_event_t *event)
+{
+	usb_ring_t *cq = &driver->rings->cq;
+	unsigned tail = cq->tail;
+
+	if (tail - cq->head >= driver->cq_size)
+		return -ENOSPC;
+
+	driver->cqes[tail & (driver->cq_size - 1)] = *event;
+	__sync_synchronize();
+	cq->tail = tail + 1;
+
+	return EOK;
+}
+
+
+/* Must be called with driver->cq_lock held */
+void hostsrv_kickDriver(usb_driver_t *driver)
+{
+	msg_t msg = { 0 };
+
+	/* Pairs with the barrier in hostproxy between setting idle and checking the ring */
+	__sync_synchronize();
+
+	if (!driver->rings->cq.idle)
+		return;
+
+	driver->rings->cq.idle = 0;
+
+	msg.type = mtDevCtl;
+	((usb_event_t *)msg.i.raw)->type = usb_event_kick;
+	msgSend(driver->port, &msg);
+}
+
+
+void hostsrv_postFailure(usb_driver_t *driver, usb_urb_t *urb, int err)
+{
+	usb_event_t event = { 0 };
+
+	event.type = usb_event_completion;
+	event.device_id = urb->device_id;
+	event.completion.transfer_id = urb->tag | USB_TAG;
+	event.completion.pipe = urb->pipe;
+	event.completion.error = err;
+
+	mutexLock(driver->cq_lock);
+	if (hostsrv_postEvent(driver, &event) < 0)
+		TRACE_FAIL("completion ring overflow, URB %u lost", urb->tag);
+	else
+		hostsrv_kickDriver(driver);
+	mutexUnlock(driver->cq_lock);
+}
+
+
+/* Submits everything posted to the driver's submission ring */
+void hostsrv_drainRing(unsigned pid)
+{
+	FUN_TRACE;
+
+	usb_driver_t *driver;
+	usb_ring_t *sq;
+	usb_urb_t urb;
+	unsigned head;
+	int err;
+
+	if ((driver = hostsrv_getDriver(pid)) == NULL || driver->rings == NULL)
+		return;
+
+	sq = &driver->rings->sq;
+
+	mutexLock(driver->sq_lock);
+	for (;;) {
+		while ((head = sq->head) != sq->tail) {
+			__sync_synchronize();
+			urb = driver->sqes[head & (driver->sq_size - 1)];
+			__sync_synchronize();
+			sq->head = head + 1;
+
+			/* There is no message to carry OUT data, it has to be in a region */
+			urb.async = 1;
+			if (urb.direction == usb_transfer_out && urb.transfer_size && !urb.region)
+				err = -EINVAL;
+			else
+				err = hostsrv_submit(driver, &urb, NULL, NULL);
+
+			if (err < 0)
+				hostsrv_postFailure(driver, &urb, err);
+		}
+
+		sq->idle = 1;
+		__sync_synchronize();
+
+		if (sq->head == sq->tail)
+			break;
+
+		sq->idle = 0;
+	}
+	mutexUnlock(driver->sq_lock);
+}
+
+
+int hostsrv_setRings(usb_region_t *region, unsigned pid)
+{
+	FUN_TRACE;
+
+	usb_driver_t *driver;
+	usb_rings_t *rings;
+	unsigned sq_size, cq_size;
+	int err = EOK;
+
+	if ((driver = hostsrv_getDriver(pid)) == NULL)
+		return -EINVAL;
+
+	if (!region->size || ((region->paddr | region->size) & (_PAGE_SIZE - 1)))
+		return -EINVAL;
+
+	if ((rings = mmap(NULL, region->size, PROT_WRITE | PROT_READ, MAP_DEVICE | MAP_UNCACHED, OID_PHYSMEM, region->paddr)) == MAP_FAILED)
+		return -ENOMEM;
+
+	/* Sizes are read once, later changes to the shared header are ignored */
+	sq_size = rings->sq.size;
+	cq_size = rings->cq.size;
+
+	if (!sq_size || !cq_size || (sq_size & (sq_size - 1)) || (cq_size & (cq_size - 1)) ||
+		sizeof(usb_rings_t) + sq_size * sizeof(usb_urb_t) + cq_size * sizeof(usb_event_t) > region->size) {
+		munmap(rings, region->size);
+		return -EINVAL;
+	}
+
+	mutexLock(hostsrv_common.lock);
+	if (driver->rings != NULL) {
+		err = -EEXIST;
+	}
+	else {
+		driver->sqes = (usb_urb_t *)(rings + 1);
+		driver->cqes = (usb_event_t *)(driver->sqes + sq_size);
+		driver->sq_size = sq_size;
+		driver->cq_size = cq_size;
+		driver->rings = rings;
+	}
+	mutexUnlock(hostsrv_common.lock);
+
+	if (err < 0)
+		munmap(rings, region->size);
+
+	return err;
+}
+
+
+int hostsrv_enumReset(usb_device_t *device);
+void hostsrv_releaseDefault(void *owner);
+void hostsrv_enumWake(wheel_timer_t *timer);
+
+
+void hostsrv_abortEndpoint(usb_endpoint_t *endpoint)
+{
+	usb_transfer_t *transfer;
+
+	while ((transfer = endpoint->transfers) != NULL) {
+		transfer->aborted = 1;
+		hostsrv_retireTransfer(transfer, -1);
+	}
+}
+
+
+/* Must be called with device->lock and sched_lock held */
+void hostsrv_abortTransfers(usb_device_t *device)
+{
+	usb_endpoint_t *ep;
+
+	hostsrv_abortEndpoint(device->control_endpoint);
+
+	if ((ep = device->endpoints) != NULL) {
+		do
+			hostsrv_abortEndpoint(ep);
+		while ((ep = ep->next) != device->endpoints);
+	}
+}
+
+
+/* Takes the QH out of the schedule for hostsrv_finishAborts, must be called with sched_lock held */
+void hostsrv_unlinkEndpoint(usb_endpoint_t *ep)
+{
+	time_t now;
+
+	/* Later cancels wait for the doorbell rung for the first one */
+	if (ep->aborting)
+		return;
+
+	hostsrv_unlinkQh(ep);
+
+	gettime(&now, NULL);
+	ep->expires = now + HOSTSRV_QH_GRACE_US;
+	ep->doorbell = 0;
+
+	if (!ep->slot.period && ehci_ringDoorbell != NULL && ehci_doorbells != NULL)
+		ep->doorbell = ehci_ringDoorbell();
+
+	ep->aborting = 1;
+	LIST_ADD_EX(&hostsrv_common.aborting, ep, abort_next, abort_prev);
+	condSignal(hostsrv_common.timer_cond);
+}
+
+
+/* Starts cancelling the transfer with aborted set to reason, must be called with sched_lock held.
+ * The QH leaves the schedule, hostsrv_finishAborts takes the qTDs off it once the controller no longer caches them.
+ * Without ehci_dequeue only the queue head can be taken off, a transfer behind it is cancelled once the ones ahead retire,
+ * so a head that never finishes holds it up */
+int hostsrv_unlinkTransfer(usb_transfer_t *transfer, int reason)
+{
+	usb_endpoint_t *ep = transfer->endpoint;
+
+	if (transfer->cancel)
+		return EOK;
+
+	transfer->cancel = reason;
+
+	if (transfer == ep->transfers || ehci_dequeue != NULL)
+		hostsrv_unlinkEndpoint(ep);
+
+	return EOK;
+}
+
+
+/* Retires cancelled transfers of QHs the controller is done with and links the QHs back, must be called with sched_lock held */
+void hostsrv_finishAborts(void)
+{
+	usb_endpoint_t *ep, *next = hostsrv_common.aborting;
+	usb_transfer_t *transfer;
+	time_t now;
+
+	if (next == NULL)
+		return;
+
+	gettime(&now, NULL);
+
+	while ((ep = next) != NULL) {
+		next = ep->abort_next != hostsrv_common.aborting ? ep->abort_next : NULL;
+
+		if (ep->doorbell ? (int)(ehci_doorbells() - ep->doorbell) < 0 : now < ep->expires)
+			continue;
+
+		LIST_REMOVE_EX(&hostsrv_common.aborting, ep, abort_next, abort_prev);
+		ep->aborting = 0;
+
+		/* Cancelled transfers that completed meanwhile have already been retired */
+		for (;;) {
+			if ((transfer = ep->transfers) != NULL) {
+				while (!transfer->cancel && (transfer = transfer->next) != ep->transfers)
+					;
+			}
+
+			if (transfer == NULL || !transfer->cancel || (transfer != ep->transfers && ehci_dequeue == NULL))
+				break;
+
+			if (transfer == ep->transfers)
+				ehci_continue(ep->qh, transfer->qtds->prev->qtd);
+			else
+				ehci_dequeue(ep->qh, transfer->qtds->qtd, transfer->qtds->prev->qtd);
+
+			transfer->aborted = transfer->cancel;
+			hostsrv_retireTransfer(transfer, -1);
+		}
+
+		hostsrv_linkQh(ep);
+	}
+}
+
+
+/* Called from wheel_advance with sched_lock held */
+void hostsrv_timeout(wheel_timer_t *timer)
+{
+	usb_transfer_t *transfer = (usb_transfer_t *)((char *)timer - offsetof(usb_transfer_t, timer));
+
+	hostsrv_unlinkTransfer(transfer, -ETIMEDOUT);
+	TRACE_FAIL("transfer %x timed out", transfer->id);
+}
+
+
+void hostsrv_timerThread(void *arg)
+{
+	time_t now;
+
+	mutexLock(hostsrv_common.sched_lock);
+
+	for (;;) {
+		gettime(&now, NULL);
+		wheel_advance(&hostsrv_common.timers, now / HOSTSRV_TICK_US, hostsrv_timeout);
+		wheel_advance(&hostsrv_common.delays, now / HOSTSRV_TICK_US, hostsrv_enumWake);
+		hostsrv_finishAborts();
+
+		/* Tick only while there is something to expire */
+		condWait(hostsrv_common.timer_cond, hostsrv_common.sched_lock,
+			hostsrv_common.timers.count || hostsrv_common.delays.count || hostsrv_common.aborting != NULL ? HOSTSRV_TICK_US : 0);
+	}
+}
+
+
+int hostsrv_cancel(int handle, unsigned pid)
+{
+	FUN_TRACE;
+
+	usb_driver_t *driver;
+	usb_transfer_t *transfer;
+	int err = EOK;
+
+	if ((driver = hostsrv_getDriver(pid)) == NULL)
+		return -EINVAL;
+
+	mutexLock(hostsrv_common.sched_lock);
+	if ((transfer = (handle & USB_TAG) ? hostsrv_findTag(driver, handle) : hostsrv_findHandle(handle)) == NULL || transfer->driver != driver) {
+		err = -EINVAL;
+	}
+	else if (transfer->finished) {
+		/* Too late, the completion is on its way */
+		err = -ENOENT;
+	}
+	else {
+		err = hostsrv_unlinkTransfer(transfer, 1);
+	}
+	mutexUnlock(hostsrv_common.sched_lock);
+
+	return err;
+}
+
+
+/* Takes over the caller's reference to device, the reset itself runs on the enumeration threads.
+ * Transfers submitted before the device has its address back fail */
+int hostsrv_resetDevice(usb_device_t *device)
+{
+	FUN_TRACE;
+
+	usb_endpoint_t *ep;
+	int err;
+
+	mutexLock(device->lock);
+	mutexLock(hostsrv_common.sched_lock);
+	hostsrv_retireQh(device->control_endpoint);
+
+	if ((ep = device->endpoints) != NULL) {
+		do
+			hostsrv_retireQh(ep);
+		while ((ep = ep->next) != device->endpoints);
+	}
+
+	hostsrv_abortTransfers(device);
+	mutexUnlock(hostsrv_common.sched_lock);
+	mutexUnlock(device->lock);
+
+	if ((err = hostsrv_enumReset(device)) < 0)
+		hostsrv_putDevice(device);
+
+	return err;
+}
+
+
+void hostsrv_cacheThread(void *arg)
+{
+	for (;;)
+		cache_flush(HOSTSRV_CACHE_FLUSH_US);
+}
+
+
+void hostsrv_resetThread(void *arg)
+{
+	usb_device_t *device;
+
+	mutexLock(hostsrv_common.lock);
+
+	for (;;) {
+		condWait(hostsrv_common.reset_cond, hostsrv_common.lock, 0);
+
+		if ((device = hostsrv_common.reset_device) != NULL) {
+			hostsrv_common.reset_device = NULL;
+			device->refs++;
+			mutexUnlock(hostsrv_common.lock);
+
+			hostsrv_resetDevice(device);
+			mutexLock(hostsrv_common.lock);
+		}
+	}
+}
+
+
+void hostsrv_eventCallback(int port_change)
+{
+	FUN_TRACE;
+	usb_endpoint_t *ep, *next = hostsrv_common.active_endpoints;
+	usb_transfer_t *transfer;
+	int error;
+
+	trace_event(usb_trace_irq, 0, port_change);
+
+	hostsrv_reclaimQhs();
+	hostsrv_finishAborts();
+
+	/* A QH retires transfers in submission order, so only queue heads need checking */
+	while ((ep = next) != NULL) {
+		next = ep->active_next != hostsrv_common.active_endpoints ? ep->active_next : NULL;
+
+		while ((transfer = ep->transfers) != NULL && (error = hostsrv_finished(transfer))) {
+			TRACE("transfer finished %x", transfer->id);
+			trace_event(usb_trace_done, transfer->handle, error);
+			ehci_continue(ep->qh, transfer->qtds->prev->qtd);
+			hostsrv_retireTransfer(transfer, error);
+		}
+
+		/* A transfer cancelled while behind others is taken off once it gets to the front */
+		if ((transfer = ep->transfers) != NULL && transfer->cancel)
+			hostsrv_unlinkEndpoint(ep);
+	}
+
+	if (port_change) {
+		TRACE("port change");
+		hostsrv_common.port_change = 1;
+		condSignal(hostsrv_common.port_cond);
+	}
+
+	TRACE("callback out");
+}
+
+
+int hostsrv_countBytes(usb_transfer_t *transfer)
+{
+	size_t transferred_bytes = 0;
+	usb_qtd_list_t *qtd;
+
+	qtd = transfer->qtds;
+
+	do {
+		transferred_bytes += qtd->size - ehci_qtdRemainingBytes(qtd->qtd);
+		qtd = qtd->next;
+	} while (qtd != transfer->qtds);
+
+	return transferred_bytes;
+}
+
+
+void hostsrv_signalDetach(usb_device_t *device, usb_driver_t *driver)
+{
+	FUN_TRACE;
 
-		if (hostsrv_common.reset_device != NULL) {
-			hostsrv_resetDevice(hostsrv_common.reset_device);
-			hostsrv_common.reset_device = NULL;
+	usb_event_t *event;
+	msg_t msg = { 0 };
+
+	if (driver == NULL) {
+		TRACE("detach: no driver!");
+		return;
+	}
+
+	msg.type = mtDevCtl;
+
+	event = (void *)msg.i.raw;
+	event->type = usb_event_removal;
+	event->device_id = idtree_id(&device->linkage);
+
+	msgSend(driver->port, &msg);
+}
+
+
+void hostsrv_fillCompletion(usb_event_t *event, usb_transfer_t *transfer, size_t *offset)
+{
+	size_t size;
+
+	event->type = usb_event_completion;
+	event->device_id = idtree_id(&transfer->endpoint->device->linkage);
+	event->completion.transfer_id = transfer->id;
+	event->completion.pipe = idtree_id(&transfer->endpoint->linkage);
+
+	if (transfer->aborted)
+		event->completion.error = transfer->aborted;
+	else if (transfer->finished < 0)
+		event->completion.error = -EIO;
+	else
+		event->completion.error = EOK;
+
+	if (transfer->shm != NULL) {
+		/* Data is already in the driver's region, pass only its location */
+		event->completion.region = idtree_id(&transfer->shm->linkage) + 1;
+		event->completion.offset = (char *)transfer->transfer_buffer - (char *)transfer->shm->vaddr;
+		event->completion.size = transfer->direction == usb_transfer_in ? (size_t)hostsrv_countBytes(transfer) : transfer->transfer_size;
+	}
+	else {
+		event->completion.region = 0;
+		event->completion.offset = *offset;
+		event->completion.size = 0;
+
+		if (transfer->direction == usb_transfer_in) {
+			size = hostsrv_countBytes(transfer);
+			memcpy(hostsrv_common.batch + *offset, transfer->transfer_buffer, size);
+			event->completion.size = size;
+			*offset += size;
+		}
+	}
+}
+
+
+/* Posts completions not carrying data in the message to the completion ring, returns their number */
+unsigned hostsrv_postCompletions(usb_driver_t *driver, usb_transfer_t *batch)
+{
+	usb_transfer_t *transfer = batch;
+	usb_event_t event;
+	size_t offset = 0;
+	unsigned n = 0;
+	int full = 0;
+
+	mutexLock(driver->cq_lock);
+	do {
+		transfer->posted = 0;
+
+		if (full || (transfer->shm == NULL && transfer->direction == usb_transfer_in))
+			continue;
+
+		hostsrv_fillCompletion(&event, transfer, &offset);
+
+		if (hostsrv_postEvent(driver, &event) < 0) {
+			full = 1;
+			continue;
+		}
+
+		transfer->posted = 1;
+		n++;
+	}
+	while ((transfer = transfer->finished_next) != batch);
+
+	if (n)
+		hostsrv_kickDriver(driver);
+	mutexUnlock(driver->cq_lock);
+
+	return n;
+}
+
+
+void hostsrv_signalDriver(usb_driver_t *driver, usb_transfer_t *batch, unsigned count)
+{
+	FUN_TRACE;
+
+	usb_transfer_t *transfer = batch;
+	usb_event_t *event;
+	msg_t msg = { 0 };
+	size_t size, offset;
+	char *buffer;
+
+	if (driver == NULL) {
+		TRACE("no driver!");
+		return;
+	}
+
+	mutexLock(hostsrv_common.sched_lock);
+	hostsrv_common.completions += count;
+	hostsrv_common.batches++;
+	mutexUnlock(hostsrv_common.sched_lock);
+
+	trace_event(usb_trace_signal, driver->pid, count);
+
+	if (driver->rings != NULL && !(count -= hostsrv_postCompletions(driver, batch)))
+		return;
+
+	size = offset = count * sizeof(usb_event_t);
+
+	do {
+		if (!transfer->posted && transfer->shm == NULL && transfer->direction == usb_transfer_in)
+			size += hostsrv_countBytes(transfer);
+	}
+	while ((transfer = transfer->finished_next) != batch);
+
+	if (size > hostsrv_common.batch_size) {
+		if ((buffer = realloc(hostsrv_common.batch, size)) == NULL) {
+			TRACE_FAIL("no memory for %u completions", count);
+			return;
+		}
+
+		hostsrv_common.batch = buffer;
+		hostsrv_common.batch_size = size;
+	}
+
+	event = (usb_event_t *)hostsrv_common.batch;
+
+	do {
+		if (!transfer->posted)
+			hostsrv_fillCompletion(event++, transfer, &offset);
+	}
+	while ((transfer = transfer->finished_next) != batch);
+
+	msg.type = mtDevCtl;
+	msg.i.data = hostsrv_common.batch;
+	msg.i.size = size;
+
+	event = (void *)msg.i.raw;
+	event->type = usb_event_completions;
+	event->batch.count = count;
+
+	TRACE("signalling");
+	msgSend(driver->port, &msg);
+	TRACE("signalling out");
+}
+
+
+void hostsrv_respond(usb_transfer_t *transfer)
+{
+	FUN_TRACE;
+
+	usb_reply_t *reply = &transfer->reply;
+	size_t size;
+	int err = EOK;
+
+	if (transfer->aborted < 0) {
+		err = transfer->aborted;
+	}
+	else if (transfer->aborted || transfer->finished < 0) {
+		err = -EIO;
+	}
+	else if (transfer->direction == usb_transfer_in && transfer->shm == NULL && reply->data != NULL) {
+		size = transfer->transfer_size < reply->size ? transfer->transfer_size : reply->size;
+		memcpy(reply->data, transfer->transfer_buffer, size);
+	}
+
+	if (reply->result != NULL)
+		*reply->result = err;
+
+	trace_event(usb_trace_respond, transfer->handle, err);
+	hostsrv_putRequest(reply->request, err);
+}
+
+
+/* Moves finished transfers of driver from list to batch, returns their number */
+unsigned hostsrv_batchTransfers(usb_transfer_t **list, usb_transfer_t **batch, usb_driver_t *driver)
+{
+	usb_transfer_t *transfer = *list, *next;
+	unsigned i, n = 0, count = 0;
+
+	do
+		count++;
+	while ((transfer = transfer->finished_next) != *list);
+
+	for (i = 0; i < count; ++i, transfer = next) {
+		next = transfer->finished_next;
+
+		if (transfer->request == NULL && transfer->endpoint->device->driver == driver) {
+			LIST_REMOVE_EX(list, transfer, finished_next, finished_prev);
+			LIST_ADD_EX(batch, transfer, finished_next, finished_prev);
+			n++;
+		}
+	}
+
+	return n;
+}
+
+
+void hostsrv_releaseTransfers(usb_transfer_t *batch)
+{
+	usb_transfer_t *transfer;
+	usb_device_t *device;
+	int copy;
+
+	while ((transfer = batch) != NULL) {
+		LIST_REMOVE_EX(&batch, transfer, finished_next, finished_prev);
+
+		if (transfer->shm != NULL)
+			hostsrv_putRegion(transfer->shm);
+		else
+			pool_bufFree(&hostsrv_common.buffers, transfer->transfer_buffer, transfer->transfer_size);
+
+		device = transfer->endpoint->device;
+		copy = !transfer->handle;
+
+		mutexLock(hostsrv_common.sched_lock);
+		hostsrv_deleteTransfer(transfer);
+		mutexUnlock(hostsrv_common.sched_lock);
+
+		/* A copy of a periodic transfer holds no device reference, the transfer itself does */
+		if (!copy)
+			hostsrv_putDevice(device);
+	}
+}
+
+
+void hostsrv_signalThread(void *arg)
+{
+	usb_transfer_t *finished, *batch, *transfer;
+	usb_driver_t *driver;
+	unsigned count;
+
+	mutexLock(hostsrv_common.sched_lock);
+
+	for (;;) {
+		while ((finished = hostsrv_common.finished_transfers) == NULL)
+			condWait(hostsrv_common.async_cond, hostsrv_common.sched_lock, 0);
+
+		hostsrv_common.finished_transfers = NULL;
+		mutexUnlock(hostsrv_common.sched_lock);
+
+		/* Deliver everything finished so far, one message per driver */
+		while ((transfer = finished) != NULL) {
+			batch = NULL;
+
+			mutexLock(hostsrv_common.lock);
+			driver = transfer->endpoint->device->driver;
+			count = hostsrv_batchTransfers(&finished, &batch, driver);
+			mutexUnlock(hostsrv_common.lock);
+
+			hostsrv_signalDriver(driver, batch, count);
+			hostsrv_releaseTransfers(batch);
+		}
+
+		mutexLock(hostsrv_common.sched_lock);
+	}
+}
+
+
+/* Answers synchronous URBs. Kept off hostsrv_signalThread, which blocks on drivers that may be waiting for these answers */
+void hostsrv_replyThread(void *arg)
+{
+	usb_transfer_t *replies, *transfer;
+
+	mutexLock(hostsrv_common.sched_lock);
+
+	for (;;) {
+		while ((replies = hostsrv_common.replies) == NULL)
+			condWait(hostsrv_common.reply_cond, hostsrv_common.sched_lock, 0);
+
+		hostsrv_common.replies = NULL;
+		mutexUnlock(hostsrv_common.sched_lock);
+
+		transfer = replies;
+		do
+			hostsrv_respond(transfer);
+		while ((transfer = transfer->finished_next) != replies);
+
+		hostsrv_releaseTransfers(replies);
+		mutexLock(hostsrv_common.sched_lock);
+	}
+}
+
+
+int hostsrv_control(usb_device_t *device, int direction, usb_setup_packet_t *setup, void *buffer, int size)
+{
+	usb_urb_t urb = (usb_urb_t) {
+		.type = usb_transfer_control,
+		.direction = direction,
+		.device_id = idtree_id(&device->linkage),
+		.pipe = 0,
+		.transfer_size = size,
+		.async = 0,
+		.setup = *setup,
+		.timeout_us = HOSTSRV_CONTROL_TIMEOUT_US,
+	};
+
+	return hostsrv_handleUrb(&urb, device->driver, device, device->control_endpoint, buffer, NULL, NULL, NULL);
+}
+
+
+int hostsrv_getDescriptor(usb_device_t *dev, int descriptor, int index, char *buffer, int size)
+{
+	FUN_TRACE;
+
+	usb_setup_packet_t setup = (usb_setup_packet_t) {
+		.bmRequestType = REQUEST_DIR_DEV2HOST | REQUEST_TYPE_STANDARD | REQUEST_RECIPIENT_DEVICE,
+		.bRequest = REQ_GET_DESCRIPTOR,
+		.wValue = descriptor << 8 | index,
+		.wIndex = 0,
+		.wLength = size,
+	};
+
+	return hostsrv_control(dev, usb_transfer_in, &setup, buffer, size);
+}
+
+
+int hostsrv_getConfigurationDescriptor(usb_device_t *dev, usb_configuration_desc_t *desc, int index, int length)
+{
+	return hostsrv_getDescriptor(dev, USB_DESC_CONFIG, index, (char *)desc, length);
+}
+
+
+int hostsrv_getDeviceDescriptor(usb_device_t *dev, usb_device_desc_t *desc)
+{
+	return hostsrv_getDescriptor(dev, USB_DESC_DEVICE, 0, (char *)desc, sizeof(*desc));
+}
+
+
+usb_driver_t *hostsrv_findDriver(usb_device_t *device)
+{
+	FUN_TRACE;
+
+	return match_find(&hostsrv_common.matches, device->descriptor);
+}
+
+
+int hostsrv_connectDriver(usb_driver_t *driver, usb_device_t *device, usb_configuration_desc_t *configuration)
+{
+	FUN_TRACE;
+
+	msg_t msg;
+	usb_event_t *event = (void *)msg.i.raw;
+	usb_insertion_t *insertion = &event->insertion;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = mtDevCtl;
+	msg.i.data = configuration;
+	msg.i.size = configuration->wTotalLength;
+
+	event->type = usb_event_insertion;
+	event->device_id = idtree_id(&device->linkage);
+	memcpy(&insertion->descriptor, device->descriptor, sizeof(usb_device_desc_t));
+
+	return msgSend(driver->port, &msg);
+}
+
+
+usb_endpoint_t *hostsrv_findPipe(usb_device_t *device, int pipe)
+{
+	return lib_treeof(usb_endpoint_t, linkage, idtree_find(&device->pipes, pipe));
+}
+
+
+int hostsrv_openPipe(usb_device_t *device, usb_endpoint_desc_t *descriptor)
+{
+	FUN_TRACE;
+
+	usb_endpoint_t *pipe = calloc(1, sizeof(usb_endpoint_t));
+	int err = EOK;
+
+	if (pipe == NULL)
+		return -ENOMEM;
+
+	pipe->max_packet_len = descriptor->wMaxPacketSize & 0x7ff;
+	pipe->number = descriptor->bEndpointAddress & 0xf;
+	pipe->type = descriptor->bmAttributes & 0x3;
+	pipe->in = (descriptor->bEndpointAddress & 0x80) != 0;
+	pipe->next = pipe->prev = NULL;
+	pipe->device = device;
+	pipe->qh = NULL;
+
+	/* High speed interrupt endpoints may move up to 3 packets per microframe */
+	pipe->mult = 1;
+	if (device->speed == high_speed && pipe->type == HOSTSRV_EP_INTERRUPT)
+		pipe->mult += (descriptor->wMaxPacketSize >> 11) & 0x3;
+
+	/* Without ehci_portSpeed a root device is taken for full speed, whatever it reports for another speed is cut down */
+	if (device->speed == low_speed && pipe->max_packet_len > 8)
+		pipe->max_packet_len = 8;
+	else if (device->speed == full_speed && pipe->max_packet_len > (pipe->type == HOSTSRV_EP_ISOCHRONOUS ? 1023 : 64))
+		pipe->max_packet_len = pipe->type == HOSTSRV_EP_ISOCHRONOUS ? 1023 : 64;
+
+	pipe->stride = pipe->max_packet_len * pipe->mult;
+
+	if (!pipe->max_packet_len || pipe->mult > 3) {
+		free(pipe);
+		return -EINVAL;
+	}
+
+	/* Without a periodic schedule interrupt QHs are polled from the async list, which reserves nothing
+	 * and cannot move more than a packet per microframe */
+	if (pipe->type == HOSTSRV_EP_INTERRUPT && ehci_linkPeriodicQh == NULL) {
+		if (pipe->mult > 1) {
+			free(pipe);
+			return -ENOSYS;
 		}
+
+		mutexLock(hostsrv_common.sched_lock);
+		if (!hostsrv_common.async_interrupt) {
+			hostsrv_common.async_interrupt = 1;
+			TRACE_FAIL("no periodic schedule, interrupt endpoints are polled asynchronously");
+		}
+		mutexUnlock(hostsrv_common.sched_lock);
+	}
+	/* Bandwidth is reserved up front, a pipe that does not fit is refused */
+	else if (pipe->type == HOSTSRV_EP_INTERRUPT) {
+		mutexLock(hostsrv_common.sched_lock);
+		err = periodic_reserve(&hostsrv_common.periodic, &pipe->slot, device->speed, pipe->in,
+			periodic_interval(device->speed, descriptor->bInterval), pipe->stride);
+		mutexUnlock(hostsrv_common.sched_lock);
+	}
+
+	if (err < 0) {
+		TRACE_FAIL("no periodic bandwidth for endpoint %x", descriptor->bEndpointAddress);
+		free(pipe);
+		return err;
 	}
+
+	LIST_ADD(&device->endpoints, pipe);
+
+	return idtree_alloc(&device->pipes, &pipe->linkage);
 }
 
 
-void hostsrv_eventCallback(int port_change)
+int hostsrv_getConfiguration(usb_device_t *device, void *buffer, size_t bufsz)
 {
 	FUN_TRACE;
-	usb_transfer_t *transfer;
-	int error;
 
-	if ((transfer = hostsrv_common.active_transfers) != NULL) {
-		do {
-			if (!transfer->finished && (error = hostsrv_finished(transfer))) {
-				TRACE("transfer finished %x", transfer->id);
-				transfer->finished = error;
+	usb_configuration_desc_t *conf;
+	int err;
 
-				if (transfer->async)
-					LIST_ADD_EX(&hostsrv_common.finished_transfers, transfer, finished_next, finished_prev);
+	if (cache_lookup(&device->key, device->descriptor, buffer, bufsz) > 0)
+		return EOK;
 
-				ehci_continue(transfer->endpoint->qh, transfer->qtds->prev->qtd);
-				condBroadcast(transfer->cond);
-			}
-			transfer = transfer->next;
-		}
-		while (transfer != hostsrv_common.active_transfers);
-	}
+	if ((conf = dma_alloc64()) == NULL)
+		return -ENOMEM;
 
-	if (port_change) {
-		TRACE("port change");
-		condSignal(hostsrv_common.port_cond);
+	if ((err = hostsrv_getConfigurationDescriptor(device, conf, 0, sizeof(usb_configuration_desc_t))) == EOK) {
+		if (bufsz < conf->wTotalLength)
+			err = -ENOBUFS;
+		else if ((err = hostsrv_getConfigurationDescriptor(device, buffer, 0, conf->wTotalLength)) == EOK)
+			cache_store(&device->key, device->descriptor, buffer, conf->wTotalLength);
 	}
 
-	TRACE("callback out");
+	dma_free64(conf);
+	return err;
 }
 
 
-int hostsrv_countBytes(usb_transfer_t *transfer)
+void hostsrv_dumpDeviceDescriptor(FILE *stream, usb_device_desc_t *descr)
 {
-	size_t transferred_bytes = 0;
-	usb_qtd_list_t *qtd;
-
-	qtd = transfer->qtds;
+	fprintf(stream, "DEVICE DESCRIPTOR:\n");
+	fprintf(stream, "\tbLength: %d\n", descr->bLength);
+	fprintf(stream, "\tbDescriptorType: %d\n", descr->bDescriptorType);
+	fprintf(stream, "\tbcdUSB: %d\n", descr->bcdUSB);
+	fprintf(stream, "\tbDeviceClass: %d\n", descr->bDeviceClass);
+	fprintf(stream, "\tbDeviceSubClass: %d\n", descr->bDeviceSubClass);
+	fprintf(stream, "\tbDeviceProtocol: %d\n", descr->bDeviceProtocol);
+	fprintf(stream, "\tbMaxPacketSize0: %d\n", descr->bMaxPacketSize0);
+	fprintf(stream, "\tidVendor: %d\n", descr->idVendor);
+	fprintf(stream, "\tidProduct: %d\n", descr->idProduct);
+	fprintf(stream, "\tbcdDevice: %d\n", descr->bcdDevice);
+	fprintf(stream, "\tiManufacturer: %d\n", descr->iManufacturer);
+	fprintf(stream, "\tiProduct: %d\n", descr->iProduct);
+	fprintf(stream, "\tiSerialNumber: %d\n", descr->iSerialNumber);
+	fprintf(stream, "\tbNumConfigurations: %d\n", descr->bNumConfigurations);
+}
 
-	do {
-		transferred_bytes += qtd->size - ehci_qtdRemainingBytes(qtd->qtd);
-		qtd = qtd->next;
-	} while (qtd != transfer->qtds);
 
-	return transferred_bytes;
+/* Device on a port, must be called with hostsrv_common.lock held */
+usb_device_t **hostsrv_portSlot(usb_device_t *hub, int port)
+{
+	return hub == NULL ? &hostsrv_common.root : &hub->hub->children[port - 1];
 }
 
 
-void hostsrv_signalDetach(usb_device_t *device)
+usb_device_t *hostsrv_allocDevice(usb_device_t *hub, int port)
 {
-	FUN_TRACE;
+	usb_device_t *dev;
+	usb_endpoint_t *ep;
 
-	usb_driver_t *driver;
-	usb_event_t *event;
-	msg_t msg = { 0 };
+	if ((dev = calloc(1, sizeof(usb_device_t))) == NULL)
+		return NULL;
 
-	if ((driver = device->driver) == NULL) {
-		TRACE("detach: no driver!");
-		return;
+	if ((ep = calloc(1, sizeof(usb_endpoint_t))) == NULL) {
+		free(dev);
+		return NULL;
 	}
 
-	msg.type = mtDevCtl;
+	dev->control_endpoint = ep;
+	dev->speed = full_speed;
+	dev->port = port;
+	dev->refs = 1;
+	mutexCreate(&dev->lock);
+	ep->number = 0;
+	ep->max_packet_len = 64;
+	ep->device = dev;
 
-	event = (void *)msg.i.raw;
-	event->type = usb_event_removal;
-	event->device_id = idtree_id(&device->linkage);
+	idtree_init(&dev->pipes);
+	idtree_alloc(&dev->pipes, &ep->linkage);
+
+	/* A device keeps its hub around for resets */
+	if ((dev->parent = hub) != NULL) {
+		mutexLock(hostsrv_common.lock);
+		hub->refs++;
+		mutexUnlock(hostsrv_common.lock);
+	}
 
-	msgSend(device->driver->port, &msg);
+	return dev;
 }
 
 
-void hostsrv_signalDriver(usb_transfer_t *transfer)
+void hostsrv_deviceDetach(usb_device_t *device)
 {
 	FUN_TRACE;
+	usb_device_t *child;
+	usb_driver_t *driver = NULL;
+	usb_endpoint_t *ep;
+	int i, attached;
 
-	usb_driver_t *driver;
-	usb_event_t *event;
-	msg_t msg = { 0 };
+	mutexLock(hostsrv_common.lock);
+	if ((attached = device->attached)) {
+		TRACE_FAIL("device detached");
+		device->attached = 0;
+		idtree_remove(&hostsrv_common.devices, &device->linkage);
+		*hostsrv_portSlot(device->parent, device->port) = NULL;
 
-	if ((driver = transfer->endpoint->device->driver) == NULL) {
-		TRACE("no driver!");
-		return;
+		if ((driver = device->driver) != NULL) {
+			LIST_REMOVE(&driver->devices, device);
+			device->driver = NULL;
+		}
+		else if (device->next != NULL) {
+			LIST_REMOVE(&hostsrv_common.orphan_devices, device);
+		}
+	}
+	mutexUnlock(hostsrv_common.lock);
+
+	/* Devices behind a hub go away with it */
+	for (i = 0; device->hub != NULL && i < device->hub->nports; ++i) {
+		mutexLock(hostsrv_common.lock);
+		if ((child = device->hub->children[i]) != NULL)
+			child->refs++;
+		mutexUnlock(hostsrv_common.lock);
+
+		if (child != NULL) {
+			hostsrv_deviceDetach(child);
+			hostsrv_putDevice(child);
+		}
 	}
 
-	msg.type = mtDevCtl;
+	mutexLock(device->lock);
+	mutexLock(hostsrv_common.sched_lock);
+	hostsrv_retireQh(device->control_endpoint);
 
-	event = (void *)msg.i.raw;
-	event->type = usb_event_completion;
-	event->completion.transfer_id = transfer->id;
-	event->completion.pipe = idtree_id(&transfer->endpoint->linkage);
+	if ((ep = device->endpoints) != NULL) {
+		do
+			hostsrv_retireQh(ep);
+		while ((ep = ep->next) != device->endpoints);
+	}
 
-	if (transfer->aborted)
-		event->completion.error = 1;
-	else if (transfer->finished < 0)
-		event->completion.error = -EIO;
-	else
-		event->completion.error = EOK;
+	hostsrv_abortTransfers(device);
+	mutexUnlock(hostsrv_common.sched_lock);
+	mutexUnlock(device->lock);
 
-	if (transfer->direction == usb_transfer_in) {
-		msg.i.size = hostsrv_countBytes(transfer);
-		msg.i.data = transfer->transfer_buffer;
+	if (attached) {
+		hostsrv_signalDetach(device, driver);
+		hostsrv_putDevice(device);
 	}
-
-	TRACE("signalling");
-	msgSend(transfer->endpoint->device->driver->port, &msg);
-	TRACE("signalling out");
 }
 
 
-void hostsrv_signalThread(void *arg)
+int hostsrv_hubEvent(usb_device_t *hub);
+
+
+/* Called once the hub's status change endpoint reports */
+void hostsrv_hubNotify(void *arg, int err)
 {
-	usb_transfer_t *transfer;
+	usb_device_t *dev = arg;
+
+	if (err == EOK && hostsrv_hubEvent(dev) == EOK)
+		return;
 
-	mutexLock(hostsrv_common.common_lock);
+	TRACE("hub %d: status pipe closed (%d)", dev->address, err);
+	hostsrv_putDevice(dev);
+}
 
-	for (;;) {
-		while ((transfer = hostsrv_common.finished_transfers) == NULL)
-			condWait(hostsrv_common.async_cond, hostsrv_common.common_lock, 0);
 
-		LIST_REMOVE(&hostsrv_common.active_transfers, transfer);
-		LIST_REMOVE_EX(&hostsrv_common.finished_transfers, transfer, finished_next, finished_prev);
+int hostsrv_hubListen(usb_device_t *dev)
+{
+	usb_hub_t *hub = dev->hub;
+	usb_reply_t reply;
+	int err;
 
-		mutexUnlock(hostsrv_common.common_lock);
-		hostsrv_signalDriver(transfer);
-		mutexLock(hostsrv_common.common_lock);
+	usb_urb_t urb = (usb_urb_t) {
+		.type = usb_transfer_interrupt,
+		.direction = usb_transfer_in,
+		.device_id = idtree_id(&dev->linkage),
+		.pipe = hub->pipe,
+		.transfer_size = hub->status_size,
+		.async = 0,
+	};
 
-		munmap(transfer->transfer_buffer, (transfer->transfer_size + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1));
-		hostsrv_deleteTransfer(transfer);
+	/* The notification holds a reference until the status changes */
+	mutexLock(hostsrv_common.lock);
+	dev->refs++;
+	mutexUnlock(hostsrv_common.lock);
+
+	if ((reply.request = hostsrv_allocNotify(hostsrv_hubNotify, dev)) == NULL) {
+		hostsrv_putDevice(dev);
+		return -ENOMEM;
 	}
+
+	reply.data = hub->status;
+	reply.size = hub->status_size;
+	reply.result = NULL;
+
+	err = hostsrv_submit(NULL, &urb, NULL, &reply);
+	hostsrv_putRequest(reply.request, err == -EINPROGRESS ? EOK : err);
+
+	return err == -EINPROGRESS ? EOK : err;
 }
 
 
-int hostsrv_control(usb_device_t *device, int direction, usb_setup_packet_t *setup, void *buffer, int size)
+/* Makes the enumeration runnable again, must be called with sched_lock held */
+void hostsrv_enumReady(usb_enum_t *e)
+{
+	LIST_ADD(&hostsrv_common.enum_ready, e);
+	condSignal(hostsrv_common.job_cond);
+}
+
+
+void hostsrv_enumNotify(void *arg, int err)
+{
+	usb_enum_t *e = arg;
+
+	mutexLock(hostsrv_common.sched_lock);
+	e->err = err;
+	hostsrv_enumReady(e);
+	mutexUnlock(hostsrv_common.sched_lock);
+}
+
+
+/* Called from wheel_advance with sched_lock held */
+void hostsrv_enumWake(wheel_timer_t *timer)
+{
+	hostsrv_enumReady((usb_enum_t *)((char *)timer - offsetof(usb_enum_t, timer)));
+}
+
+
+void hostsrv_enumDelay(usb_enum_t *e, unsigned delay_us)
+{
+	mutexLock(hostsrv_common.sched_lock);
+	hostsrv_armTimer(&hostsrv_common.delays, &e->timer, delay_us);
+	mutexUnlock(hostsrv_common.sched_lock);
+}
+
+
+/* Submits a control stage, hostsrv_enumNotify makes the enumeration runnable once it is done */
+void hostsrv_enumControl(usb_enum_t *e, usb_device_t *target, int direction, usb_setup_packet_t *setup, void *data, int size)
 {
+	usb_reply_t reply;
+	int err;
+
 	usb_urb_t urb = (usb_urb_t) {
 		.type = usb_transfer_control,
 		.direction = direction,
-		.device_id = idtree_id(&device->linkage),
 		.pipe = 0,
 		.transfer_size = size,
 		.async = 0,
 		.setup = *setup,
+		.timeout_us = HOSTSRV_CONTROL_TIMEOUT_US,
 	};
 
-	return hostsrv_handleUrb(&urb, device->driver, device, device->control_endpoint, buffer);
+	if ((reply.request = hostsrv_allocNotify(hostsrv_enumNotify, e)) == NULL) {
+		hostsrv_enumNotify(e, -ENOMEM);
+		return;
+	}
+
+	reply.data = data;
+	reply.size = size;
+	reply.result = NULL;
+
+	mutexLock(hostsrv_common.lock);
+	target->refs++;
+	mutexUnlock(hostsrv_common.lock);
+
+	err = hostsrv_submitDevice(NULL, target, target->control_endpoint, &urb, NULL, NULL, &reply);
+	hostsrv_putRequest(reply.request, err == -EINPROGRESS ? EOK : err);
 }
 
 
-int hostsrv_setAddress(usb_device_t *dev, unsigned char address)
+/* Class request to the hub itself (port 0) or to one of its ports */
+void hostsrv_enumHubRequest(usb_enum_t *e, usb_device_t *hub, int direction, int request, int value, int port, void *data, int size)
 {
-	FUN_TRACE;
-
 	usb_setup_packet_t setup = (usb_setup_packet_t) {
-		.bmRequestType = REQUEST_DIR_HOST2DEV | REQUEST_TYPE_STANDARD | REQUEST_RECIPIENT_DEVICE,
-		.bRequest = REQ_SET_ADDRESS,
-		.wValue = address,
-		.wIndex = 0,
-		.wLength = 0,
+		.bmRequestType = (direction == usb_transfer_in ? REQUEST_DIR_DEV2HOST : REQUEST_DIR_HOST2DEV) | REQUEST_TYPE_CLASS |
+			(port ? REQUEST_RECIPIENT_OTHER : REQUEST_RECIPIENT_DEVICE),
+		.bRequest = request,
+		.wValue = value,
+		.wIndex = port,
+		.wLength = size,
 	};
 
-	return hostsrv_control(dev, usb_transfer_out, &setup, NULL, 0);
+	hostsrv_enumControl(e, hub, direction, &setup, data, size);
 }
 
 
-int hostsrv_getDescriptor(usb_device_t *dev, int descriptor, int index, char *buffer, int size)
+void hostsrv_enumPortRequest(usb_enum_t *e, int direction, int request, int feature, void *data, int size)
 {
-	FUN_TRACE;
+	hostsrv_enumHubRequest(e, e->device->parent, direction, request, feature, e->device->port, data, size);
+}
+
 
+void hostsrv_enumRequest(usb_enum_t *e, int direction, int request, int value, int index, void *data, int size)
+{
 	usb_setup_packet_t setup = (usb_setup_packet_t) {
-		.bmRequestType = REQUEST_DIR_DEV2HOST | REQUEST_TYPE_STANDARD | REQUEST_RECIPIENT_DEVICE,
-		.bRequest = REQ_GET_DESCRIPTOR,
-		.wValue = descriptor << 8 | index,
-		.wIndex = 0,
+		.bmRequestType = (direction == usb_transfer_in ? REQUEST_DIR_DEV2HOST : REQUEST_DIR_HOST2DEV) | REQUEST_TYPE_STANDARD | REQUEST_RECIPIENT_DEVICE,
+		.bRequest = request,
+		.wValue = value,
+		.wIndex = index,
 		.wLength = size,
 	};
 
-	return hostsrv_control(dev, usb_transfer_in, &setup, buffer, size);
+	hostsrv_enumControl(e, e->device, direction, &setup, data, size);
 }
 
 
-int hostsrv_getConfigurationDescriptor(usb_device_t *dev, usb_configuration_desc_t *desc, int index, int length)
+/* Only one device may answer at the default address, returns 0 if e has to wait for its turn */
+int hostsrv_enumAcquire(usb_enum_t *e)
 {
-	return hostsrv_getDescriptor(dev, USB_DESC_CONFIG, index, (char *)desc, length);
+	int acquired;
+
+	mutexLock(hostsrv_common.sched_lock);
+	if (hostsrv_common.default_owner == NULL)
+		hostsrv_common.default_owner = e;
+
+	if (!(acquired = hostsrv_common.default_owner == e))
+		LIST_ADD(&hostsrv_common.enum_waiting, e);
+	mutexUnlock(hostsrv_common.sched_lock);
+
+	return acquired;
 }
 
 
-int hostsrv_getDeviceDescriptor(usb_device_t *dev, usb_device_desc_t *desc)
+void hostsrv_releaseDefault(void *owner)
 {
-	return hostsrv_getDescriptor(dev, USB_DESC_DEVICE, 0, (char *)desc, sizeof(*desc));
+	usb_enum_t *next;
+
+	mutexLock(hostsrv_common.sched_lock);
+	if (hostsrv_common.default_owner == owner) {
+		/* Hand over to the next enumeration right away */
+		if ((next = hostsrv_common.enum_waiting) != NULL) {
+			LIST_REMOVE(&hostsrv_common.enum_waiting, next);
+			hostsrv_enumReady(next);
+		}
+
+		hostsrv_common.default_owner = next;
+	}
+	mutexUnlock(hostsrv_common.sched_lock);
+}
+
+
+void hostsrv_enumFree(usb_enum_t *e)
+{
+	if (e->configuration != NULL)
+		pool_bufFree(&hostsrv_common.buffers, e->configuration, _PAGE_SIZE);
+
+	hostsrv_putDevice(e->device);
+	free(e);
+}
+
+
+void hostsrv_enumFail(usb_enum_t *e, int err)
+{
+	TRACE_FAIL("enumeration failed at %d (%d)", e->state, err);
+
+	hostsrv_releaseDefault(e);
+	hostsrv_deviceDetach(e->device);
+	hostsrv_enumFree(e);
 }
 
 
-int hostsrv_driverMatch1(usb_driver_t *driver, usb_device_t *device)
-{
-	usb_device_id_t *filter = &driver->filter;
-	usb_device_desc_t *descriptor = device->descriptor;
+/* Registers the device and hands it to its driver */
+void hostsrv_enumConnect(usb_enum_t *e)
+{
+	usb_device_t *dev = e->device;
+	usb_driver_t *driver = e->driver;
+	int attached;
+
+	if (driver != NULL && hostsrv_connectDriver(driver, dev, e->configuration) < 0)
+		driver = NULL;
+
+	mutexLock(hostsrv_common.lock);
+	if ((attached = dev->attached) && driver != NULL) {
+		LIST_ADD(&driver->devices, dev);
+		dev->driver = driver;
+	}
+	else if (attached) {
+		TRACE("no driver");
+		LIST_ADD(&hostsrv_common.orphan_devices, dev);
+		dev->driver = NULL;
+	}
+	mutexUnlock(hostsrv_common.lock);
+
+	/* Unplugged while the driver was being connected */
+	if (!attached)
+		hostsrv_signalDetach(dev, driver);
+
+	hostsrv_enumFree(e);
+}
+
+
+int hostsrv_enumStart(usb_device_t *hub, int port);
+
+
+/* Runs enumeration stages until one has to wait for a transfer or a delay */
+void hostsrv_enumStep(usb_enum_t *e)
+{
+	usb_device_t *dev = e->device, *hub = dev->parent, *child;
+	usb_configuration_desc_t *conf;
+	usb_hub_desc_t *desc;
+	usb_hub_t *ports;
+	char *ptr;
+	int err, speed;
+
+	mutexLock(hostsrv_common.sched_lock);
+	err = e->err;
+	e->err = EOK;
+	mutexUnlock(hostsrv_common.sched_lock);
+
+	for (;;) {
+		/* Without a serial number the device is keyed by its descriptor alone */
+		if (err < 0 && e->state == enum_serial) {
+			e->serial.bLength = 0;
+			err = EOK;
+		}
+		/* Without a configuration the device is still attached, just left without a driver */
+		else if (err < 0 && e->state >= enum_config && e->state <= enum_connect && dev->descriptor->bDeviceClass != USB_CLASS_HUB) {
+			e->driver = NULL;
+			e->state = enum_connect;
+			err = EOK;
+		}
+		/* A port whose status is unknown waits for its next change, failed clears are not retried */
+		else if (err < 0 && e->state >= enum_hubEvent) {
+			if (e->state == enum_hubPortStatus)
+				e->state = enum_hubPort;
+			err = EOK;
+		}
+		else if (err < 0) {
+			hostsrv_enumFail(e, err);
+			return;
+		}
+
+		switch (e->state) {
+		case enum_acquire:
+			if (!hostsrv_enumAcquire(e))
+				return;
+
+			/* Never reset a port that is in use by another device */
+			mutexLock(hostsrv_common.lock);
+			if ((hub != NULL && !hub->attached) || *hostsrv_portSlot(hub, dev->port) != (e->readdress ? dev : NULL))
+				err = -EBUSY;
+			mutexUnlock(hostsrv_common.lock);
+
+			e->state = enum_reset;
+			break;
+
+		case enum_reset:
+			TRACE("reset");
+			e->resets++;
+
+			if (hub == NULL) {
+				ehci_resetPort();
+				e->status.wPortStatus = HUB_STATUS_ENABLE;
+
+				/* Reported like a hub port would */
+				if (ehci_portSpeed != NULL && (speed = ehci_portSpeed()) != full_speed)
+					e->status.wPortStatus |= speed == high_speed ? HUB_STATUS_HIGH_SPEED : HUB_STATUS_LOW_SPEED;
+
+				e->state = enum_resetDone;
+				break;
+			}
+
+			e->polls = 0;
+			e->state = enum_resetWait;
+			hostsrv_enumPortRequest(e, usb_transfer_out, REQ_SET_FEATURE, HUB_PORT_RESET, NULL, 0);
+			return;
+
+		case enum_resetWait:
+			e->state = enum_resetPoll;
+			hostsrv_enumDelay(e, HOSTSRV_RESET_POLL_US);
+			return;
+
+		case enum_resetPoll:
+			e->state = enum_resetStatus;
+			hostsrv_enumPortRequest(e, usb_transfer_in, REQ_GET_STATUS, 0, &e->status, sizeof(usb_port_status_t));
+			return;
+
+		case enum_resetStatus:
+			if (!(e->status.wPortChange & HUB_CHANGE_RESET) && ++e->polls < HOSTSRV_RESET_POLLS) {
+				e->state = enum_resetPoll;
+				hostsrv_enumDelay(e, HOSTSRV_RESET_POLL_US);
+				return;
+			}
+
+			e->state = enum_resetDone;
+			hostsrv_enumPortRequest(e, usb_transfer_out, REQ_CLEAR_FEATURE, HUB_C_PORT_RESET, NULL, 0);
+			return;
+
+		case enum_resetDone:
+			if (!(e->status.wPortStatus & HUB_STATUS_ENABLE)) {
+				err = -EIO;
+				break;
+			}
+
+			if (e->status.wPortStatus & HUB_STATUS_LOW_SPEED)
+				dev->speed = low_speed;
+			else if (e->status.wPortStatus & HUB_STATUS_HIGH_SPEED)
+				dev->speed = high_speed;
+			else
+				dev->speed = full_speed;
+
+			if (hub != NULL && hub->speed == high_speed && dev->speed != high_speed) {
+				dev->tt_address = hub->address;
+				dev->tt_port = dev->port;
+			}
+			else if (hub != NULL) {
+				dev->tt_address = hub->tt_address;
+				dev->tt_port = hub->tt_port;
+			}
+
+			if (e->readdress)
+				e->state = enum_readdress;
+			else
+				e->state = e->resets == 1 ? enum_descriptor : enum_address;
+			break;
+
+		case enum_descriptor:
+			TRACE("getting device descriptor");
+			e->state = enum_descriptorDone;
+			hostsrv_enumRequest(e, usb_transfer_in, REQ_GET_DESCRIPTOR, USB_DESC_DEVICE << 8, 0, dev->descriptor, sizeof(usb_device_desc_t));
+			return;
+
+		case enum_descriptorDone:
+			/* The QH was set up for the default packet size, it is allocated again with the real one */
+			if (dev->control_endpoint->max_packet_len != dev->descriptor->bMaxPacketSize0 && dev->descriptor->bMaxPacketSize0) {
+				mutexLock(hostsrv_common.sched_lock);
+				hostsrv_retireQh(dev->control_endpoint);
+				mutexUnlock(hostsrv_common.sched_lock);
+
+				dev->control_endpoint->max_packet_len = dev->descriptor->bMaxPacketSize0;
+			}
+
+			if (0) {
+				hostsrv_dumpDeviceDescriptor(stderr, dev->descriptor);
+			}
+
+			e->state = enum_reset;
+			break;
+
+		case enum_address:
+			TRACE("setting address");
+			mutexLock(hostsrv_common.lock);
+			if ((hub != NULL && !hub->attached) || *hostsrv_portSlot(hub, dev->port) != NULL) {
+				err = -ENODEV;
+			}
+			else {
+				idtree_alloc(&hostsrv_common.devices, &dev->linkage);
+				*hostsrv_portSlot(hub, dev->port) = dev;
+				dev->attached = 1;
+				dev->refs++;
+			}
+			mutexUnlock(hostsrv_common.lock);
+
+			if (err < 0)
+				break;
+
+			e->state = enum_addressDone;
+			hostsrv_enumRequest(e, usb_transfer_out, REQ_SET_ADDRESS, 1 + idtree_id(&dev->linkage), 0, NULL, 0);
+			return;
+
+		case enum_addressDone:
+			dev->address = 1 + idtree_id(&dev->linkage);
+
+			mutexLock(hostsrv_common.sched_lock);
+			ehci_qhSetAddress(dev->control_endpoint->qh, dev->address);
+			mutexUnlock(hostsrv_common.sched_lock);
+
+			hostsrv_releaseDefault(e);
+
+			/* The serial number completes the cache key */
+			e->state = enum_serial;
+			if (dev->descriptor->iSerialNumber) {
+				hostsrv_enumRequest(e, usb_transfer_in, REQ_GET_DESCRIPTOR, USB_DESC_STRING << 8 | dev->descriptor->iSerialNumber,
+					HOSTSRV_LANGID_EN_US, &e->serial, sizeof(usb_string_desc_t));
+				return;
+			}
+
+			e->serial.bLength = 0;
+			break;
+
+		case enum_readdress:
+			/* Controls queued since the reset began still target the old address */
+			mutexLock(dev->lock);
+			mutexLock(hostsrv_common.sched_lock);
+			hostsrv_retireQh(dev->control_endpoint);
+			hostsrv_abortEndpoint(dev->control_endpoint);
+			mutexUnlock(hostsrv_common.sched_lock);
+			dev->address = 0;
+			mutexUnlock(dev->lock);
+
+			e->state = enum_readdressDone;
+			hostsrv_enumRequest(e, usb_transfer_out, REQ_SET_ADDRESS, 1 + idtree_id(&dev->linkage), 0, NULL, 0);
+			return;
+
+		case enum_readdressDone:
+			TRACE("reset: address is set");
+			mutexLock(dev->lock);
+			dev->address = 1 + idtree_id(&dev->linkage);
+			mutexLock(hostsrv_common.sched_lock);
+			ehci_qhSetAddress(dev->control_endpoint->qh, dev->address);
+			mutexUnlock(hostsrv_common.sched_lock);
+			mutexUnlock(dev->lock);
+
+			hostsrv_releaseDefault(e);
+			hostsrv_enumFree(e);
+			return;
+
+		case enum_serial:
+			cache_key(&dev->key, dev->descriptor, &e->serial);
+
+			if (dev->descriptor->bDeviceClass != USB_CLASS_HUB) {
+				mutexLock(hostsrv_common.lock);
+				e->driver = hostsrv_findDriver(dev);
+				mutexUnlock(hostsrv_common.lock);
+			}
+
+			/* A hub is configured here, its status changes are reported on its only endpoint */
+			if (e->driver == NULL && dev->descriptor->bDeviceClass != USB_CLASS_HUB) {
+				e->state = enum_connect;
+				break;
+			}
+
+			TRACE("got driver");
+			e->state = enum_config;
+
+			if ((e->configuration = pool_bufAlloc(&hostsrv_common.buffers, _PAGE_SIZE)) == NULL) {
+				err = -ENOBUFS;
+				break;
+			}
+
+			/* A known device skips both configuration fetches */
+			if (cache_lookup(&dev->key, dev->descriptor, e->configuration, _PAGE_SIZE) > 0) {
+				TRACE("configuration cached");
+				e->state = enum_connect;
+				break;
+			}
+
+			hostsrv_enumRequest(e, usb_transfer_in, REQ_GET_DESCRIPTOR, USB_DESC_CONFIG << 8, 0, &e->header, sizeof(usb_configuration_desc_t));
+			return;
+
+		case enum_config:
+			if (e->header.wTotalLength > _PAGE_SIZE) {
+				err = -ENOBUFS;
+				break;
+			}
+
+			e->state = enum_store;
+			hostsrv_enumRequest(e, usb_transfer_in, REQ_GET_DESCRIPTOR, USB_DESC_CONFIG << 8, 0, e->configuration, e->header.wTotalLength);
+			return;
+
+		case enum_store:
+			cache_store(&dev->key, dev->descriptor, e->configuration, e->header.wTotalLength);
+			e->state = enum_connect;
+			break;
+
+		case enum_connect:
+			if (dev->descriptor->bDeviceClass == USB_CLASS_HUB) {
+				e->state = enum_hubConfigure;
+				break;
+			}
+
+			hostsrv_enumConnect(e);
+			return;
+
+		case enum_hubConfigure:
+			conf = e->configuration;
+			err = -EINVAL;
 
-	return (filter->idVendor == USB_CONNECT_WILDCARD || filter->idVendor == descriptor->idVendor) &&
-		(filter->idProduct == USB_CONNECT_WILDCARD || filter->idProduct == descriptor->idProduct) &&
-		(filter->bcdDevice == USB_CONNECT_WILDCARD || filter->bcdDevice == descriptor->bcdDevice);
-}
+			for (ptr = (char *)conf + conf->bLength; ptr < (char *)conf + conf->wTotalLength && ptr[0] > 0; ptr += ptr[0]) {
+				if (ptr[1] == USB_DESC_ENDPOINT) {
+					memcpy(&e->endpoint, ptr, sizeof(usb_endpoint_desc_t));
+					err = EOK;
+					break;
+				}
+			}
 
+			if (err < 0)
+				break;
 
-int hostsrv_driverMatch2(usb_driver_t *driver, usb_device_t *device)
-{
-	usb_device_id_t *filter = &driver->filter;
-	usb_device_desc_t *descriptor = device->descriptor;
+			e->state = enum_hubOpen;
+			hostsrv_enumRequest(e, usb_transfer_out, REQ_SET_CONFIGURATION, conf->bConfigurationValue, 0, NULL, 0);
+			return;
 
-	return (filter->idVendor == USB_CONNECT_WILDCARD || filter->idVendor == descriptor->idVendor) &&
-		(filter->idProduct == USB_CONNECT_WILDCARD || filter->idProduct == descriptor->idProduct);
-}
+		case enum_hubOpen:
+			mutexLock(dev->lock);
+			e->pipe = hostsrv_openPipe(dev, &e->endpoint);
+			mutexUnlock(dev->lock);
 
+			if ((err = e->pipe) < 0)
+				break;
 
-int hostsrv_driverMatch3(usb_driver_t *driver, usb_device_t *device)
-{
-	usb_device_id_t *filter = &driver->filter;
-	usb_device_desc_t *descriptor = device->descriptor;
+			/* The configuration is no longer needed, the buffer takes the hub descriptor */
+			e->state = enum_hubPower;
+			hostsrv_enumHubRequest(e, dev, usb_transfer_in, REQ_GET_DESCRIPTOR, USB_DESC_HUB << 8, 0, e->configuration, sizeof(usb_hub_desc_t));
+			return;
 
-	if (descriptor->bDeviceClass == 0xff) {
-		return (filter->idVendor == USB_CONNECT_WILDCARD || filter->idVendor == descriptor->idVendor) &&
-			(filter->bDeviceSubClass == USB_CONNECT_WILDCARD || filter->bDeviceSubClass == descriptor->bDeviceSubClass) &&
-			(filter->bDeviceProtocol == USB_CONNECT_WILDCARD || filter->bDeviceProtocol == descriptor->bDeviceProtocol);
-	}
-	else {
-		return (filter->bDeviceClass == USB_CONNECT_WILDCARD || filter->bDeviceClass == descriptor->bDeviceClass) &&
-			(filter->bDeviceSubClass == USB_CONNECT_WILDCARD || filter->bDeviceSubClass == descriptor->bDeviceSubClass) &&
-			(filter->bDeviceProtocol == USB_CONNECT_WILDCARD || filter->bDeviceProtocol == descriptor->bDeviceProtocol);
-	}
-}
+		case enum_hubPower:
+			desc = e->configuration;
 
+			if ((ports = calloc(1, sizeof(usb_hub_t) + desc->bNbrPorts * sizeof(usb_device_t *))) == NULL) {
+				err = -ENOMEM;
+				break;
+			}
 
-int hostsrv_driverMatch4(usb_driver_t *driver, usb_device_t *device)
-{
-	usb_device_id_t *filter = &driver->filter;
-	usb_device_desc_t *descriptor = device->descriptor;
+			ports->pipe = e->pipe;
+			ports->nports = desc->bNbrPorts;
+			ports->status_size = ports->nports / 8 + 1;
 
-	if (descriptor->bDeviceClass == 0xff) {
-		return (filter->idVendor == USB_CONNECT_WILDCARD || filter->idVendor == descriptor->idVendor) &&
-			(filter->bDeviceSubClass == USB_CONNECT_WILDCARD || filter->bDeviceSubClass == descriptor->bDeviceSubClass);
-	}
-	else {
-		return (filter->bDeviceClass == USB_CONNECT_WILDCARD || filter->bDeviceClass == descriptor->bDeviceClass) &&
-			(filter->bDeviceSubClass == USB_CONNECT_WILDCARD || filter->bDeviceSubClass == descriptor->bDeviceSubClass);
-	}
-}
+			mutexLock(hostsrv_common.lock);
+			dev->hub = ports;
+			mutexUnlock(hostsrv_common.lock);
 
+			TRACE("hub %d: %d ports", dev->address, ports->nports);
+			e->port = 0;
+			e->state = enum_hubPowerPort;
+			break;
 
-usb_driver_t *hostsrv_findDriver(usb_device_t *device)
-{
-	FUN_TRACE;
+		case enum_hubPowerPort:
+			/* Connected ports report a connection change once powered */
+			if (++e->port <= dev->hub->nports) {
+				hostsrv_enumHubRequest(e, dev, usb_transfer_out, REQ_SET_FEATURE, HUB_PORT_POWER, e->port, NULL, 0);
+				return;
+			}
 
-	const int (*usb_driverMatch[])(usb_driver_t *, usb_device_t *) = {
-		hostsrv_driverMatch1, hostsrv_driverMatch2, hostsrv_driverMatch3, hostsrv_driverMatch4
-	};
+			desc = e->configuration;
+			e->state = enum_hubListen;
+			hostsrv_enumDelay(e, desc->bPwrOn2PwrGood * 2000);
+			return;
 
-	rbnode_t *node;
-	usb_driver_t *driver;
-	int i;
-
-	for (i = 0; i < 4; ++i) {
-		for (node = lib_rbMinimum(hostsrv_common.drivers.root); node != NULL; node = lib_rbNext(node)) {
-			driver = lib_treeof(usb_driver_t, linkage, node);
-			if (usb_driverMatch[i](driver, device)) {
-				TRACE("found driver");
-				return driver;
-			}
-		}
-	}
-	return NULL;
-}
+		case enum_hubListen:
+			if ((err = hostsrv_hubListen(dev)) < 0)
+				break;
 
+			hostsrv_enumFree(e);
+			return;
 
-int hostsrv_connectDriver(usb_driver_t *driver, usb_device_t *device, usb_configuration_desc_t *configuration)
-{
-	FUN_TRACE;
+		case enum_hubEvent:
+			if (!dev->attached) {
+				hostsrv_enumFree(e);
+				return;
+			}
 
-	msg_t msg;
-	usb_event_t *event = (void *)msg.i.raw;
-	usb_insertion_t *insertion = &event->insertion;
+			e->port = 0;
+			e->state = enum_hubPort;
 
-	memset(&msg, 0, sizeof(msg));
-	msg.type = mtDevCtl;
-	msg.i.data = configuration;
-	msg.i.size = configuration->wTotalLength;
+			if (dev->hub->status[0] & 1) {
+				e->state = enum_hubOverCurrent;
+				hostsrv_enumHubRequest(e, dev, usb_transfer_out, REQ_CLEAR_FEATURE, HUB_C_LOCAL_POWER, 0, NULL, 0);
+				return;
+			}
+			break;
+
+		case enum_hubOverCurrent:
+			e->state = enum_hubPort;
+			hostsrv_enumHubRequest(e, dev, usb_transfer_out, REQ_CLEAR_FEATURE, HUB_C_OVER_CURRENT, 0, NULL, 0);
+			return;
+
+		case enum_hubPort:
+			ports = dev->hub;
+			while (++e->port <= ports->nports && !(ports->status[e->port / 8] & (1 << (e->port % 8))))
+				;
+
+			if (e->port > ports->nports) {
+				hostsrv_hubListen(dev);
+				hostsrv_enumFree(e);
+				return;
+			}
 
-	event->type = usb_event_insertion;
-	event->device_id = idtree_id(&device->linkage);
-	memcpy(&insertion->descriptor, device->descriptor, sizeof(usb_device_desc_t));
+			e->state = enum_hubPortStatus;
+			hostsrv_enumHubRequest(e, dev, usb_transfer_in, REQ_GET_STATUS, 0, e->port, &e->status, sizeof(usb_port_status_t));
+			return;
 
-	return msgSend(driver->port, &msg);
-}
+		case enum_hubPortStatus:
+			e->polls = 0;
+			e->state = enum_hubPortClear;
+			break;
 
+		case enum_hubPortClear:
+			/* Reset change is left to the enumeration resetting the port */
+			while (e->polls < HUB_C_PORT_RESET - HUB_C_PORT_CONNECTION && !(e->status.wPortChange & (1 << e->polls)))
+				e->polls++;
 
-usb_endpoint_t *hostsrv_findPipe(usb_device_t *device, int pipe)
-{
-	return lib_treeof(usb_endpoint_t, linkage, idtree_find(&device->pipes, pipe));
-}
+			if (e->polls < HUB_C_PORT_RESET - HUB_C_PORT_CONNECTION) {
+				hostsrv_enumHubRequest(e, dev, usb_transfer_out, REQ_CLEAR_FEATURE, HUB_C_PORT_CONNECTION + e->polls++, e->port, NULL, 0);
+				return;
+			}
 
+			e->state = enum_hubPortConnect;
+			break;
 
-int hostsrv_openPipe(usb_device_t *device, usb_endpoint_desc_t *descriptor)
-{
-	FUN_TRACE;
+		case enum_hubPortConnect:
+			e->state = enum_hubPort;
 
-	usb_endpoint_t *pipe = calloc(1, sizeof(usb_endpoint_t));
+			if (!(e->status.wPortChange & HUB_CHANGE_CONNECTION))
+				break;
 
-	pipe->max_packet_len = 64; //*/descriptor->wMaxPacketSize;
-	pipe->number = descriptor->bEndpointAddress & 0xf;
-	pipe->next = pipe->prev = NULL;
-	pipe->device = device;
-	pipe->qh = NULL;
+			mutexLock(hostsrv_common.lock);
+			if ((child = dev->hub->children[e->port - 1]) != NULL)
+				child->refs++;
+			mutexUnlock(hostsrv_common.lock);
 
-	LIST_ADD(&device->endpoints, pipe);
+			if (child != NULL) {
+				hostsrv_deviceDetach(child);
+				hostsrv_putDevice(child);
+			}
 
-	return idtree_alloc(&device->pipes, &pipe->linkage);
+			if (e->status.wPortStatus & HUB_STATUS_CONNECTION)
+				hostsrv_enumStart(dev, e->port);
+			break;
+		}
+	}
 }
 
 
-int hostsrv_getConfiguration(usb_device_t *device, void *buffer, size_t bufsz)
+/* Starts enumeration of a device connected to a port of hub (NULL - root port) */
+int hostsrv_enumStart(usb_device_t *hub, int port)
 {
-	FUN_TRACE;
+	usb_enum_t *e;
 
-	usb_configuration_desc_t *conf = dma_alloc64();
+	if ((e = calloc(1, sizeof(*e))) == NULL)
+		return -ENOMEM;
 
-	hostsrv_getConfigurationDescriptor(device, conf, 0, sizeof(usb_configuration_desc_t));
+	if ((e->device = hostsrv_allocDevice(hub, port)) == NULL) {
+		free(e);
+		return -ENOMEM;
+	}
 
-	if (bufsz < conf->wTotalLength)
-		return -ENOBUFS;
+	if ((e->device->descriptor = dma_alloc64()) == NULL) {
+		hostsrv_putDevice(e->device);
+		free(e);
+		return -ENOMEM;
+	}
 
-	hostsrv_getConfigurationDescriptor(device, buffer, 0, conf->wTotalLength);
+	/* Let the connection settle */
+	e->state = enum_acquire;
+	hostsrv_enumDelay(e, HOSTSRV_DEBOUNCE_US);
 
-	dma_free64(conf);
 	return EOK;
 }
 
 
-void hostsrv_dumpDeviceDescriptor(FILE *stream, usb_device_desc_t *descr)
-{
-	fprintf(stream, "DEVICE DESCRIPTOR:\n");
-	fprintf(stream, "\tbLength: %d\n", descr->bLength);
-	fprintf(stream, "\tbDescriptorType: %d\n", descr->bDescriptorType);
-	fprintf(stream, "\tbcdUSB: %d\n", descr->bcdUSB);
-	fprintf(stream, "\tbDeviceClass: %d\n", descr->bDeviceClass);
-	fprintf(stream, "\tbDeviceSubClass: %d\n", descr->bDeviceSubClass);
-	fprintf(stream, "\tbDeviceProtocol: %d\n", descr->bDeviceProtocol);
-	fprintf(stream, "\tbMaxPacketSize0: %d\n", descr->bMaxPacketSize0);
-	fprintf(stream, "\tidVendor: %d\n", descr->idVendor);
-	fprintf(stream, "\tidProduct: %d\n", descr->idProduct);
-	fprintf(stream, "\tbcdDevice: %d\n", descr->bcdDevice);
-	fprintf(stream, "\tiManufacturer: %d\n", descr->iManufacturer);
-	fprintf(stream, "\tiProduct: %d\n", descr->iProduct);
-	fprintf(stream, "\tiSerialNumber: %d\n", descr->iSerialNumber);
-	fprintf(stream, "\tbNumConfigurations: %d\n", descr->bNumConfigurations);
-}
-
-
-int hostsrv_deviceAttach(void)
+/* Takes over the caller's reference to device */
+int hostsrv_enumReset(usb_device_t *device)
 {
-	FUN_TRACE;
-
-	usb_device_t *dev;
-	usb_endpoint_t *ep;
-	usb_driver_t *driver;
-	void *configuration;
-	usb_device_desc_t *ddesc = dma_alloc64();
-
-	TRACE("reset");
-	ehci_resetPort();
+	usb_enum_t *e;
 
-	dev = calloc(1, sizeof(usb_device_t));
-	ep = calloc(1, sizeof(usb_endpoint_t));
-
-	dev->control_endpoint = ep;
-	dev->speed = full_speed;
-	ep->number = 0;
-	ep->max_packet_len = 64;
-	ep->device = dev;
+	if ((e = calloc(1, sizeof(*e))) == NULL)
+		return -ENOMEM;
 
-	idtree_init(&dev->pipes);
-	idtree_alloc(&dev->pipes, &ep->linkage);
+	e->device = device;
+	e->readdress = 1;
+	e->state = enum_acquire;
 
-	TRACE("getting device descriptor");
-	if (hostsrv_getDeviceDescriptor(dev, ddesc) < 0) {
-		TRACE_FAIL("getting device descriptor");
-		free(dev);
-		free(ep);
-		dma_free64(ddesc);
-		ehci_resetPort();
-		return -EIO;
-	}
+	mutexLock(hostsrv_common.sched_lock);
+	hostsrv_enumReady(e);
+	mutexUnlock(hostsrv_common.sched_lock);
 
-	ehci_resetPort();
+	return EOK;
+}
 
-	dev->descriptor = ddesc;
-	ep->max_packet_len = ddesc->bMaxPacketSize0;
 
-	if (0) {
-		hostsrv_dumpDeviceDescriptor(stderr, ddesc);
-	}
+/* Handles the changes reported by the hub's status endpoint, takes over the caller's reference to hub */
+int hostsrv_hubEvent(usb_device_t *hub)
+{
+	usb_enum_t *e;
 
-	TRACE("setting address");
-	idtree_alloc(&hostsrv_common.devices, &dev->linkage);
+	if ((e = calloc(1, sizeof(*e))) == NULL)
+		return -ENOMEM;
 
-	hostsrv_setAddress(dev, 1 + idtree_id(&dev->linkage));
-	dev->address = 1 + idtree_id(&dev->linkage);
-	ehci_qhSetAddress(dev->control_endpoint->qh, dev->address);
+	e->device = hub;
+	e->state = enum_hubEvent;
 
-	if ((driver = hostsrv_findDriver(dev)) != NULL) {
-		TRACE("got driver");
-		configuration = mmap(NULL, _PAGE_SIZE, PROT_WRITE | PROT_READ, MAP_ANONYMOUS | MAP_UNCACHED, OID_NULL, 0);
-		hostsrv_getConfiguration(dev, configuration, _PAGE_SIZE);
-		if (hostsrv_connectDriver(driver, dev, configuration) < 0) {
-			LIST_ADD(&hostsrv_common.orphan_devices, dev);
-			dev->driver = NULL;
-		}
-		else {
-			LIST_ADD(&driver->devices, dev);
-			dev->driver = driver;
-		}
-		munmap(configuration, _PAGE_SIZE);
-	}
-	else {
-		TRACE("no driver");
-		LIST_ADD(&hostsrv_common.orphan_devices, dev);
-	}
+	mutexLock(hostsrv_common.sched_lock);
+	hostsrv_enumReady(e);
+	mutexUnlock(hostsrv_common.sched_lock);
 
 	return EOK;
 }
 
 
-void hostsrv_deviceDetach(void)
+/* Runs enumeration stages, hub attaches, resets and hub events, none waits for a transfer or sleeps */
+void hostsrv_enumThread(void *arg)
 {
-	FUN_TRACE;
-	usb_device_t *device = lib_treeof(usb_device_t, linkage, hostsrv_common.devices.root);
-
-	if (device != NULL) {
-		TRACE_FAIL("device detached");
-		idtree_remove(&hostsrv_common.devices, &device->linkage);
-
-		/* TODO: remove active transfers */
+	usb_enum_t *e;
 
-		ehci_unlinkQh(device->control_endpoint->qh);
+	mutexLock(hostsrv_common.sched_lock);
 
-		usb_endpoint_t *ep = device->endpoints;
-		if (ep != NULL) {
-			do
-				if (ep->qh != NULL)
-					ehci_unlinkQh(ep->qh);
-			while ((ep = ep->next) != device->endpoints);
-		}
+	for (;;) {
+		while ((e = hostsrv_common.enum_ready) == NULL)
+			condWait(hostsrv_common.job_cond, hostsrv_common.sched_lock, 0);
 
-		if (device->driver != NULL) {
-			LIST_REMOVE(&device->driver->devices, device);
-			hostsrv_signalDetach(device);
-			device->driver = NULL;
-		}
-		else {
-			LIST_REMOVE(&hostsrv_common.orphan_devices, device);
-		}
+		LIST_REMOVE(&hostsrv_common.enum_ready, e);
+		mutexUnlock(hostsrv_common.sched_lock);
 
-		free(device);
+		hostsrv_enumStep(e);
+		mutexLock(hostsrv_common.sched_lock);
 	}
 }
 
 
 void hostsrv_portthr(void *arg)
 {
-	int attached = 0;
-
-	mutexLock(hostsrv_common.common_lock);
+	usb_device_t *root;
 
 	for (;;) {
-		condWait(hostsrv_common.port_cond, hostsrv_common.common_lock, 0);
+		mutexLock(hostsrv_common.sched_lock);
+		while (!hostsrv_common.port_change)
+			condWait(hostsrv_common.port_cond, hostsrv_common.sched_lock, 0);
+		hostsrv_common.port_change = 0;
+		mutexUnlock(hostsrv_common.sched_lock);
 		FUN_TRACE;
 
+		mutexLock(hostsrv_common.lock);
+		if ((root = hostsrv_common.root) != NULL)
+			root->refs++;
+		mutexUnlock(hostsrv_common.lock);
+
 		if (ehci_deviceAttached()) {
-			if (attached) {
+			if (root != NULL)
 				TRACE_FAIL("double attach");
-			}
-			else {
-				if (hostsrv_deviceAttach() == EOK)
-					attached = 1;
-			}
+			else
+				hostsrv_enumStart(NULL, 1);
+		}
+		else if (root == NULL) {
+			TRACE_FAIL("double detach");
 		}
 		else {
-			if (!attached) {
-				TRACE_FAIL("double detach");
-			}
-			else {
-				hostsrv_deviceDetach();
-				attached = 0;
-			}
+			hostsrv_deviceDetach(root);
 		}
+
+		if (root != NULL)
+			hostsrv_putDevice(root);
 	}
 }
 
@@ -923,14 +3370,11 @@ int hostsrv_connect(usb_connect_t *c, unsigned pid)
 {
 	FUN_TRACE;
 
-	const int (*usb_driverMatch[])(usb_driver_t *, usb_device_t *) = {
-		hostsrv_driverMatch1, hostsrv_driverMatch2, hostsrv_driverMatch3, hostsrv_driverMatch4
-	};
-
-	int i;
 	usb_driver_t *driver = malloc(sizeof(*driver));
-	usb_device_t *device;
+	usb_device_t *device, *next, **claimed = NULL;
 	void *configuration;
+	unsigned count = 0, i;
+	int attached, err;
 
 	if (driver == NULL)
 		return -ENOMEM;
@@ -939,36 +3383,93 @@ int hostsrv_connect(usb_connect_t *c, unsigned pid)
 	driver->filter = c->filter;
 	driver->pid = pid;
 	driver->devices = NULL;
+	driver->rings = NULL;
+	idtree_init(&driver->regions);
+
+	/* Descriptor reads of claimed orphans need it, nothing is published if it is missing */
+	if ((configuration = pool_bufAlloc(&hostsrv_common.buffers, _PAGE_SIZE)) == NULL) {
+		free(driver);
+		return -ENOMEM;
+	}
 
-	lib_rbInsert(&hostsrv_common.drivers, &driver->linkage);
+	mutexCreate(&driver->sq_lock);
+	mutexCreate(&driver->cq_lock);
 
-	if (hostsrv_common.orphan_devices != NULL) {
-		configuration = mmap(NULL, _PAGE_SIZE, PROT_WRITE | PROT_READ, MAP_ANONYMOUS | MAP_UNCACHED, OID_NULL, 0);
+	mutexLock(hostsrv_common.lock);
+	if (match_add(&hostsrv_common.matches, &driver->filter, pid, driver) < 0) {
+		mutexUnlock(hostsrv_common.lock);
+		resourceDestroy(driver->sq_lock);
+		resourceDestroy(driver->cq_lock);
+		pool_bufFree(&hostsrv_common.buffers, configuration, _PAGE_SIZE);
+		free(driver);
+		return -ENOMEM;
+	}
 
-		if (configuration == MAP_FAILED)
-			return -ENOMEM;
+	/* A process connects once, a second connect would leave two drivers with its pid */
+	if (lib_rbInsert(&hostsrv_common.drivers, &driver->linkage) < 0) {
+		match_remove(&hostsrv_common.matches, driver);
+		mutexUnlock(hostsrv_common.lock);
+		resourceDestroy(driver->sq_lock);
+		resourceDestroy(driver->cq_lock);
+		pool_bufFree(&hostsrv_common.buffers, configuration, _PAGE_SIZE);
+		free(driver);
+		return -EEXIST;
+	}
 
-		for (i = 0; i < 4; ++i) {
-			device = hostsrv_common.orphan_devices;
+	/* An orphan goes to the new driver only if it is now its best match */
+	if ((device = hostsrv_common.orphan_devices) != NULL) {
+		do {
+			if (match_find(&hostsrv_common.matches, device->descriptor) == driver)
+				count++;
+		}
+		while ((device = device->next) != hostsrv_common.orphan_devices);
+	}
 
-			do {
-				while (device != NULL && usb_driverMatch[i](driver, device)) {
-					hostsrv_getConfiguration(device, configuration, _PAGE_SIZE);
-					hostsrv_connectDriver(driver, device, configuration);
-					device->driver = driver;
+	if (count && (claimed = malloc(count * sizeof(*claimed))) == NULL) {
+		TRACE_FAIL("no memory to hand orphans over");
+		count = 0;
+	}
 
-					LIST_REMOVE(&hostsrv_common.orphan_devices, device);
-					LIST_ADD(&driver->devices, device);
+	/* Claimed devices are on no list until connected, as during enumeration */
+	for (i = 0, device = hostsrv_common.orphan_devices; i < count; device = next) {
+		next = device->next;
 
-					device = hostsrv_common.orphan_devices;
-				}
-			}
-			while (device != NULL && (device = device->next) != hostsrv_common.orphan_devices);
+		if (match_find(&hostsrv_common.matches, device->descriptor) == driver) {
+			LIST_REMOVE(&hostsrv_common.orphan_devices, device);
+			device->refs++;
+			claimed[i++] = device;
 		}
+	}
+	mutexUnlock(hostsrv_common.lock);
+
+	/* Descriptor reads and the driver's insertion handler must not stall the registry */
+	for (i = 0; i < count; ++i) {
+		device = claimed[i];
+
+		if ((err = hostsrv_getConfiguration(device, configuration, _PAGE_SIZE)) == EOK)
+			err = hostsrv_connectDriver(driver, device, configuration);
+
+		mutexLock(hostsrv_common.lock);
+		if ((attached = device->attached) && err == EOK) {
+			LIST_ADD(&driver->devices, device);
+			device->driver = driver;
+		}
+		else if (attached) {
+			TRACE_FAIL("device %d: driver connect failed (%d)", idtree_id(&device->linkage), err);
+			LIST_ADD(&hostsrv_common.orphan_devices, device);
+		}
+		mutexUnlock(hostsrv_common.lock);
 
-		munmap(configuration, _PAGE_SIZE);
+		/* Unplugged while the driver was being connected */
+		if (!attached && err == EOK)
+			hostsrv_signalDetach(device, driver);
+
+		hostsrv_putDevice(device);
 	}
 
+	pool_bufFree(&hostsrv_common.buffers, configuration, _PAGE_SIZE);
+	free(claimed);
+
 	telit = pid;
 
 	return EOK;
@@ -979,11 +3480,10 @@ int hostsrv_submitReset(int device_id)
 {
 	usb_device_t *device;
 
-	if ((device = lib_treeof(usb_device_t, linkage, idtree_find(&hostsrv_common.devices, device_id))) == NULL)
+	if ((device = hostsrv_getDevice(device_id)) == NULL)
 		return -EINVAL;
 
-	hostsrv_resetDevice(device);
-	return EOK;
+	return hostsrv_resetDevice(device);
 }
 
 
@@ -991,11 +3491,143 @@ int hostsrv_open(usb_open_t *o, msg_t *msg)
 {
 	FUN_TRACE;
 	usb_device_t *device;
+	int pipe;
+
+	if ((device = hostsrv_getDevice(o->device_id)) == NULL)
+		return -EINVAL;
+
+	mutexLock(device->lock);
+	pipe = hostsrv_openPipe(device, &o->endpoint);
+	mutexUnlock(device->lock);
+
+	hostsrv_putDevice(device);
+	return pipe;
+}
+
+
+/* Pending records are returned before capture is stopped, returns the number of bytes */
+int hostsrv_capture(usb_capture_t *capture, msg_t *msg)
+{
+	int err = EOK;
+
+	mutexLock(hostsrv_common.sched_lock);
+	if (capture->set && capture->size)
+		err = capture_start(&hostsrv_common.capture, capture->size, capture->device_id, capture->endpoint, capture->snaplen);
+
+	if (err == EOK && msg->o.data != NULL)
+		err = capture_read(&hostsrv_common.capture, msg->o.data, msg->o.size);
+
+	if (capture->set && !capture->size)
+		capture_stop(&hostsrv_common.capture);
+	mutexUnlock(hostsrv_common.sched_lock);
+
+	return err;
+}
+
+
+void hostsrv_addStats(usb_pipe_stats_t *total, const usb_pipe_stats_t *stats)
+{
+	unsigned i;
+
+	total->submitted += stats->submitted;
+	total->completed += stats->completed;
+	total->bytes += stats->bytes;
+	total->errors += stats->errors;
+	total->babbles += stats->babbles;
+	total->aborted += stats->aborted;
+	total->timeouts += stats->timeouts;
+	total->depth += stats->depth;
+
+	/* Pipes peak at different times, the sum of their peaks is no depth the device ever had */
+	if (stats->depth_hwm > total->depth_hwm)
+		total->depth_hwm = stats->depth_hwm;
+
+	for (i = 0; i < USB_LATENCY_BUCKETS; ++i)
+		total->latency[i] += stats->latency[i];
+}
+
+
+void hostsrv_copyStats(usb_device_stats_t *header, usb_pipe_stats_t *pipes, unsigned room, usb_endpoint_t *ep)
+{
+	ep->stats.pipe = idtree_id(&ep->linkage);
+	hostsrv_addStats(&header->total, &ep->stats);
+
+	if (header->pipes < room)
+		pipes[header->pipes] = ep->stats;
+
+	header->pipes++;
+}
+
+
+/* Returns the number of pipes, the output buffer gets the device totals and as many pipes as fit */
+int hostsrv_deviceStats(usb_devstats_t *devstats, msg_t *msg)
+{
+	usb_device_stats_t *header = msg->o.data;
+	usb_pipe_stats_t *pipes = (void *)(header + 1);
+	usb_endpoint_t *ep;
+	usb_device_t *device;
+	unsigned room;
+
+	if (header == NULL || msg->o.size < sizeof(*header))
+		return -EINVAL;
 
-	if ((device = lib_treeof(usb_device_t, linkage, idtree_find(&hostsrv_common.devices, o->device_id))) == NULL)
+	if ((device = hostsrv_getDevice(devstats->device_id)) == NULL)
+		return -ENODEV;
+
+	room = (msg->o.size - sizeof(*header)) / sizeof(usb_pipe_stats_t);
+	memset(header, 0, sizeof(*header));
+	header->total.pipe = -1;
+
+	mutexLock(device->lock);
+	mutexLock(hostsrv_common.sched_lock);
+	hostsrv_copyStats(header, pipes, room, device->control_endpoint);
+
+	if ((ep = device->endpoints) != NULL) {
+		do
+			hostsrv_copyStats(header, pipes, room, ep);
+		while ((ep = ep->next) != device->endpoints);
+	}
+	mutexUnlock(hostsrv_common.sched_lock);
+	mutexUnlock(device->lock);
+
+	hostsrv_putDevice(device);
+
+	return header->pipes;
+}
+
+
+int hostsrv_stats(msg_t *msg)
+{
+	usb_stats_t stats;
+
+	if (msg->o.data == NULL || msg->o.size < sizeof(stats))
 		return -EINVAL;
 
-	return hostsrv_openPipe(device, &o->endpoint);
+	mutexLock(hostsrv_common.sched_lock);
+	stats.transfers = hostsrv_common.transfers.stats;
+	stats.qtds = hostsrv_common.qtds.stats;
+	stats.requests = hostsrv_common.requests.stats;
+	stats.qhs = hostsrv_common.qhs.stats;
+	stats.capture_drops = hostsrv_common.capture.drops;
+	stats.completions = hostsrv_common.completions;
+	stats.batches = hostsrv_common.batches;
+	mutexUnlock(hostsrv_common.sched_lock);
+
+	pool_bufStats(&hostsrv_common.buffers, stats.buffers);
+
+	memcpy(msg->o.data, &stats, sizeof(stats));
+
+	return EOK;
+}
+
+
+/* Threads started here get a trace ring of their own */
+void hostsrv_beginThread(void (*start)(void *), void *arg)
+{
+	void *stack = malloc(HOSTSRV_STACK_SIZE);
+
+	trace_thread(stack, HOSTSRV_STACK_SIZE);
+	beginthread(start, 4, stack, HOSTSRV_STACK_SIZE, arg);
 }
 
 
@@ -1011,7 +3643,6 @@ void msgthr(void *arg)
 		if (msgRecv(port, &msg, &rid) < 0)
 			continue;
 
-		mutexLock(hostsrv_common.common_lock);
 		if (msg.type == mtDevCtl) {
 			umsg = (void *)msg.i.raw;
 
@@ -1020,7 +3651,16 @@ void msgthr(void *arg)
 				msg.o.io.err = hostsrv_connect(&umsg->connect, msg.pid);
 				break;
 			case usb_msg_urb:
-				msg.o.io.err = hostsrv_submitUrb(msg.pid, &umsg->urb, msg.i.data, msg.o.data);
+				/* Synchronous URBs are answered from hostsrv_replyThread */
+				if ((msg.o.io.err = hostsrv_submitUrb(port, &msg, rid)) == -EINPROGRESS)
+					continue;
+				break;
+			case usb_msg_cancel:
+				msg.o.io.err = hostsrv_cancel(umsg->cancel.handle, msg.pid);
+				break;
+			case usb_msg_submitv:
+				if ((msg.o.io.err = hostsrv_submitv(port, &msg, rid)) == -EINPROGRESS)
+					continue;
 				break;
 			case usb_msg_open:
 				msg.o.io.err = hostsrv_open(&umsg->open, &msg);
@@ -1028,6 +3668,37 @@ void msgthr(void *arg)
 			case usb_msg_reset:
 				msg.o.io.err = hostsrv_submitReset(umsg->reset.device_id);
 				break;
+			case usb_msg_stats:
+				msg.o.io.err = hostsrv_stats(&msg);
+				break;
+			case usb_msg_devstats:
+				msg.o.io.err = hostsrv_deviceStats(&umsg->devstats, &msg);
+				break;
+			case usb_msg_capture:
+				msg.o.io.err = hostsrv_capture(&umsg->capture, &msg);
+				break;
+			case usb_msg_trace:
+				/* Messages carry no credentials, anyone who can open /dev/usb may change the mask and read the dump,
+				 * as with stats and capture. Events hold handles, pids, sizes and stamps, never transfer data */
+				if (umsg->trace.set)
+					trace_mask = umsg->trace.mask;
+				msg.o.io.err = msg.o.data != NULL && trace_dump(msg.o.data, msg.o.size) ? EOK : -EINVAL;
+				break;
+			case usb_msg_register:
+				msg.o.io.err = hostsrv_register(&umsg->region, msg.pid);
+				break;
+			case usb_msg_unregister:
+				msg.o.io.err = hostsrv_unregister(&umsg->region, msg.pid);
+				break;
+			case usb_msg_rings:
+				msg.o.io.err = hostsrv_setRings(&umsg->region, msg.pid);
+				break;
+			case usb_msg_kick:
+				/* Release the driver before draining, it may keep posting meanwhile */
+				msg.o.io.err = EOK;
+				msgRespond(port, &msg, rid);
+				hostsrv_drainRing(msg.pid);
+				continue;
 			default:
 				TRACE_FAIL("unsupported usb_msg type");
 				break;
@@ -1037,7 +3708,6 @@ void msgthr(void *arg)
 			TRACE_FAIL("unsupported msg type");
 			msg.o.io.err = -EINVAL;
 		}
-		mutexUnlock(hostsrv_common.common_lock);
 
 		msgRespond(port, &msg, rid);
 	}
@@ -1058,39 +3728,125 @@ int hostsrv_driverCmp(rbnode_t *n1, rbnode_t *n2)
 }
 
 
+void hostsrv_usage(const char *progname)
+{
+	printf("Usage: %s [options]\n", progname);
+	printf("\t-t <n>\ttransfer pool size (default %d)\n", HOSTSRV_TRANSFERS);
+	printf("\t-q <n>\tqTD pool size (default %d)\n", HOSTSRV_QTDS);
+	printf("\t-r <n>\tsynchronous request pool size (default %d)\n", HOSTSRV_REQUESTS);
+	printf("\t-b <n>,<n>,<n>,<n>\tnumber of 64 B, 512 B, 4 KB and 16 KB DMA buffers (default %d,%d,%d,%d)\n",
+		HOSTSRV_BUFFERS_64, HOSTSRV_BUFFERS_512, HOSTSRV_BUFFERS_4K, HOSTSRV_BUFFERS_16K);
+	printf("\t-c <file>\tpersist the descriptor cache in file\n");
+	printf("\t-T <mask>\ttrace event mask (default %#x)\n", HOSTSRV_TRACE_MASK);
+}
+
+
 int main(int argc, char **argv)
 {
 	FUN_TRACE;
 	oid_t oid;
+	time_t now;
+	int c, i;
+	char *arg;
+	const char *cache_path = NULL;
+	unsigned transfers = HOSTSRV_TRANSFERS, qtds = HOSTSRV_QTDS, requests = HOSTSRV_REQUESTS, trace = HOSTSRV_TRACE_MASK;
+	unsigned buffers[USB_BUFFER_CLASSES] = { HOSTSRV_BUFFERS_64, HOSTSRV_BUFFERS_512, HOSTSRV_BUFFERS_4K, HOSTSRV_BUFFERS_16K };
+
+	while ((c = getopt(argc, argv, "t:q:r:b:c:T:h")) != -1) {
+		switch (c) {
+		case 't':
+			transfers = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			qtds = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			requests = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			for (i = 0, arg = optarg; i < USB_BUFFER_CLASSES && *arg != '\0'; ++i) {
+				buffers[i] = strtoul(arg, &arg, 0);
+				if (*arg == ',')
+					arg++;
+			}
+			break;
+		case 'c':
+			cache_path = optarg;
+			break;
+		case 'T':
+			trace = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			hostsrv_usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	openlog("hostsrv", LOG_CONS, LOG_DAEMON);
+	trace_init(trace);
+
+	if (pool_init(&hostsrv_common.transfers, "transfer", sizeof(usb_transfer_t), transfers, hostsrv_transferCtor, hostsrv_transferDtor) < 0 ||
+		pool_init(&hostsrv_common.qtds, "qtd", sizeof(usb_qtd_list_t), qtds, NULL, NULL) < 0 ||
+		pool_init(&hostsrv_common.requests, "request", sizeof(usb_request_t), requests, NULL, NULL) < 0 ||
+		pool_init(&hostsrv_common.qhs, "qh", sizeof(usb_qh_t), HOSTSRV_QHS, NULL, NULL) < 0 ||
+		pool_bufInit(&hostsrv_common.buffers, buffers) < 0 ||
+		cache_init(HOSTSRV_CACHE_ENTRIES, cache_path) < 0 ||
+		match_init(&hostsrv_common.matches, HOSTSRV_MATCH_BUCKETS) < 0) {
+		fprintf(stderr, "hostsrv: pool allocation failed\n");
+		return 1;
+	}
+
 	portCreate(&hostsrv_common.port);
 
-	mutexCreate(&hostsrv_common.common_lock);
+	mutexCreate(&hostsrv_common.lock);
+	mutexCreate(&hostsrv_common.sched_lock);
 	condCreate(&hostsrv_common.port_cond);
 	condCreate(&hostsrv_common.async_cond);
+	condCreate(&hostsrv_common.reply_cond);
 	condCreate(&hostsrv_common.reset_cond);
-
-	openlog("hostsrv", LOG_CONS, LOG_DAEMON);
-
-	hostsrv_common.active_transfers = NULL;
+	condCreate(&hostsrv_common.timer_cond);
+	condCreate(&hostsrv_common.job_cond);
+
+	hostsrv_common.active_endpoints = NULL;
+	hostsrv_common.aborting = NULL;
+	hostsrv_common.free_handle = HOSTSRV_HANDLE_NONE;
+	gettime(&now, NULL);
+	wheel_init(&hostsrv_common.timers, now / HOSTSRV_TICK_US);
+	wheel_init(&hostsrv_common.delays, now / HOSTSRV_TICK_US);
+	periodic_init(&hostsrv_common.periodic);
 	hostsrv_common.finished_transfers = NULL;
+	hostsrv_common.replies = NULL;
 	hostsrv_common.orphan_devices = NULL;
+	hostsrv_common.root = NULL;
+	hostsrv_common.enum_ready = NULL;
+	hostsrv_common.enum_waiting = NULL;
+	hostsrv_common.default_owner = NULL;
 	hostsrv_common.reset_device = NULL;
+	hostsrv_common.port_change = 0;
 	lib_rbInit(&hostsrv_common.drivers, hostsrv_driverCmp, NULL);
 	idtree_init(&hostsrv_common.devices);
 
-	ehci_init(hostsrv_eventCallback, hostsrv_common.common_lock);
+	ehci_init(hostsrv_eventCallback, hostsrv_common.sched_lock);
 
 	oid.port = hostsrv_common.port;
 	oid.id = 0;
 	create_dev(&oid, "/dev/usb");
 
-	beginthread(hostsrv_portthr, 4, malloc(0x4000), 0x4000, NULL);
-	beginthread(hostsrv_signalThread, 4, malloc(0x4000), 0x4000, NULL);
-	beginthread(hostsrv_resetThread, 4, malloc(0x4000), 0x4000, NULL);
+	hostsrv_beginThread(hostsrv_portthr, NULL);
+	hostsrv_beginThread(hostsrv_signalThread, NULL);
+	hostsrv_beginThread(hostsrv_replyThread, NULL);
+	hostsrv_beginThread(hostsrv_resetThread, NULL);
+	hostsrv_beginThread(hostsrv_timerThread, NULL);
+
+	if (cache_path != NULL)
+		hostsrv_beginThread(hostsrv_cacheThread, NULL);
+
+	for (i = 0; i < HOSTSRV_ENUM_THREADS; ++i)
+		hostsrv_beginThread(hostsrv_enumThread, NULL);
 
-	beginthread(msgthr, 4, malloc(0x4000), 0x4000, (void *)hostsrv_common.port);
-	beginthread(msgthr, 4, malloc(0x4000), 0x4000, (void *)hostsrv_common.port);
-	beginthread(msgthr, 4, malloc(0x4000), 0x4000, (void *)hostsrv_common.port);
+	hostsrv_beginThread(msgthr, (void *)hostsrv_common.port);
+	hostsrv_beginThread(msgthr, (void *)hostsrv_common.port);
+	hostsrv_beginThread(msgthr, (void *)hostsrv_common.port);
 
 	printf("hostsrv: initialized\n");
 	msgthr((void *)hostsrv_common.port);
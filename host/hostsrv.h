@@ -16,11 +16,16 @@
 #ifndef _USB_HOST_SERVER_H_
 #define _USB_HOST_SERVER_H_
 
+#include <sys/types.h>
+#include <stdint.h>
 #include <usb.h>
 
 #define USB_CONNECT_WILDCARD ((unsigned)-1)
 #define USB_CONNECT_NONE ((unsigned)-2)
 
+/* Set in every URB tag, transfer ids assigned by hostsrv never have it */
+#define USB_TAG (1u << 30)
+
 
 typedef struct {
 	unsigned idVendor;
@@ -46,9 +51,32 @@ typedef struct {
 	int transfer_size;
 	int async;
 	usb_setup_packet_t setup;
+
+	/* Data lives in a registered region instead of the message (0 - none) */
+	int region;
+	unsigned offset;
+
+	/* Reported as transfer_id on completion with USB_TAG set (0 - assigned by hostsrv) */
+	unsigned tag;
+
+	/* Completes with -ETIMEDOUT if not done in time (0 - no timeout) */
+	unsigned timeout_us;
+
+	/* Asynchronous interrupt IN URB without a region stays queued after each completion until cancelled or failed */
+	int periodic;
+
+	/* Number of usb_segment_t in the message data describing the data in the region (0 - contiguous at offset) */
+	unsigned segments;
 } usb_urb_t;
 
 
+/* Part of scatter-gather URB data, all but the last one must be a multiple of wMaxPacketSize long */
+typedef struct {
+	unsigned offset;
+	unsigned size;
+} usb_segment_t;
+
+
 typedef struct {
 	int device_id;
 	usb_endpoint_desc_t endpoint;
@@ -61,13 +89,162 @@ typedef struct {
 
 
 typedef struct {
-	enum { usb_msg_connect, usb_msg_urb, usb_msg_open, usb_msg_reset } type;
+	unsigned count;
+} usb_submitv_t;
+
+
+typedef struct {
+	int handle;
+} usb_cancel_t;
+
+
+/* Physically contiguous, uncached memory shared by a driver with hostsrv */
+typedef struct {
+	int id;
+	addr_t paddr;
+	size_t size;
+} usb_region_t;
+
+
+/* Single producer/consumer ring, the consumer sets idle before it sleeps */
+typedef struct {
+	volatile unsigned head;
+	volatile unsigned tail;
+	volatile unsigned idle;
+	unsigned size;
+} usb_ring_t;
+
+
+/* Shared with hostsrv, followed by sq.size usb_urb_t and cq.size usb_event_t entries */
+typedef struct {
+	usb_ring_t sq;
+	usb_ring_t cq;
+} usb_rings_t;
+
+
+#define USB_BUFFER_CLASSES 4
+
+
+typedef struct {
+	unsigned size;
+	unsigned capacity;
+	unsigned used;
+	unsigned hwm;
+	unsigned fallbacks;
+} usb_pool_stats_t;
+
+
+typedef struct {
+	usb_pool_stats_t transfers;
+	usb_pool_stats_t qtds;
+	usb_pool_stats_t requests;
+	usb_pool_stats_t qhs;
+	usb_pool_stats_t buffers[USB_BUFFER_CLASSES];
+
+	/* Average batch size is completions / batches */
+	unsigned completions;
+	unsigned batches;
+
+	/* URB capture records lost to a full ring */
+	unsigned capture_drops;
+} usb_stats_t;
+
+
+#define USB_LATENCY_BUCKETS 24
+
+
+/* Latency bucket i counts transfers completed within [2^i, 2^(i + 1)) us of submission, the last one anything slower */
+typedef struct {
+	int pipe;
+	unsigned submitted;
+	unsigned completed;
+	uint64_t bytes;
+	unsigned errors;
+	unsigned babbles;
+	unsigned aborted;
+	unsigned timeouts;
+	unsigned depth;
+	unsigned depth_hwm;
+	unsigned latency[USB_LATENCY_BUCKETS];
+} usb_pipe_stats_t;
+
+
+typedef struct {
+	int device_id;
+} usb_devstats_t;
+
+
+/* Followed by up to the output buffer size of the pipes usb_pipe_stats_t, the control pipe first.
+ * In total depth_hwm is the highest of the pipes, the other counts are sums */
+typedef struct {
+	usb_pipe_stats_t total;
+	unsigned pipes;
+} usb_device_stats_t;
+
+
+/* Starts (size > 0) or stops (size 0) URB capture if set, pending pcap records with the Linux usbmon
+ * link type are moved to the output buffer. device_id and endpoint (number) of -1 match any. Rings over 1 MB are refused */
+typedef struct {
+	int set;
+	int device_id;
+	int endpoint;
+	unsigned snaplen;
+	size_t size;
+} usb_capture_t;
+
+
+/* URB lifecycle events of the binary trace */
+enum { usb_trace_urb, usb_trace_link, usb_trace_irq, usb_trace_done, usb_trace_signal, usb_trace_respond, usb_trace_types };
+
+
+/* Trace rings, one per hostsrv thread and the last one shared by the rest */
+#define USB_TRACE_RINGS 12
+
+
+/* Sets the trace event mask if set, the trace dump is returned in the output buffer. Not restricted to any caller */
+typedef struct {
+	unsigned mask;
+	int set;
+} usb_trace_t;
+
+
+typedef struct {
+	uint64_t stamp;
+	uint32_t id;
+	int32_t arg;
+	uint32_t seq;
+	uint32_t type;
+} usb_trace_event_t;
+
+
+/* Followed by rings arrays of size events, event i of a ring is at i % size and valid
+ * if its seq is i + 1 and ends - size <= i < heads */
+typedef struct {
+	unsigned mask;
+	unsigned size;
+	unsigned rings;
+	unsigned cycles;
+	uint32_t heads[USB_TRACE_RINGS];
+	uint32_t ends[USB_TRACE_RINGS];
+} usb_trace_header_t;
+
+
+typedef struct {
+	enum { usb_msg_connect, usb_msg_urb, usb_msg_open, usb_msg_reset, usb_msg_stats, usb_msg_register, usb_msg_unregister,
+		usb_msg_rings, usb_msg_kick, usb_msg_submitv, usb_msg_cancel,
+		usb_msg_trace, usb_msg_devstats, usb_msg_capture } type;
 
 	union {
 		usb_connect_t connect;
 		usb_urb_t urb;
 		usb_open_t open;
 		usb_reset_t reset;
+		usb_region_t region;
+		usb_submitv_t submitv;
+		usb_cancel_t cancel;
+		usb_trace_t trace;
+		usb_devstats_t devstats;
+		usb_capture_t capture;
 	};
 } usb_msg_t;
 
@@ -81,17 +258,29 @@ typedef struct {
 	int transfer_id;
 	int pipe;
 	int error;
+
+	/* Data location: registered region or, if region is 0, the batch message */
+	int region;
+	unsigned offset;
+	size_t size;
 } usb_completion_t;
 
 
+/* Message data holds count usb_event_t completion records followed by their data */
+typedef struct {
+	unsigned count;
+} usb_batch_t;
+
+
 typedef struct {
-	enum { usb_event_insertion, usb_event_removal, usb_event_completion, usb_event_reset } type;
+	enum { usb_event_insertion, usb_event_removal, usb_event_completion, usb_event_reset, usb_event_completions, usb_event_kick } type;
 
 	int device_id;
 
 	union {
 		usb_insertion_t insertion;
 		usb_completion_t completion;
+		usb_batch_t batch;
 	};
 } usb_event_t;
 
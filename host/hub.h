@@ -0,0 +1,85 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Hub Class definitions
+ *
+ * host/hub.h
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+
+#ifndef _USB_HUB_H_
+#define _USB_HUB_H_
+
+#include <stdint.h>
+
+
+/* device class code */
+#define USB_CLASS_HUB 0x9
+
+
+/* hub descriptor type */
+#define USB_DESC_HUB 0x29
+
+
+/* hub feature selectors */
+#define HUB_C_LOCAL_POWER 0
+#define HUB_C_OVER_CURRENT 1
+
+
+/* port feature selectors */
+#define HUB_PORT_CONNECTION 0
+#define HUB_PORT_ENABLE 1
+#define HUB_PORT_SUSPEND 2
+#define HUB_PORT_OVER_CURRENT 3
+#define HUB_PORT_RESET 4
+#define HUB_PORT_POWER 8
+#define HUB_PORT_LOW_SPEED 9
+#define HUB_C_PORT_CONNECTION 16
+#define HUB_C_PORT_ENABLE 17
+#define HUB_C_PORT_SUSPEND 18
+#define HUB_C_PORT_OVER_CURRENT 19
+#define HUB_C_PORT_RESET 20
+
+
+/* wPortStatus bits */
+#define HUB_STATUS_CONNECTION (1 << HUB_PORT_CONNECTION)
+#define HUB_STATUS_ENABLE (1 << HUB_PORT_ENABLE)
+#define HUB_STATUS_LOW_SPEED (1 << 9)
+#define HUB_STATUS_HIGH_SPEED (1 << 10)
+
+
+/* wPortChange bits, bit n is cleared with feature HUB_C_PORT_CONNECTION + n */
+#define HUB_CHANGE_CONNECTION (1 << 0)
+#define HUB_CHANGE_ENABLE (1 << 1)
+#define HUB_CHANGE_SUSPEND (1 << 2)
+#define HUB_CHANGE_OVER_CURRENT (1 << 3)
+#define HUB_CHANGE_RESET (1 << 4)
+#define HUB_CHANGE_MASK 0x1f
+
+
+/* hub descriptor */
+typedef struct _usb_hub_desc {
+	uint8_t bDescLength;
+	uint8_t bDescriptorType;
+	uint8_t bNbrPorts;
+	uint16_t wHubCharacteristics;
+	uint8_t bPwrOn2PwrGood;			/* in 2 ms units */
+	uint8_t bHubContrCurrent;
+	uint8_t variable[];				/* DeviceRemovable and PortPwrCtrlMask */
+} __attribute__((packed)) usb_hub_desc_t;
+
+
+/* port status returned by GET_STATUS */
+typedef struct _usb_port_status {
+	uint16_t wPortStatus;
+	uint16_t wPortChange;
+} __attribute__((packed)) usb_port_status_t;
+
+
+#endif
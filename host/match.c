@@ -0,0 +1,174 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Server - driver match index
+ *
+ * host/match.c
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "match.h"
+
+
+enum { match_vendor, match_product, match_bcd, match_class, match_subclass, match_protocol, match_fieldCount };
+
+enum { match_idFull, match_id, match_vendorProtocol, match_classProtocol, match_vendorSubclass, match_classSubclass, match_ruleCount };
+
+
+static const struct {
+	unsigned count;
+	unsigned fields[3];
+} match_rules[match_ruleCount] = {
+	{ 3, { match_vendor, match_product, match_bcd } },
+	{ 2, { match_vendor, match_product } },
+	{ 3, { match_vendor, match_subclass, match_protocol } },
+	{ 3, { match_class, match_subclass, match_protocol } },
+	{ 2, { match_vendor, match_subclass } },
+	{ 2, { match_class, match_subclass } },
+};
+
+
+/* Rules probed for a device, vendor specific class swaps class for VID */
+static const unsigned match_levels[2][4] = {
+	{ match_idFull, match_id, match_classProtocol, match_classSubclass },
+	{ match_idFull, match_id, match_vendorProtocol, match_vendorSubclass },
+};
+
+
+/* Wildcard masks ordered from the most specific */
+static const unsigned match_masks[] = { 0, 1, 2, 4, 3, 5, 6, 7 };
+
+
+static unsigned match_hash(unsigned rule, const unsigned *key)
+{
+	unsigned i, hash = rule * 0x9e3779b1;
+
+	for (i = 0; i < match_rules[rule].count; ++i)
+		hash = (hash ^ key[i]) * 0x01000193;
+
+	return hash;
+}
+
+
+static match_entry_t *match_lookup(match_t *index, unsigned rule, const unsigned *key)
+{
+	match_entry_t *entry;
+	unsigned i;
+
+	for (entry = index->buckets[match_hash(rule, key) % index->size]; entry != NULL; entry = entry->next) {
+		if (entry->rule != rule)
+			continue;
+
+		for (i = 0; i < match_rules[rule].count && entry->key[i] == key[i]; ++i)
+			;
+
+		if (i == match_rules[rule].count)
+			return entry;
+	}
+
+	return NULL;
+}
+
+
+int match_init(match_t *index, unsigned buckets)
+{
+	if ((index->buckets = calloc(buckets, sizeof(match_entry_t *))) == NULL)
+		return -ENOMEM;
+
+	index->size = buckets;
+
+	return EOK;
+}
+
+
+int match_add(match_t *index, const usb_device_id_t *filter, unsigned order, void *owner)
+{
+	unsigned values[match_fieldCount] = { filter->idVendor, filter->idProduct, filter->bcdDevice,
+		filter->bDeviceClass, filter->bDeviceSubClass, filter->bDeviceProtocol };
+	match_entry_t *entry, **prev;
+	unsigned rule, i;
+
+	for (rule = 0; rule < match_ruleCount; ++rule) {
+		for (i = 0; i < match_rules[rule].count && values[match_rules[rule].fields[i]] != USB_CONNECT_NONE; ++i)
+			;
+
+		/* A field set to none never matches */
+		if (i < match_rules[rule].count)
+			continue;
+
+		if ((entry = malloc(sizeof(*entry))) == NULL) {
+			match_remove(index, owner);
+			return -ENOMEM;
+		}
+
+		entry->rule = rule;
+		entry->order = order;
+		entry->owner = owner;
+
+		for (i = 0; i < match_rules[rule].count; ++i)
+			entry->key[i] = values[match_rules[rule].fields[i]];
+
+		/* Chains are sorted by order so the first hit is the winner */
+		for (prev = &index->buckets[match_hash(rule, entry->key) % index->size]; *prev != NULL && (*prev)->order <= order; prev = &(*prev)->next)
+			;
+
+		entry->next = *prev;
+		*prev = entry;
+	}
+
+	return EOK;
+}
+
+
+void match_remove(match_t *index, void *owner)
+{
+	match_entry_t *entry, **prev;
+	unsigned i;
+
+	for (i = 0; i < index->size; ++i) {
+		for (prev = &index->buckets[i]; (entry = *prev) != NULL;) {
+			if (entry->owner == owner) {
+				*prev = entry->next;
+				free(entry);
+			}
+			else {
+				prev = &entry->next;
+			}
+		}
+	}
+}
+
+
+void *match_find(match_t *index, const usb_device_desc_t *desc)
+{
+	unsigned values[match_fieldCount] = { desc->idVendor, desc->idProduct, desc->bcdDevice,
+		desc->bDeviceClass, desc->bDeviceSubClass, desc->bDeviceProtocol };
+	const unsigned *levels = match_levels[desc->bDeviceClass == 0xff];
+	match_entry_t *entry;
+	unsigned key[3], level, rule, mask, m, i;
+
+	for (level = 0; level < 4; ++level) {
+		rule = levels[level];
+
+		for (m = 0; m < sizeof(match_masks) / sizeof(match_masks[0]); ++m) {
+			if ((mask = match_masks[m]) >= 1u << match_rules[rule].count)
+				continue;
+
+			for (i = 0; i < match_rules[rule].count; ++i)
+				key[i] = (mask & (1 << i)) ? USB_CONNECT_WILDCARD : values[match_rules[rule].fields[i]];
+
+			if ((entry = match_lookup(index, rule, key)) != NULL)
+				return entry->owner;
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,57 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Server - driver match index
+ *
+ * host/match.h
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _USB_HOST_MATCH_H_
+#define _USB_HOST_MATCH_H_
+
+#include <usb.h>
+
+#include "hostsrv.h"
+
+
+typedef struct _match_entry_t {
+	struct _match_entry_t *next;
+	unsigned rule;
+	unsigned key[3];
+	unsigned order;
+	void *owner;
+} match_entry_t;
+
+
+typedef struct {
+	match_entry_t **buckets;
+	unsigned size;
+} match_t;
+
+
+int match_init(match_t *index, unsigned buckets);
+
+
+/* Indexes every rule filter can match by, owners with lower order win ties. On failure no entry of owner is left */
+int match_add(match_t *index, const usb_device_id_t *filter, unsigned order, void *owner);
+
+
+/* Drops every entry of owner */
+void match_remove(match_t *index, void *owner);
+
+
+/*
+ * Returns the owner of the best filter matching desc or NULL. Priority is:
+ * VID/PID/bcdDevice, VID/PID, class (VID for vendor specific devices)/subclass/protocol,
+ * class (VID)/subclass, then filters with fewer wildcards, then lower order.
+ */
+void *match_find(match_t *index, const usb_device_desc_t *desc);
+
+
+#endif
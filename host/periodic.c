@@ -0,0 +1,212 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Server - periodic bandwidth allocator
+ *
+ * host/periodic.c
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <ehci.h>
+
+#include "periodic.h"
+
+
+/* Bus time estimates of USB 2.0 5.11.3 in nanoseconds */
+#define PERIODIC_BITS(bytes) (7 * 8 * (bytes) / 6 + 3)
+#define PERIODIC_HOST_DELAY 1000
+#define PERIODIC_HUB_LS_SETUP 333
+
+
+/* Start splits go in microframes 0-3 so that the complete splits fit in the same frame */
+#define PERIODIC_SPLIT_STARTS 4
+#define PERIODIC_CSPLIT_MASK 0x1c
+
+
+static unsigned periodic_usecs(unsigned ns)
+{
+	return (ns + 999) / 1000;
+}
+
+
+static unsigned periodic_hsUsecs(unsigned bytes)
+{
+	return periodic_usecs((55 * 8 * 2083 + 2083 * PERIODIC_BITS(bytes)) / 1000 + 5);
+}
+
+
+static unsigned periodic_fsUsecs(int speed, int in, unsigned bytes)
+{
+	if (speed != low_speed)
+		return periodic_usecs(9107 + PERIODIC_HOST_DELAY + 83540 * PERIODIC_BITS(bytes) / 1000);
+
+	if (in)
+		return periodic_usecs(64060 + 2 * PERIODIC_HUB_LS_SETUP + PERIODIC_HOST_DELAY + 676670 * PERIODIC_BITS(bytes) / 1000);
+
+	return periodic_usecs(64107 + 2 * PERIODIC_HUB_LS_SETUP + PERIODIC_HOST_DELAY + 667000 * PERIODIC_BITS(bytes) / 1000);
+}
+
+
+static void periodic_place(periodic_slot_t *slot, unsigned phase)
+{
+	unsigned i;
+
+	slot->phase = phase;
+	slot->smask = 0;
+	slot->cmask = 0;
+
+	if (slot->tt_usecs) {
+		slot->smask = 1 << (phase % 8);
+		slot->cmask = PERIODIC_CSPLIT_MASK << (phase % 8);
+		return;
+	}
+
+	/* Periods shorter than a frame poll several times in every frame */
+	for (i = phase % 8; i < 8; i += slot->period)
+		slot->smask |= 1 << i;
+}
+
+
+/* Returns the highest microframe and full speed frame load with slot added or -ENOSPC */
+static int periodic_check(periodic_t *periodic, const periodic_slot_t *slot, unsigned *peak, unsigned *tt_peak)
+{
+	unsigned frame, i, load;
+
+	*peak = 0;
+	*tt_peak = 0;
+
+	for (frame = periodic_frame(slot); frame < PERIODIC_FRAMES; frame += periodic_frames(slot)) {
+		for (i = 0; i < 8; ++i) {
+			load = periodic->load[8 * frame + i];
+
+			if (slot->smask & (1 << i))
+				load += slot->usecs;
+			else if (slot->cmask & (1 << i))
+				load += slot->cusecs;
+			else
+				continue;
+
+			if (load > PERIODIC_HS_BUDGET)
+				return -ENOSPC;
+
+			if (load > *peak)
+				*peak = load;
+		}
+
+		if (slot->tt_usecs) {
+			if ((load = periodic->tt_load[frame] + slot->tt_usecs) > PERIODIC_FS_BUDGET)
+				return -ENOSPC;
+
+			if (load > *tt_peak)
+				*tt_peak = load;
+		}
+	}
+
+	return EOK;
+}
+
+
+static void periodic_apply(periodic_t *periodic, const periodic_slot_t *slot, int sign)
+{
+	unsigned frame, i;
+
+	for (frame = periodic_frame(slot); frame < PERIODIC_FRAMES; frame += periodic_frames(slot)) {
+		for (i = 0; i < 8; ++i) {
+			if (slot->smask & (1 << i))
+				periodic->load[8 * frame + i] += sign * slot->usecs;
+			else if (slot->cmask & (1 << i))
+				periodic->load[8 * frame + i] += sign * slot->cusecs;
+		}
+
+		periodic->tt_load[frame] += sign * slot->tt_usecs;
+	}
+}
+
+
+void periodic_init(periodic_t *periodic)
+{
+	memset(periodic, 0, sizeof(*periodic));
+}
+
+
+unsigned periodic_interval(int speed, unsigned interval)
+{
+	unsigned period = 1;
+
+	/* High speed bInterval is an exponent, full/low speed one a number of frames */
+	if (speed == high_speed) {
+		if (interval < 1)
+			interval = 1;
+
+		return interval > 9 ? PERIODIC_UFRAMES : 1 << (interval - 1);
+	}
+
+	while (2 * period <= interval && 2 * period <= PERIODIC_FRAMES)
+		period *= 2;
+
+	return 8 * period;
+}
+
+
+int periodic_reserve(periodic_t *periodic, periodic_slot_t *slot, int speed, int in, unsigned period, unsigned max_packet)
+{
+	periodic_slot_t candidate;
+	unsigned i, phases, peak, tt_peak, best_peak = ~0u, best_tt = ~0u;
+	int found = 0;
+
+	if (period < 1 || period > PERIODIC_UFRAMES || (period & (period - 1)))
+		return -EINVAL;
+
+	candidate.period = period;
+
+	if (speed == high_speed) {
+		candidate.usecs = periodic_hsUsecs(max_packet);
+		candidate.cusecs = 0;
+		candidate.tt_usecs = 0;
+		phases = period;
+	}
+	else {
+		/* Data goes with the start split of OUT and with the complete split of IN transfers */
+		candidate.usecs = periodic_hsUsecs(in ? 0 : max_packet);
+		candidate.cusecs = periodic_hsUsecs(in ? max_packet : 0);
+		candidate.tt_usecs = periodic_fsUsecs(speed, in, max_packet);
+		phases = period / 8 * PERIODIC_SPLIT_STARTS;
+	}
+
+	for (i = 0; i < phases; ++i) {
+		if (speed == high_speed)
+			periodic_place(&candidate, i);
+		else
+			periodic_place(&candidate, i / PERIODIC_SPLIT_STARTS * 8 + i % PERIODIC_SPLIT_STARTS);
+
+		if (periodic_check(periodic, &candidate, &peak, &tt_peak) < 0)
+			continue;
+
+		if (peak < best_peak || (peak == best_peak && tt_peak < best_tt)) {
+			best_peak = peak;
+			best_tt = tt_peak;
+			*slot = candidate;
+			found = 1;
+		}
+	}
+
+	if (!found)
+		return -ENOSPC;
+
+	periodic_apply(periodic, slot, 1);
+
+	return EOK;
+}
+
+
+void periodic_release(periodic_t *periodic, const periodic_slot_t *slot)
+{
+	periodic_apply(periodic, slot, -1);
+}
@@ -0,0 +1,73 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Server - periodic bandwidth allocator
+ *
+ * host/periodic.h
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _USB_HOST_PERIODIC_H_
+#define _USB_HOST_PERIODIC_H_
+
+
+/* Longer intervals are polled every PERIODIC_FRAMES frames */
+#define PERIODIC_FRAMES 32
+#define PERIODIC_UFRAMES (8 * PERIODIC_FRAMES)
+
+/* Microseconds left for periodic transfers in a high speed microframe and a full speed frame */
+#define PERIODIC_HS_BUDGET 100
+#define PERIODIC_FS_BUDGET 900
+
+
+typedef struct {
+	unsigned period; /* Microframes, power of 2 */
+	unsigned phase;  /* First microframe used, below period */
+	unsigned smask, cmask;
+
+	/* Bus time of a (start split) transaction, a complete split and on the full speed side */
+	unsigned usecs, cusecs, tt_usecs;
+} periodic_slot_t;
+
+
+/* Load of every microframe of the schedule, split transactions assume a single shared TT */
+typedef struct {
+	unsigned short load[PERIODIC_UFRAMES];
+	unsigned short tt_load[PERIODIC_FRAMES];
+} periodic_t;
+
+
+/* Allocators are not locked, callers serialise access */
+void periodic_init(periodic_t *periodic);
+
+
+/* Polling period in microframes for bInterval of an interrupt endpoint */
+unsigned periodic_interval(int speed, unsigned interval);
+
+
+/* Places an endpoint at the least loaded phase, returns -ENOSPC if it does not fit anywhere */
+int periodic_reserve(periodic_t *periodic, periodic_slot_t *slot, int speed, int in, unsigned period, unsigned max_packet);
+
+
+void periodic_release(periodic_t *periodic, const periodic_slot_t *slot);
+
+
+/* Frame list placement of a reserved slot */
+static inline unsigned periodic_frames(const periodic_slot_t *slot)
+{
+	return slot->period < 8 ? 1 : slot->period / 8;
+}
+
+
+static inline unsigned periodic_frame(const periodic_slot_t *slot)
+{
+	return slot->phase / 8;
+}
+
+
+#endif
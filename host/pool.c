@@ -0,0 +1,232 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Server - fixed-size object pools
+ *
+ * host/pool.c
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+
+
+static const size_t pool_bufSizes[USB_BUFFER_CLASSES] = { 64, 512, 4096, 16384 };
+
+
+int pool_init(pool_t *pool, const char *name, size_t size, unsigned capacity, void (*ctor)(void *), void (*dtor)(void *))
+{
+	unsigned i;
+	void *object;
+
+	/* Objects are linked through their first word while free */
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	pool->name = name;
+	pool->size = size;
+	pool->free = NULL;
+	pool->ctor = ctor;
+	pool->dtor = dtor;
+
+	pool->stats.size = size;
+	pool->stats.capacity = capacity;
+	pool->stats.used = 0;
+	pool->stats.hwm = 0;
+	pool->stats.fallbacks = 0;
+
+	if (!capacity) {
+		pool->storage = NULL;
+		return EOK;
+	}
+
+	if ((pool->storage = malloc(size * capacity)) == NULL)
+		return -ENOMEM;
+
+	for (i = capacity; i-- > 0;) {
+		object = pool->storage + i * size;
+
+		if (ctor != NULL)
+			ctor(object);
+
+		*(void **)object = pool->free;
+		pool->free = object;
+	}
+
+	return EOK;
+}
+
+
+static int pool_owns(pool_t *pool, void *object)
+{
+	return (char *)object >= pool->storage && (char *)object < pool->storage + pool->size * pool->stats.capacity;
+}
+
+
+void *pool_alloc(pool_t *pool)
+{
+	void *object;
+
+	if ((object = pool->free) != NULL) {
+		pool->free = *(void **)object;
+	}
+	else {
+		if (!pool->stats.fallbacks++)
+			syslog(LOG_WARNING, "hostsrv: %s pool exhausted (%u objects), falling back to malloc", pool->name, pool->stats.capacity);
+
+		if ((object = malloc(pool->size)) == NULL)
+			return NULL;
+
+		if (pool->ctor != NULL)
+			pool->ctor(object);
+	}
+
+	if (++pool->stats.used > pool->stats.hwm)
+		pool->stats.hwm = pool->stats.used;
+
+	return object;
+}
+
+
+void pool_free(pool_t *pool, void *object)
+{
+	if (object == NULL)
+		return;
+
+	pool->stats.used--;
+
+	if (pool_owns(pool, object)) {
+		*(void **)object = pool->free;
+		pool->free = object;
+	}
+	else {
+		if (pool->dtor != NULL)
+			pool->dtor(object);
+
+		free(object);
+	}
+}
+
+
+static size_t pool_pageAlign(size_t size)
+{
+	return (size + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1);
+}
+
+
+int pool_bufInit(pool_buf_t *pool, const unsigned *capacity)
+{
+	int i;
+	unsigned n;
+	size_t size;
+
+	memset(pool, 0, sizeof(*pool));
+
+	if (mutexCreate(&pool->lock) < 0)
+		return -ENOMEM;
+
+	for (i = 0; i < USB_BUFFER_CLASSES; ++i) {
+		size = pool_bufSizes[i];
+
+		pool->classes[i].stats.size = size;
+		pool->classes[i].stats.capacity = capacity[i];
+
+		if (!capacity[i])
+			continue;
+
+		pool->classes[i].base = mmap(NULL, pool_pageAlign(size * capacity[i]), PROT_WRITE | PROT_READ, MAP_ANONYMOUS | MAP_UNCACHED, OID_NULL, 0);
+
+		if (pool->classes[i].base == MAP_FAILED)
+			return -ENOMEM;
+
+		for (n = capacity[i]; n-- > 0;) {
+			*(void **)(pool->classes[i].base + n * size) = pool->classes[i].free;
+			pool->classes[i].free = pool->classes[i].base + n * size;
+		}
+	}
+
+	return EOK;
+}
+
+
+void *pool_bufAlloc(pool_buf_t *pool, size_t size)
+{
+	int i, fit;
+	void *buffer = NULL;
+
+	for (fit = 0; fit < USB_BUFFER_CLASSES && pool_bufSizes[fit] < size; ++fit)
+		;
+
+	mutexLock(pool->lock);
+
+	/* Borrow from a larger class before resorting to mmap */
+	for (i = fit; i < USB_BUFFER_CLASSES; ++i) {
+		if ((buffer = pool->classes[i].free) != NULL) {
+			pool->classes[i].free = *(void **)buffer;
+
+			if (++pool->classes[i].stats.used > pool->classes[i].stats.hwm)
+				pool->classes[i].stats.hwm = pool->classes[i].stats.used;
+
+			break;
+		}
+	}
+
+	if (buffer == NULL && fit < USB_BUFFER_CLASSES)
+		pool->classes[fit].stats.fallbacks++;
+
+	mutexUnlock(pool->lock);
+
+	if (buffer == NULL) {
+		buffer = mmap(NULL, pool_pageAlign(size), PROT_WRITE | PROT_READ, MAP_ANONYMOUS | MAP_UNCACHED, OID_NULL, 0);
+
+		if (buffer == MAP_FAILED)
+			return NULL;
+	}
+
+	return buffer;
+}
+
+
+void pool_bufFree(pool_buf_t *pool, void *buffer, size_t size)
+{
+	int i;
+	char *base;
+
+	if (buffer == NULL)
+		return;
+
+	for (i = 0; i < USB_BUFFER_CLASSES; ++i) {
+		base = pool->classes[i].base;
+
+		if ((char *)buffer >= base && (char *)buffer < base + pool_bufSizes[i] * pool->classes[i].stats.capacity) {
+			mutexLock(pool->lock);
+			*(void **)buffer = pool->classes[i].free;
+			pool->classes[i].free = buffer;
+			pool->classes[i].stats.used--;
+			mutexUnlock(pool->lock);
+			return;
+		}
+	}
+
+	munmap(buffer, pool_pageAlign(size));
+}
+
+
+void pool_bufStats(pool_buf_t *pool, usb_pool_stats_t *stats)
+{
+	int i;
+
+	mutexLock(pool->lock);
+	for (i = 0; i < USB_BUFFER_CLASSES; ++i)
+		stats[i] = pool->classes[i].stats;
+	mutexUnlock(pool->lock);
+}
@@ -0,0 +1,71 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Server - fixed-size object pools
+ *
+ * host/pool.h
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _USB_HOST_POOL_H_
+#define _USB_HOST_POOL_H_
+
+#include <stddef.h>
+#include <sys/threads.h>
+
+#include "hostsrv.h"
+
+
+typedef struct {
+	const char *name;
+	size_t size;
+	char *storage;
+	void *free;
+
+	void (*ctor)(void *);
+	void (*dtor)(void *);
+
+	usb_pool_stats_t stats;
+} pool_t;
+
+
+typedef struct {
+	handle_t lock;
+
+	struct {
+		char *base;
+		void *free;
+		usb_pool_stats_t stats;
+	} classes[USB_BUFFER_CLASSES];
+} pool_buf_t;
+
+
+/* Pools are not locked, callers serialise access */
+int pool_init(pool_t *pool, const char *name, size_t size, unsigned capacity, void (*ctor)(void *), void (*dtor)(void *));
+
+
+void *pool_alloc(pool_t *pool);
+
+
+void pool_free(pool_t *pool, void *object);
+
+
+/* Uncached DMA buffers in 64 B, 512 B, 4 KB and 16 KB classes */
+int pool_bufInit(pool_buf_t *pool, const unsigned *capacity);
+
+
+void *pool_bufAlloc(pool_buf_t *pool, size_t size);
+
+
+void pool_bufFree(pool_buf_t *pool, void *buffer, size_t size);
+
+
+void pool_bufStats(pool_buf_t *pool, usb_pool_stats_t *stats);
+
+
+#endif
@@ -0,0 +1,739 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Server - simulated EHCI controller
+ *
+ * Implements the libusbehci interface on top of in-process device models,
+ * so that hostsrv can run and be measured without the controller hardware.
+ *
+ * host/sim/ehci-sim.c
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <sys/threads.h>
+#include <sys/list.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <ehci.h>
+#include "../ehci_ext.h"
+#include "../hostsrv.h"
+
+#include "sim.h"
+
+
+/* Bytes a qTD can hold, five 4 KB pages less the offset into the first one */
+#define SIM_QTD_PAGES 5
+#define SIM_PAGE_SIZE 0x1000
+
+/* Defaults, overridden by EHCI_SIM_* environment variables */
+#define SIM_FRAME_US 1000
+#define SIM_HS_BYTES 60000
+#define SIM_FS_BYTES 1500
+#define SIM_OVERHEAD 20
+#define SIM_LATENCY_US 0
+
+
+typedef struct sim_qtd {
+	struct sim_qtd *next;
+	int token;
+	int datax;
+	char *buffer;
+	size_t size, remaining;
+	int active, error, babble;
+	time_t ready;
+} sim_qtd_t;
+
+
+typedef struct sim_qh {
+	struct sim_qh *next, *prev;
+	int address, endpoint, transfer, speed, max_packet_len, mult;
+	unsigned period, phase;
+	int periodic;
+
+	/* Halted after an error or a short packet until ehci_continue */
+	int halted;
+	sim_qtd_t *first, *last, *current;
+
+	/* Control transfer in progress, the request runs after the data stage of OUT requests */
+	usb_setup_packet_t setup;
+	char *data;
+	size_t data_size, length, offset;
+	int stall;
+} sim_qh_t;
+
+
+static struct {
+	const sim_model_t *model;
+	int address, configuration;
+
+	void (*event_cb)(int);
+	handle_t lock, cond;
+	int port_change;
+	unsigned frame;
+	unsigned doorbells, answered;
+
+	sim_qh_t *async, *periodic;
+
+	/* Bus model: wall time of a frame, bytes moved in it, cost of every transaction and delay of every qTD */
+	time_t frame_us;
+	unsigned bytes, overhead;
+	time_t latency_us;
+
+	time_t now;
+	int completed;
+} sim_common;
+
+
+static const sim_model_t *sim_models[] = { &sim_zero };
+
+
+static unsigned sim_env(const char *name, unsigned value)
+{
+	const char *env = getenv(name);
+
+	return env != NULL ? strtoul(env, NULL, 0) : value;
+}
+
+
+static void sim_complete(sim_qh_t *qh, sim_qtd_t *qtd)
+{
+	qtd->active = 0;
+	qh->current = qtd->next;
+	sim_common.completed = 1;
+}
+
+
+static void sim_fail(sim_qh_t *qh, sim_qtd_t *qtd, int babble)
+{
+	if (babble)
+		qtd->babble = 1;
+	else
+		qtd->error = 1;
+
+	qh->halted = 1;
+	sim_complete(qh, qtd);
+}
+
+
+/* Standard requests are answered here, the rest by the model */
+static int sim_request(sim_qh_t *qh)
+{
+	const usb_setup_packet_t *setup = &qh->setup;
+	const sim_model_t *model = sim_common.model;
+	int length;
+
+	if ((setup->bmRequestType & (3 << 5)) != REQUEST_TYPE_STANDARD)
+		return model->control != NULL ? model->control(setup, qh->data) : SIM_STALL;
+
+	switch (setup->bRequest) {
+	case REQ_GET_DESCRIPTOR:
+		switch (setup->wValue >> 8) {
+		case USB_DESC_DEVICE:
+			length = sizeof(usb_device_desc_t);
+			memcpy(qh->data, model->device, length < setup->wLength ? length : setup->wLength);
+			return length;
+
+		case USB_DESC_CONFIG:
+			length = model->configuration->wTotalLength;
+			memcpy(qh->data, model->configuration, length < setup->wLength ? length : setup->wLength);
+			return length;
+
+		case USB_DESC_STRING:
+			/* Only the language table, models carry no strings */
+			if ((setup->wValue & 0xff) || setup->wLength < 4)
+				return SIM_STALL;
+
+			memcpy(qh->data, "\x04\x03\x09\x04", 4);
+			return 4;
+
+		default:
+			return SIM_STALL;
+		}
+
+	case REQ_SET_ADDRESS:
+	case REQ_SET_CONFIGURATION:
+	case REQ_SET_FEATURE:
+	case REQ_CLEAR_FEATURE:
+		return 0;
+
+	case REQ_GET_STATUS:
+		memset(qh->data, 0, setup->wLength);
+		return setup->wLength < 2 ? setup->wLength : 2;
+
+	case REQ_GET_CONFIGURATION:
+		if (setup->wLength)
+			*qh->data = sim_common.configuration;
+		return setup->wLength ? 1 : 0;
+
+	default:
+		return model->control != NULL ? model->control(setup, qh->data) : SIM_STALL;
+	}
+}
+
+
+/* Takes effect once the status stage is done */
+static void sim_requestDone(sim_qh_t *qh)
+{
+	if ((qh->setup.bmRequestType & (3 << 5)) != REQUEST_TYPE_STANDARD)
+		return;
+
+	if (qh->setup.bRequest == REQ_SET_ADDRESS)
+		sim_common.address = qh->setup.wValue;
+	else if (qh->setup.bRequest == REQ_SET_CONFIGURATION)
+		sim_common.configuration = qh->setup.wValue;
+}
+
+
+static int sim_setupStage(sim_qh_t *qh, sim_qtd_t *qtd)
+{
+	char *data;
+	int length;
+
+	if (qtd->size != sizeof(usb_setup_packet_t))
+		return SIM_STALL;
+
+	memcpy(&qh->setup, qtd->buffer, sizeof(usb_setup_packet_t));
+	qh->length = 0;
+	qh->offset = 0;
+	qh->stall = 0;
+
+	if (qh->setup.wLength > qh->data_size) {
+		if ((data = realloc(qh->data, qh->setup.wLength)) == NULL)
+			return SIM_STALL;
+
+		qh->data = data;
+		qh->data_size = qh->setup.wLength;
+	}
+
+	/* IN requests are answered right away, the data stage reads the answer */
+	if ((qh->setup.bmRequestType & REQUEST_DIR_MASK) == REQUEST_DIR_DEV2HOST) {
+		if ((length = sim_request(qh)) < 0)
+			qh->stall = 1;
+		else
+			qh->length = length < qh->setup.wLength ? length : qh->setup.wLength;
+	}
+
+	return sizeof(usb_setup_packet_t);
+}
+
+
+/* Returns bytes moved or SIM_STALL */
+static int sim_controlStage(sim_qh_t *qh, sim_qtd_t *qtd, size_t packet)
+{
+	int in = (qh->setup.bmRequestType & REQUEST_DIR_MASK) == REQUEST_DIR_DEV2HOST;
+	size_t n;
+
+	if (qh->stall)
+		return SIM_STALL;
+
+	/* Status stage goes in the opposite direction */
+	if ((qtd->token == in_token) != in) {
+		if (!in && sim_request(qh) == SIM_STALL)
+			return SIM_STALL;
+
+		sim_requestDone(qh);
+		return 0;
+	}
+
+	if (in) {
+		n = qh->length - qh->offset < packet ? qh->length - qh->offset : packet;
+		memcpy(qtd->buffer + qtd->size - qtd->remaining, qh->data + qh->offset, n);
+	}
+	else {
+		if ((n = packet) > qh->setup.wLength - qh->offset)
+			return SIM_STALL;
+
+		memcpy(qh->data + qh->offset, qtd->buffer + qtd->size - qtd->remaining, n);
+	}
+
+	qh->offset += n;
+
+	return n;
+}
+
+
+/* Runs one transaction of the current qTD of qh, returns the bus bytes it took or 0 if qh has nothing to do */
+static unsigned sim_transaction(sim_qh_t *qh)
+{
+	const sim_model_t *model = sim_common.model;
+	sim_qtd_t *qtd = qh->current;
+	size_t packet;
+	int n;
+
+	if (qh->halted || qtd == NULL || sim_common.now < qtd->ready)
+		return 0;
+
+	/* Nobody answers at another address */
+	if (model == NULL || qh->address != sim_common.address) {
+		sim_fail(qh, qtd, 0);
+		return sim_common.overhead;
+	}
+
+	packet = qtd->remaining < (size_t)qh->max_packet_len ? qtd->remaining : (size_t)qh->max_packet_len;
+
+	if (qtd->token == setup_token)
+		n = sim_setupStage(qh, qtd);
+	else if (qh->transfer == usb_transfer_control)
+		n = sim_controlStage(qh, qtd, packet);
+	else if (qtd->token == in_token)
+		n = model->in(qh->endpoint, qtd->buffer + qtd->size - qtd->remaining, packet);
+	else
+		n = model->out(qh->endpoint, qtd->buffer + qtd->size - qtd->remaining, packet);
+
+	if (n == SIM_NAK)
+		return sim_common.overhead;
+
+	/* Any other negative answer is taken for a stall, n is a byte count past this point */
+	if (n < 0) {
+		sim_fail(qh, qtd, 0);
+		return sim_common.overhead;
+	}
+
+	if ((size_t)n > packet && qtd->token != setup_token) {
+		sim_fail(qh, qtd, 1);
+		return sim_common.overhead + packet;
+	}
+
+	qtd->remaining -= n;
+
+	if (!qtd->remaining) {
+		sim_complete(qh, qtd);
+	}
+	else if ((size_t)n < packet) {
+		/* A short packet ends the transfer, except for the data stage of a control transfer */
+		sim_complete(qh, qtd);
+		if (qh->transfer != usb_transfer_control)
+			qh->halted = 1;
+	}
+
+	return sim_common.overhead + n;
+}
+
+
+static int sim_busy(void)
+{
+	sim_qh_t *qh;
+
+	if (sim_common.port_change || sim_common.doorbells != sim_common.answered)
+		return 1;
+
+	if ((qh = sim_common.async) != NULL) {
+		do {
+			if (qh->current != NULL && !qh->halted)
+				return 1;
+		}
+		while ((qh = qh->next) != sim_common.async);
+	}
+
+	if ((qh = sim_common.periodic) != NULL) {
+		do {
+			if (qh->current != NULL && !qh->halted)
+				return 1;
+		}
+		while ((qh = qh->next) != sim_common.periodic);
+	}
+
+	return 0;
+}
+
+
+static void sim_microframe(unsigned uframe)
+{
+	unsigned budget = sim_common.bytes / 8, used, cost, i;
+	sim_qh_t *qh;
+
+	/* Periodic QHs are served first, once per period */
+	if ((qh = sim_common.periodic) != NULL) {
+		do {
+			if ((uframe - qh->phase) % qh->period)
+				continue;
+
+			for (i = 0; i < (unsigned)qh->mult && (cost = sim_transaction(qh)); ++i)
+				budget = cost < budget ? budget - cost : 0;
+		}
+		while ((qh = qh->next) != sim_common.periodic);
+	}
+
+	/* The async schedule is walked round robin, one transaction per QH visit */
+	while (budget && (qh = sim_common.async) != NULL) {
+		used = 0;
+
+		do {
+			if ((cost = sim_transaction(qh)) != 0) {
+				used += cost;
+				budget = cost < budget ? budget - cost : 0;
+			}
+
+			qh = qh->next;
+		}
+		while (budget && qh != sim_common.async);
+
+		/* The next pass starts where this one stopped */
+		sim_common.async = qh;
+
+		if (!used)
+			break;
+	}
+}
+
+
+static void sim_thread(void *arg)
+{
+	time_t next, now;
+	unsigned i;
+	int port_change;
+
+	gettime(&next, NULL);
+
+	mutexLock(sim_common.lock);
+	for (;;) {
+		while (!sim_busy()) {
+			condWait(sim_common.cond, sim_common.lock, 0);
+			gettime(&next, NULL);
+		}
+
+		sim_common.now = next;
+		sim_common.completed = 0;
+
+		for (i = 0; i < 8; ++i)
+			sim_microframe(8 * sim_common.frame + i);
+
+		sim_common.frame++;
+
+		/* Nothing unlinked before this frame is referenced any more */
+		sim_common.answered = sim_common.doorbells;
+
+		if (sim_common.completed || sim_common.port_change) {
+			port_change = sim_common.port_change;
+			sim_common.port_change = 0;
+			sim_common.event_cb(port_change);
+		}
+		mutexUnlock(sim_common.lock);
+
+		/* Frames keep wall clock pace, a late one is not made up for */
+		next += sim_common.frame_us;
+		gettime(&now, NULL);
+		if (now < next)
+			usleep(next - now);
+		else
+			next = now;
+
+		mutexLock(sim_common.lock);
+	}
+}
+
+
+struct qtd *ehci_allocQtd(int token, char *buffer, size_t *size, int datax)
+{
+	sim_qtd_t *qtd;
+	size_t capacity, n = 0;
+
+	if ((qtd = calloc(1, sizeof(*qtd))) == NULL)
+		return NULL;
+
+	if (size != NULL) {
+		capacity = SIM_QTD_PAGES * SIM_PAGE_SIZE - ((uintptr_t)buffer & (SIM_PAGE_SIZE - 1));
+		n = *size < capacity ? *size : capacity;
+		*size -= n;
+	}
+
+	qtd->token = token;
+	qtd->datax = datax;
+	qtd->buffer = buffer;
+	qtd->size = n;
+	qtd->remaining = n;
+	qtd->active = 1;
+
+	return (struct qtd *)qtd;
+}
+
+
+void ehci_freeQtd(struct qtd *qtd)
+{
+	free(qtd);
+}
+
+
+void ehci_qhInit(struct qh *qh, int address, int endpoint, int transfer, int speed, int max_packet_len)
+{
+	sim_qh_t *q = (sim_qh_t *)qh;
+	char *data = q->data;
+	size_t data_size = q->data_size;
+
+	memset(q, 0, sizeof(*q));
+	q->address = address;
+	q->endpoint = endpoint;
+	q->transfer = transfer;
+	q->speed = speed;
+	q->max_packet_len = max_packet_len;
+	q->mult = 1;
+	q->period = 1;
+	q->data = data;
+	q->data_size = data_size;
+}
+
+
+struct qh *ehci_allocQh(int address, int endpoint, int transfer, int speed, int max_packet_len)
+{
+	sim_qh_t *qh;
+
+	if ((qh = calloc(1, sizeof(*qh))) == NULL)
+		return NULL;
+
+	ehci_qhInit((struct qh *)qh, address, endpoint, transfer, speed, max_packet_len);
+
+	return (struct qh *)qh;
+}
+
+
+void ehci_freeQh(struct qh *qh)
+{
+	free(((sim_qh_t *)qh)->data);
+	free(qh);
+}
+
+
+void ehci_linkQtd(struct qtd *prev, struct qtd *next)
+{
+	((sim_qtd_t *)prev)->next = (sim_qtd_t *)next;
+}
+
+
+void ehci_linkQh(struct qh *qh)
+{
+	LIST_ADD(&sim_common.async, (sim_qh_t *)qh);
+	condSignal(sim_common.cond);
+}
+
+
+void ehci_unlinkQh(struct qh *qh)
+{
+	LIST_REMOVE(&sim_common.async, (sim_qh_t *)qh);
+}
+
+
+void ehci_linkPeriodicQh(struct qh *qh, unsigned period, unsigned phase, unsigned smask, unsigned cmask)
+{
+	sim_qh_t *q = (sim_qh_t *)qh;
+
+	/* Polled once per period, several times a frame for short periods as smask has it */
+	q->period = period;
+	q->phase = phase;
+	q->periodic = 1;
+	LIST_ADD(&sim_common.periodic, q);
+	condSignal(sim_common.cond);
+}
+
+
+void ehci_unlinkPeriodicQh(struct qh *qh)
+{
+	LIST_REMOVE(&sim_common.periodic, (sim_qh_t *)qh);
+}
+
+
+void ehci_enqueue(struct qh *qh, struct qtd *first, struct qtd *last)
+{
+	sim_qh_t *q = (sim_qh_t *)qh;
+	sim_qtd_t *qtd;
+	time_t now = 0;
+
+	((sim_qtd_t *)last)->next = NULL;
+
+	if (sim_common.latency_us)
+		gettime(&now, NULL);
+
+	for (qtd = (sim_qtd_t *)first; qtd != NULL; qtd = qtd->next)
+		qtd->ready = now + sim_common.latency_us;
+
+	if (q->last != NULL)
+		q->last->next = (sim_qtd_t *)first;
+	else
+		q->first = (sim_qtd_t *)first;
+
+	q->last = (sim_qtd_t *)last;
+
+	if (q->current == NULL)
+		q->current = (sim_qtd_t *)first;
+
+	condSignal(sim_common.cond);
+}
+
+
+void ehci_continue(struct qh *qh, struct qtd *last)
+{
+	sim_qh_t *q = (sim_qh_t *)qh;
+	sim_qtd_t *qtd, *end = (sim_qtd_t *)last;
+	int reached = 0;
+
+	for (qtd = q->first; qtd != NULL; qtd = qtd->next) {
+		reached |= qtd == q->current;
+
+		if (qtd == end)
+			break;
+	}
+
+	if (qtd == NULL)
+		return;
+
+	q->first = end->next;
+	if (q->first == NULL)
+		q->last = NULL;
+
+	/* qTDs left over after a short packet or an error are skipped */
+	if (reached)
+		q->current = end->next;
+
+	q->halted = 0;
+	condSignal(sim_common.cond);
+}
+
+
+void ehci_dequeue(struct qh *qh, struct qtd *first, struct qtd *last)
+{
+	sim_qh_t *q = (sim_qh_t *)qh;
+	sim_qtd_t *qtd, *prev = NULL, *end = (sim_qtd_t *)last;
+	int reached = 0;
+
+	for (qtd = q->first; qtd != NULL && qtd != (sim_qtd_t *)first; qtd = qtd->next)
+		prev = qtd;
+
+	if (qtd == NULL)
+		return;
+
+	for (; qtd != end; qtd = qtd->next)
+		reached |= qtd == q->current;
+
+	reached |= end == q->current;
+
+	if (prev != NULL)
+		prev->next = end->next;
+	else
+		q->first = end->next;
+
+	if (q->last == end)
+		q->last = prev;
+
+	if (reached)
+		q->current = end->next;
+}
+
+
+int ehci_qtdError(struct qtd *qtd)
+{
+	return ((sim_qtd_t *)qtd)->error;
+}
+
+
+int ehci_qtdBabble(struct qtd *qtd)
+{
+	return ((sim_qtd_t *)qtd)->babble;
+}
+
+
+int ehci_qtdFinished(struct qtd *qtd)
+{
+	return !((sim_qtd_t *)qtd)->active;
+}
+
+
+size_t ehci_qtdRemainingBytes(struct qtd *qtd)
+{
+	return ((sim_qtd_t *)qtd)->remaining;
+}
+
+
+void ehci_qhSetAddress(struct qh *qh, int address)
+{
+	((sim_qh_t *)qh)->address = address;
+}
+
+
+void ehci_qhSetMult(struct qh *qh, int mult)
+{
+	((sim_qh_t *)qh)->mult = mult;
+}
+
+
+void ehci_qhSetTT(struct qh *qh, int hub_address, int port)
+{
+	/* No hubs are modelled */
+}
+
+
+unsigned ehci_ringDoorbell(void)
+{
+	condSignal(sim_common.cond);
+	return ++sim_common.doorbells;
+}
+
+
+unsigned ehci_doorbells(void)
+{
+	return sim_common.answered;
+}
+
+
+/* Called without the schedule lock, the controller thread uses the device state under it */
+void ehci_resetPort(void)
+{
+	mutexLock(sim_common.lock);
+	sim_common.address = 0;
+	sim_common.configuration = 0;
+
+	if (sim_common.model != NULL && sim_common.model->reset != NULL)
+		sim_common.model->reset();
+	mutexUnlock(sim_common.lock);
+}
+
+
+int ehci_portSpeed(void)
+{
+	return sim_common.model != NULL ? sim_common.model->speed : full_speed;
+}
+
+
+int ehci_deviceAttached(void)
+{
+	return sim_common.model != NULL;
+}
+
+
+int ehci_init(void (*event_cb)(int), handle_t lock)
+{
+	const char *name = getenv("EHCI_SIM_DEVICE");
+	unsigned i;
+
+	if (name == NULL)
+		name = sim_zero.name;
+
+	for (i = 0; i < sizeof(sim_models) / sizeof(sim_models[0]); ++i) {
+		if (!strcmp(sim_models[i]->name, name))
+			sim_common.model = sim_models[i];
+	}
+
+	sim_common.event_cb = event_cb;
+	sim_common.lock = lock;
+	sim_common.frame_us = sim_env("EHCI_SIM_FRAME_US", SIM_FRAME_US);
+	sim_common.bytes = sim_env("EHCI_SIM_BYTES", sim_common.model != NULL && sim_common.model->speed != high_speed ? SIM_FS_BYTES : SIM_HS_BYTES);
+	sim_common.overhead = sim_env("EHCI_SIM_OVERHEAD", SIM_OVERHEAD);
+	sim_common.latency_us = sim_env("EHCI_SIM_LATENCY_US", SIM_LATENCY_US);
+
+	/* A device present from the start shows up as a port change */
+	sim_common.port_change = sim_common.model != NULL;
+
+	if (condCreate(&sim_common.cond) < 0)
+		return -ENOMEM;
+
+	gettime(&sim_common.now, NULL);
+
+	return beginthread(sim_thread, 3, malloc(0x4000), 0x4000, NULL);
+}
@@ -0,0 +1,51 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Server - simulated EHCI controller
+ *
+ * host/sim/sim.h
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _USB_HOST_SIM_H_
+#define _USB_HOST_SIM_H_
+
+#include <stddef.h>
+#include <usb.h>
+
+
+/* Device model answers besides a byte count */
+#define SIM_NAK (-1)
+#define SIM_STALL (-2)
+
+
+/* Device on the root port, always called with the schedule lock held */
+typedef struct {
+	const char *name;
+	int speed;
+	const usb_device_desc_t *device;
+	const usb_configuration_desc_t *configuration; /* wTotalLength bytes */
+
+	/* Bus reset, may be NULL */
+	void (*reset)(void);
+
+	/* Requests other than the standard ones handled by the controller model. Data is wLength bytes,
+	 * returns the length of an IN data stage or SIM_STALL. May be NULL */
+	int (*control)(const usb_setup_packet_t *setup, void *data);
+
+	/* A single packet on a non-control endpoint, returns the bytes moved, SIM_NAK or SIM_STALL */
+	int (*in)(int endpoint, void *data, size_t size);
+	int (*out)(int endpoint, const void *data, size_t size);
+} sim_model_t;
+
+
+/* Source/sink device in the style of Linux gadget zero */
+extern const sim_model_t sim_zero;
+
+
+#endif
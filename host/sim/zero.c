@@ -0,0 +1,127 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Server - simulated source/sink device
+ *
+ * host/sim/zero.c
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <string.h>
+#include <ehci.h>
+
+#include "sim.h"
+
+
+/* Bulk IN and OUT plus an interrupt IN endpoint polled every millisecond */
+#define ZERO_BULK_IN 1
+#define ZERO_BULK_OUT 1
+#define ZERO_INTR_IN 2
+#define ZERO_INTR_SIZE 8
+
+
+static const usb_device_desc_t zero_device = {
+	.bLength = sizeof(usb_device_desc_t),
+	.bDescriptorType = USB_DESC_DEVICE,
+	.bcdUSB = 0x0200,
+	.bDeviceClass = 0xff,
+	.bMaxPacketSize0 = 64,
+	.idVendor = 0x0525,
+	.idProduct = 0xa4a0,
+	.bcdDevice = 0x0100,
+	.bNumConfigurations = 1,
+};
+
+
+static const struct {
+	usb_configuration_desc_t configuration;
+	usb_interface_desc_t interface;
+	usb_endpoint_desc_t endpoints[3];
+} __attribute__((packed)) zero_configuration = {
+	.configuration = {
+		.bLength = sizeof(usb_configuration_desc_t),
+		.bDescriptorType = USB_DESC_CONFIG,
+		.wTotalLength = sizeof(zero_configuration),
+		.bNumInterfaces = 1,
+		.bConfigurationValue = 1,
+		.bmAttributes = 0x80,
+		.bMaxPower = 50,
+	},
+	.interface = {
+		.bLength = sizeof(usb_interface_desc_t),
+		.bDescriptorType = USB_DESC_INTERFACE,
+		.bNumEndpoints = 3,
+		.bInterfaceClass = 0xff,
+	},
+	.endpoints = {
+		{ sizeof(usb_endpoint_desc_t), USB_DESC_ENDPOINT, 0x80 | ZERO_BULK_IN, 2, 512, 0 },
+		{ sizeof(usb_endpoint_desc_t), USB_DESC_ENDPOINT, ZERO_BULK_OUT, 2, 512, 0 },
+		{ sizeof(usb_endpoint_desc_t), USB_DESC_ENDPOINT, 0x80 | ZERO_INTR_IN, 3, 64, 4 },
+	},
+};
+
+
+static struct {
+	unsigned pattern;
+} zero_common;
+
+
+static void zero_reset(void)
+{
+	zero_common.pattern = 0;
+}
+
+
+static int zero_control(const usb_setup_packet_t *setup, void *data)
+{
+	/* Vendor requests read zeros and swallow anything written */
+	if ((setup->bmRequestType & REQUEST_DIR_MASK) == REQUEST_DIR_DEV2HOST)
+		memset(data, 0, setup->wLength);
+
+	return setup->wLength;
+}
+
+
+static int zero_in(int endpoint, void *data, size_t size)
+{
+	unsigned char *bytes = data;
+	size_t i;
+
+	if (endpoint == ZERO_INTR_IN) {
+		size = size < ZERO_INTR_SIZE ? size : ZERO_INTR_SIZE;
+		memset(data, 0, size);
+		return size;
+	}
+
+	if (endpoint != ZERO_BULK_IN)
+		return SIM_STALL;
+
+	/* Same pattern as gadget zero: i % 63 */
+	for (i = 0; i < size; ++i, zero_common.pattern = (zero_common.pattern + 1) % 63)
+		bytes[i] = zero_common.pattern;
+
+	return size;
+}
+
+
+static int zero_out(int endpoint, const void *data, size_t size)
+{
+	return endpoint == ZERO_BULK_OUT ? (int)size : SIM_STALL;
+}
+
+
+const sim_model_t sim_zero = {
+	.name = "zero",
+	.speed = high_speed,
+	.device = &zero_device,
+	.configuration = &zero_configuration.configuration,
+	.reset = zero_reset,
+	.control = zero_control,
+	.in = zero_in,
+	.out = zero_out,
+};
@@ -0,0 +1,145 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Server - binary trace rings
+ *
+ * host/trace.c
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <sys/threads.h>
+#include <string.h>
+
+#include "trace.h"
+
+
+volatile unsigned trace_mask;
+
+
+#define TRACE_DEMCR 0xe000edfc
+#define TRACE_DWT_CTRL 0xe0001000
+#define TRACE_DWT_CYCCNT 0xe0001004
+
+
+static struct {
+	volatile uint32_t heads[USB_TRACE_RINGS];
+	usb_trace_event_t events[USB_TRACE_RINGS][TRACE_RING_SIZE];
+
+	struct {
+		char *stack;
+		size_t size;
+	} threads[USB_TRACE_RINGS - 1];
+	unsigned nthreads;
+} trace_common;
+
+
+/* On ARMv7-M the stamp is the 32-bit DWT cycle counter, it wraps every few seconds.
+ * ARMv7-A does not let user mode read its counter, there the stamp is the system time */
+static inline uint64_t trace_stamp(void)
+{
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+	return *(volatile uint32_t *)TRACE_DWT_CYCCNT;
+#elif TRACE_CYCLES
+	return __builtin_ia32_rdtsc();
+#else
+	time_t now;
+
+	gettime(&now, NULL);
+	return now;
+#endif
+}
+
+
+void trace_init(unsigned mask)
+{
+	memset(&trace_common, 0, sizeof(trace_common));
+
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+	/* TRCENA powers the DWT, CYCCNTENA starts the counter */
+	*(volatile uint32_t *)TRACE_DEMCR |= 1u << 24;
+	*(volatile uint32_t *)TRACE_DWT_CTRL |= 1u;
+#endif
+
+	trace_mask = mask;
+}
+
+
+/* Must be called before the thread starts */
+void trace_thread(void *stack, size_t size)
+{
+	unsigned n = trace_common.nthreads;
+
+	if (stack == NULL || n == USB_TRACE_RINGS - 1)
+		return;
+
+	trace_common.threads[n].stack = stack;
+	trace_common.threads[n].size = size;
+	__atomic_store_n(&trace_common.nthreads, n + 1, __ATOMIC_RELEASE);
+}
+
+
+/* A thread is told apart by its stack */
+static unsigned trace_ring(void)
+{
+	char local, *sp = &local;
+	unsigned i, n = __atomic_load_n(&trace_common.nthreads, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < n; ++i) {
+		if (sp >= trace_common.threads[i].stack && sp < trace_common.threads[i].stack + trace_common.threads[i].size)
+			return i;
+	}
+
+	return USB_TRACE_RINGS - 1;
+}
+
+
+void trace_record(unsigned type, unsigned id, int arg)
+{
+	unsigned ring = trace_ring();
+	uint32_t index = __atomic_fetch_add(&trace_common.heads[ring], 1, __ATOMIC_RELAXED);
+	usb_trace_event_t *event = &trace_common.events[ring][index % TRACE_RING_SIZE];
+
+	/* seq is written last, a reader seeing index + 1 there has the whole event */
+	__atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+	event->stamp = trace_stamp();
+	event->id = id;
+	event->arg = arg;
+	event->type = type;
+	__atomic_store_n(&event->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+
+size_t trace_dump(void *buffer, size_t size)
+{
+	usb_trace_header_t header;
+	unsigned ring;
+
+	if (size < sizeof(header))
+		return 0;
+
+	header.mask = trace_mask;
+	header.size = TRACE_RING_SIZE;
+	header.rings = (size - sizeof(header)) / sizeof(trace_common.events[0]);
+	header.cycles = TRACE_CYCLES;
+
+	if (header.rings > USB_TRACE_RINGS)
+		header.rings = USB_TRACE_RINGS;
+
+	/* Writers are not stopped, heads are sampled around the copy so that the reader can drop events written during it */
+	for (ring = 0; ring < USB_TRACE_RINGS; ++ring)
+		header.heads[ring] = __atomic_load_n(&trace_common.heads[ring], __ATOMIC_ACQUIRE);
+
+	memcpy((char *)buffer + sizeof(header), trace_common.events, header.rings * sizeof(trace_common.events[0]));
+
+	for (ring = 0; ring < USB_TRACE_RINGS; ++ring)
+		header.ends[ring] = __atomic_load_n(&trace_common.heads[ring], __ATOMIC_ACQUIRE);
+
+	memcpy(buffer, &header, sizeof(header));
+
+	return sizeof(header) + header.rings * sizeof(trace_common.events[0]);
+}
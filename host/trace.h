@@ -0,0 +1,60 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Server - binary trace rings
+ *
+ * host/trace.h
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _USB_HOST_TRACE_H_
+#define _USB_HOST_TRACE_H_
+
+#include <stddef.h>
+
+#include "hostsrv.h"
+
+
+/* Events kept per ring, power of 2 */
+#define TRACE_RING_SIZE 128
+
+
+/* Stamps are cycle counts where the counter can be read, elsewhere each stamp is a gettime call */
+#if defined(__i386__) || defined(__x86_64__) || defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+#define TRACE_CYCLES 1
+#else
+#define TRACE_CYCLES 0
+#endif
+
+
+extern volatile unsigned trace_mask;
+
+
+void trace_init(unsigned mask);
+
+
+/* Gives the thread running on stack a ring of its own, threads not registered share the last one */
+void trace_thread(void *stack, size_t size);
+
+
+void trace_record(unsigned type, unsigned id, int arg);
+
+
+/* Copies the header and as many rings as fit in size bytes, returns the number of bytes copied */
+size_t trace_dump(void *buffer, size_t size);
+
+
+/* Events go to the ring of the calling thread. Disabled events cost a load and a branch */
+static inline void trace_event(unsigned type, unsigned id, int arg)
+{
+	if (trace_mask & (1u << type))
+		trace_record(type, id, arg);
+}
+
+
+#endif
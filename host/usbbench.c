@@ -0,0 +1,476 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Server - URB throughput and latency benchmark
+ *
+ * host/usbbench.c
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/threads.h>
+
+#include "hostproxy.h"
+
+
+#define USBBENCH_PIPES 8
+#define USBBENCH_DEPTH 256
+#define USBBENCH_MIN_SIZE 8
+#define USBBENCH_MAX_SIZE 65536
+
+/* Gadget zero, also the device of hostsrv-sim */
+#define USBBENCH_VID 0x0525
+#define USBBENCH_PID 0xa4a0
+
+/* Gadget zero control read and write test requests */
+#define USBBENCH_REQ_WRITE 0x5b
+#define USBBENCH_REQ_READ 0x5c
+
+
+typedef struct {
+	int id;
+	int in;
+
+	/* Submission times of URBs in flight, completions on a pipe come in submission order */
+	time_t stamps[USBBENCH_DEPTH];
+	unsigned head, tail;
+	unsigned count;
+} usbbench_pipe_t;
+
+
+static struct {
+	handle_t lock, cond;
+
+	int device_id;
+	usb_configuration_desc_t *configuration;
+
+	int type, in, out;
+	unsigned depth, size;
+	char *buffer;
+
+	usbbench_pipe_t pipes[USBBENCH_PIPES];
+	unsigned npipes;
+
+	/* Current round, pipe threads start on a change */
+	unsigned round;
+	unsigned total, done, errors;
+	unsigned long long bytes;
+	time_t *latencies, end;
+} usbbench_common;
+
+
+static void usbbench_complete(time_t now, time_t latency, int err, size_t size)
+{
+	if (err != EOK)
+		usbbench_common.errors++;
+	else
+		usbbench_common.bytes += size;
+
+	usbbench_common.latencies[usbbench_common.done++] = latency;
+
+	if (usbbench_common.done == usbbench_common.total) {
+		usbbench_common.end = now;
+		condBroadcast(usbbench_common.cond);
+	}
+}
+
+
+static void usbbench_event(usb_event_t *event, void *data, size_t size)
+{
+	usbbench_pipe_t *pipe;
+	time_t now;
+	unsigned i;
+
+	switch (event->type) {
+	case usb_event_insertion:
+		mutexLock(usbbench_common.lock);
+		if (usbbench_common.configuration == NULL && (usbbench_common.configuration = malloc(size)) != NULL) {
+			memcpy(usbbench_common.configuration, data, size);
+			usbbench_common.device_id = event->device_id;
+			condBroadcast(usbbench_common.cond);
+		}
+		mutexUnlock(usbbench_common.lock);
+		break;
+
+	case usb_event_completion:
+		gettime(&now, NULL);
+
+		mutexLock(usbbench_common.lock);
+		for (i = 0; i < usbbench_common.npipes; ++i) {
+			pipe = &usbbench_common.pipes[i];
+
+			if (pipe->id != event->completion.pipe || pipe->head == pipe->tail)
+				continue;
+
+			usbbench_complete(now, now - pipe->stamps[pipe->head++ % USBBENCH_DEPTH], event->completion.error, pipe->in ? event->completion.size : usbbench_common.size);
+			condBroadcast(usbbench_common.cond);
+			break;
+		}
+		mutexUnlock(usbbench_common.lock);
+		break;
+
+	default:
+		break;
+	}
+}
+
+
+static int usbbench_submit(usbbench_pipe_t *pipe, int async)
+{
+	usb_urb_t urb = {
+		.type = usbbench_common.type,
+		.device_id = usbbench_common.device_id,
+		.pipe = pipe->id,
+		.transfer_size = usbbench_common.size,
+		.async = async,
+	};
+
+	if (usbbench_common.type == usb_transfer_control) {
+		urb.setup.bmRequestType = (pipe->in ? REQUEST_DIR_DEV2HOST : REQUEST_DIR_HOST2DEV) | REQUEST_TYPE_VENDOR | REQUEST_RECIPIENT_DEVICE;
+		urb.setup.bRequest = pipe->in ? USBBENCH_REQ_READ : USBBENCH_REQ_WRITE;
+		urb.setup.wLength = usbbench_common.size;
+	}
+
+	if (pipe->in)
+		return hostproxy_read(&urb, usbbench_common.buffer, usbbench_common.size);
+
+	return hostproxy_write(&urb, usbbench_common.buffer, usbbench_common.size);
+}
+
+
+static void usbbench_sync(usbbench_pipe_t *pipe)
+{
+	time_t start, end;
+	unsigned i;
+	int err;
+
+	for (i = 0; i < pipe->count; ++i) {
+		gettime(&start, NULL);
+		err = usbbench_submit(pipe, 0);
+		gettime(&end, NULL);
+
+		mutexLock(usbbench_common.lock);
+		usbbench_complete(end, end - start, err, usbbench_common.size);
+		mutexUnlock(usbbench_common.lock);
+	}
+}
+
+
+static void usbbench_async(usbbench_pipe_t *pipe)
+{
+	time_t now;
+	unsigned i;
+	int err;
+
+	for (i = 0; i < pipe->count; ++i) {
+		mutexLock(usbbench_common.lock);
+		while (pipe->tail - pipe->head >= usbbench_common.depth)
+			condWait(usbbench_common.cond, usbbench_common.lock, 0);
+
+		gettime(&pipe->stamps[pipe->tail++ % USBBENCH_DEPTH], NULL);
+		mutexUnlock(usbbench_common.lock);
+
+		if ((err = usbbench_submit(pipe, 1)) >= 0)
+			continue;
+
+		/* Nothing submitted after it, so the failed URB is still the last one */
+		gettime(&now, NULL);
+
+		mutexLock(usbbench_common.lock);
+		pipe->tail--;
+		usbbench_complete(now, 0, err, 0);
+		mutexUnlock(usbbench_common.lock);
+	}
+}
+
+
+static void usbbench_thread(void *arg)
+{
+	usbbench_pipe_t *pipe = arg;
+	unsigned round = 0;
+
+	mutexLock(usbbench_common.lock);
+	for (;;) {
+		while (usbbench_common.round == round)
+			condWait(usbbench_common.cond, usbbench_common.lock, 0);
+
+		round = usbbench_common.round;
+		mutexUnlock(usbbench_common.lock);
+
+		if (usbbench_common.depth)
+			usbbench_async(pipe);
+		else
+			usbbench_sync(pipe);
+
+		mutexLock(usbbench_common.lock);
+	}
+}
+
+
+static int usbbench_compare(const void *a, const void *b)
+{
+	time_t x = *(const time_t *)a, y = *(const time_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+static time_t usbbench_percentile(unsigned permille)
+{
+	unsigned i = (unsigned long long)usbbench_common.total * permille / 1000;
+
+	return usbbench_common.latencies[i < usbbench_common.total ? i : usbbench_common.total - 1];
+}
+
+
+static void usbbench_round(unsigned count)
+{
+	time_t start, elapsed;
+	unsigned i;
+
+	mutexLock(usbbench_common.lock);
+	usbbench_common.total = count;
+	usbbench_common.done = 0;
+	usbbench_common.errors = 0;
+	usbbench_common.bytes = 0;
+
+	for (i = 0; i < usbbench_common.npipes; ++i)
+		usbbench_common.pipes[i].count = count / usbbench_common.npipes + (i < count % usbbench_common.npipes);
+
+	gettime(&start, NULL);
+	usbbench_common.round++;
+	condBroadcast(usbbench_common.cond);
+
+	while (usbbench_common.done < usbbench_common.total)
+		condWait(usbbench_common.cond, usbbench_common.lock, 0);
+	mutexUnlock(usbbench_common.lock);
+
+	if ((elapsed = usbbench_common.end - start) <= 0)
+		elapsed = 1;
+
+	qsort(usbbench_common.latencies, count, sizeof(time_t), usbbench_compare);
+
+	printf("%8u %10llu %10.2f %8llu %8llu %8llu %8u\n", usbbench_common.size,
+		(unsigned long long)count * 1000000 / elapsed, (double)usbbench_common.bytes / elapsed,
+		(unsigned long long)usbbench_percentile(500), (unsigned long long)usbbench_percentile(990),
+		(unsigned long long)usbbench_percentile(999), usbbench_common.errors);
+}
+
+
+static int usbbench_connect(unsigned vid, unsigned pid)
+{
+	usb_device_id_t id = { vid, pid, USB_CONNECT_NONE, USB_CONNECT_NONE, USB_CONNECT_NONE, USB_CONNECT_NONE };
+	usb_setup_packet_t setup = {
+		.bmRequestType = REQUEST_DIR_HOST2DEV | REQUEST_TYPE_STANDARD | REQUEST_RECIPIENT_DEVICE,
+		.bRequest = REQ_SET_CONFIGURATION,
+	};
+	usb_urb_t urb = { .type = usb_transfer_control };
+
+	if (hostproxy_connect(&id, usbbench_event) < 0)
+		return -1;
+
+	mutexLock(usbbench_common.lock);
+	while (usbbench_common.configuration == NULL)
+		condWait(usbbench_common.cond, usbbench_common.lock, 0);
+	mutexUnlock(usbbench_common.lock);
+
+	setup.wValue = usbbench_common.configuration->bConfigurationValue;
+	urb.device_id = usbbench_common.device_id;
+	urb.setup = setup;
+
+	return hostproxy_write(&urb, NULL, 0);
+}
+
+
+/* Opens up to count endpoints of the benchmarked type and direction */
+static int usbbench_open(unsigned count)
+{
+	unsigned char *desc = (unsigned char *)usbbench_common.configuration, *end = desc + usbbench_common.configuration->wTotalLength;
+	usb_endpoint_desc_t *endpoint;
+	usbbench_pipe_t *pipe;
+	usb_open_t open;
+	int in, id;
+
+	if (usbbench_common.type == usb_transfer_control) {
+		usbbench_common.pipes[0].id = 0;
+		usbbench_common.pipes[0].in = usbbench_common.in;
+		usbbench_common.npipes = 1;
+		return 0;
+	}
+
+	for (; desc + 2 <= end && desc[0] >= 2; desc += desc[0]) {
+		if (desc[1] != USB_DESC_ENDPOINT || usbbench_common.npipes == count)
+			continue;
+
+		endpoint = (usb_endpoint_desc_t *)desc;
+		in = (endpoint->bEndpointAddress & 0x80) != 0;
+
+		/* Attributes keep the hardware encoding: 2 bulk, 3 interrupt */
+		if ((endpoint->bmAttributes & 0x3) != (usbbench_common.type == usb_transfer_bulk ? 2 : 3))
+			continue;
+
+		if ((in && !usbbench_common.in) || (!in && !usbbench_common.out))
+			continue;
+
+		open.device_id = usbbench_common.device_id;
+		open.endpoint = *endpoint;
+
+		if ((id = hostproxy_open(&open)) < 0) {
+			fprintf(stderr, "usbbench: failed to open endpoint %x (%d)\n", endpoint->bEndpointAddress, id);
+			return id;
+		}
+
+		pipe = &usbbench_common.pipes[usbbench_common.npipes++];
+		pipe->id = id;
+		pipe->in = in;
+	}
+
+	return usbbench_common.npipes ? 0 : -ENOENT;
+}
+
+
+static void usbbench_usage(const char *progname)
+{
+	printf("Usage: %s [options]\n", progname);
+	printf("\t-t <type>\tbulk, interrupt or control (default bulk)\n");
+	printf("\t-d <dir>\tin, out or both (default in)\n");
+	printf("\t-s <min>[-<max>]\ttransfer sizes, doubled from min to max (default %d-%d)\n", USBBENCH_MIN_SIZE, USBBENCH_MAX_SIZE);
+	printf("\t-q <n>\tasync URBs queued per pipe, 0 - synchronous (default 0)\n");
+	printf("\t-p <n>\tpipes used concurrently (default 1)\n");
+	printf("\t-n <n>\tURBs per transfer size (default 1000)\n");
+	printf("\t-r <n>\tregister buffers and post async URBs through rings of n entries\n");
+	printf("\t-i <vid>:<pid>\tdevice to test (default %04x:%04x)\n", USBBENCH_VID, USBBENCH_PID);
+}
+
+
+int main(int argc, char **argv)
+{
+	unsigned min = USBBENCH_MIN_SIZE, max = USBBENCH_MAX_SIZE, pipes = 1, count = 1000, rings = 0;
+	unsigned vid = USBBENCH_VID, pid = USBBENCH_PID, i;
+	const char *type = "bulk", *dir = "in";
+	char *end;
+	int c;
+
+	usbbench_common.type = usb_transfer_bulk;
+	usbbench_common.in = 1;
+
+	while ((c = getopt(argc, argv, "t:d:s:q:p:n:r:i:h")) != -1) {
+		switch (c) {
+		case 't':
+			type = optarg;
+			if (!strcmp(optarg, "bulk"))
+				usbbench_common.type = usb_transfer_bulk;
+			else if (!strcmp(optarg, "interrupt"))
+				usbbench_common.type = usb_transfer_interrupt;
+			else if (!strcmp(optarg, "control"))
+				usbbench_common.type = usb_transfer_control;
+			else
+				c = '?';
+			break;
+		case 'd':
+			dir = optarg;
+			usbbench_common.in = !strcmp(optarg, "in") || !strcmp(optarg, "both");
+			usbbench_common.out = !strcmp(optarg, "out") || !strcmp(optarg, "both");
+			if (!usbbench_common.in && !usbbench_common.out)
+				c = '?';
+			break;
+		case 's':
+			min = max = strtoul(optarg, &end, 0);
+			if (*end == '-')
+				max = strtoul(end + 1, NULL, 0);
+			break;
+		case 'q':
+			usbbench_common.depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			pipes = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			rings = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			vid = strtoul(optarg, &end, 16);
+			pid = *end == ':' ? strtoul(end + 1, NULL, 16) : USB_CONNECT_WILDCARD;
+			break;
+		default:
+			c = '?';
+			break;
+		}
+
+		if (c == '?' || c == 'h') {
+			usbbench_usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	/* Control transfers have a 16 bit wLength and one direction at a time */
+	if (usbbench_common.type == usb_transfer_control) {
+		max = max < 0xffff ? max : 0xffff;
+		usbbench_common.out = !usbbench_common.in;
+	}
+
+	if (!min || min > max || max > USBBENCH_MAX_SIZE || !count || !pipes || pipes > USBBENCH_PIPES || usbbench_common.depth > USBBENCH_DEPTH) {
+		usbbench_usage(argv[0]);
+		return 1;
+	}
+
+	if (mutexCreate(&usbbench_common.lock) < 0 || condCreate(&usbbench_common.cond) < 0 ||
+		(usbbench_common.latencies = malloc(count * sizeof(time_t))) == NULL) {
+		fprintf(stderr, "usbbench: out of memory\n");
+		return 1;
+	}
+
+	if (hostproxy_init() < 0 || usbbench_connect(vid, pid) < 0 || usbbench_open(pipes) < 0) {
+		fprintf(stderr, "usbbench: no usable %s %s endpoints on %04x:%04x\n", type, dir, vid, pid);
+		return 1;
+	}
+
+	/* URBs in a registered region are not copied, only async ones go through the rings */
+	if (rings) {
+		if ((usbbench_common.buffer = hostproxy_alloc(max)) == NULL || hostproxy_register(usbbench_common.buffer, max) < 0 ||
+			(usbbench_common.depth && hostproxy_rings(rings) < 0)) {
+			fprintf(stderr, "usbbench: failed to set up shared buffers\n");
+			return 1;
+		}
+	}
+	else if ((usbbench_common.buffer = malloc(max)) == NULL) {
+		fprintf(stderr, "usbbench: out of memory\n");
+		return 1;
+	}
+
+	if (usbbench_common.npipes < pipes)
+		fprintf(stderr, "usbbench: only %u %s %s endpoints available\n", usbbench_common.npipes, type, dir);
+
+	for (i = 0; i < usbbench_common.npipes; ++i)
+		beginthread(usbbench_thread, 4, malloc(0x4000), 0x4000, &usbbench_common.pipes[i]);
+
+	printf("usbbench: %s %s, %u pipes, ", type, dir, usbbench_common.npipes);
+	if (usbbench_common.depth)
+		printf("async depth %u%s\n", usbbench_common.depth, rings ? ", rings" : "");
+	else
+		printf("sync\n");
+
+	printf("%8s %10s %10s %8s %8s %8s %8s\n", "size", "URB/s", "MB/s", "p50 us", "p99 us", "p999 us", "errors");
+
+	/* Sizes double up to max, which is run last even if it is not a power of 2 */
+	for (usbbench_common.size = min;; usbbench_common.size = usbbench_common.size < max / 2 ? 2 * usbbench_common.size : max) {
+		usbbench_round(count);
+
+		if (usbbench_common.size == max)
+			break;
+	}
+
+	return 0;
+}
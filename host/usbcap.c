@@ -0,0 +1,135 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Server - URB capture tool
+ *
+ * host/usbcap.c
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "hostproxy.h"
+
+
+#define USBCAP_SNAPLEN 64
+#define USBCAP_RING (64 * 1024)
+#define USBCAP_POLL_US 100000
+
+/* Linux usbmon header preceding the data of every record */
+#define USBCAP_USBMON_SIZE 48
+#define USBCAP_LINKTYPE 189
+
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t network;
+} usbcap_header_t;
+
+
+static void usbcap_usage(const char *progname)
+{
+	printf("Usage: %s -w <file> [options]\n", progname);
+	printf("\t-d <id>\tcapture device id only\n");
+	printf("\t-e <n>\tcapture endpoint number only\n");
+	printf("\t-s <n>\tdata bytes kept per URB (default %d)\n", USBCAP_SNAPLEN);
+	printf("\t-b <n>\tcapture ring size in hostsrv (default %d)\n", USBCAP_RING);
+	printf("\t-t <s>\tcapture time in seconds (default 10)\n");
+}
+
+
+int main(int argc, char **argv)
+{
+	usb_capture_t capture = { .set = 1, .device_id = -1, .endpoint = -1, .snaplen = USBCAP_SNAPLEN, .size = USBCAP_RING };
+	usbcap_header_t header = { 0xa1b2c3d4, 2, 4, 0, 0, 0, USBCAP_LINKTYPE };
+	const char *path = NULL;
+	unsigned seconds = 10, polls;
+	usb_stats_t stats;
+	char *buffer;
+	size_t size;
+	FILE *file;
+	int c, n;
+
+	while ((c = getopt(argc, argv, "w:d:e:s:b:t:h")) != -1) {
+		switch (c) {
+		case 'w':
+			path = optarg;
+			break;
+		case 'd':
+			capture.device_id = strtol(optarg, NULL, 0);
+			break;
+		case 'e':
+			capture.endpoint = strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			capture.snaplen = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			capture.size = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			seconds = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usbcap_usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (path == NULL || !capture.size) {
+		usbcap_usage(argv[0]);
+		return 1;
+	}
+
+	size = capture.size;
+
+	if ((buffer = malloc(size)) == NULL || (file = fopen(path, "wb")) == NULL) {
+		fprintf(stderr, "usbcap: can't open %s\n", path);
+		return 1;
+	}
+
+	header.snaplen = USBCAP_USBMON_SIZE + capture.snaplen;
+	fwrite(&header, sizeof(header), 1, file);
+
+	if (hostproxy_init() < 0 || (n = hostproxy_capture(&capture, NULL, 0)) < 0) {
+		fprintf(stderr, "usbcap: failed to start capture\n");
+		return 1;
+	}
+
+	/* Drain the ring in hostsrv often enough to keep it from filling up */
+	capture.set = 0;
+	for (polls = 0; polls < seconds * (1000000 / USBCAP_POLL_US); ++polls) {
+		usleep(USBCAP_POLL_US);
+
+		if ((n = hostproxy_capture(&capture, buffer, size)) > 0)
+			fwrite(buffer, n, 1, file);
+	}
+
+	/* Stopping returns whatever is left */
+	capture.set = 1;
+	capture.size = 0;
+	if ((n = hostproxy_capture(&capture, buffer, size)) > 0)
+		fwrite(buffer, n, 1, file);
+
+	fclose(file);
+
+	if (hostproxy_stats(&stats) == 0 && stats.capture_drops)
+		fprintf(stderr, "usbcap: %u URBs dropped\n", stats.capture_drops);
+
+	free(buffer);
+
+	return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Server - trace dump tool
+ *
+ * host/usbtrace.c
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hostproxy.h"
+
+
+/* Transfers followed at once for the latency column, power of 2 */
+#define USBTRACE_TRANSFERS 1024
+
+
+typedef struct {
+	uint64_t stamp;
+	unsigned type;
+	uint32_t id;
+	int32_t arg;
+} usbtrace_event_t;
+
+
+static const char *usbtrace_names[usb_trace_types] = { "urb", "link", "irq", "done", "signal", "respond" };
+
+
+static int usbtrace_cmp(const void *a, const void *b)
+{
+	const usbtrace_event_t *e1 = a, *e2 = b;
+
+	if (e1->stamp != e2->stamp)
+		return e1->stamp > e2->stamp ? 1 : -1;
+
+	return (int)e1->type - (int)e2->type;
+}
+
+
+/* Keeps the events of a ring that were complete and not overwritten while the dump was taken */
+static unsigned usbtrace_collect(const usb_trace_header_t *header, const usb_trace_event_t *ring, unsigned r, usbtrace_event_t *events)
+{
+	uint32_t i, first = header->ends[r] - header->size;
+	unsigned n = 0;
+
+	if (header->ends[r] < header->size)
+		first = 0;
+
+	for (i = first; i != header->heads[r]; ++i) {
+		if ((int32_t)(header->heads[r] - i) < 0)
+			break;
+
+		if (ring[i % header->size].seq != i + 1 || ring[i % header->size].type >= usb_trace_types)
+			continue;
+
+		events[n].stamp = ring[i % header->size].stamp;
+		events[n].type = ring[i % header->size].type;
+		events[n].id = ring[i % header->size].id;
+		events[n].arg = ring[i % header->size].arg;
+		n++;
+	}
+
+	return n;
+}
+
+
+static void usbtrace_print(const usb_trace_header_t *header, usbtrace_event_t *events, unsigned count)
+{
+	static struct {
+		uint32_t id;
+		uint64_t stamp;
+	} last[USBTRACE_TRANSFERS];
+	unsigned i, slot;
+	uint64_t base = count ? events[0].stamp : 0;
+
+	memset(last, 0, sizeof(last));
+
+	printf("%14s %10s %-8s %10s %10s\n", header->cycles ? "cycles" : "us", "delta", "event", "id", "arg");
+
+	/* Transfer events also show the time since the previous event of the same transfer */
+	for (i = 0; i < count; ++i) {
+		printf("%14llu ", (unsigned long long)(events[i].stamp - base));
+
+		if (events[i].type == usb_trace_irq || events[i].type == usb_trace_signal) {
+			printf("%10s ", "");
+		}
+		else {
+			slot = events[i].id % USBTRACE_TRANSFERS;
+
+			if (last[slot].id == events[i].id && last[slot].stamp)
+				printf("%10llu ", (unsigned long long)(events[i].stamp - last[slot].stamp));
+			else
+				printf("%10s ", "");
+
+			last[slot].id = events[i].id;
+			last[slot].stamp = events[i].stamp;
+		}
+
+		printf("%-8s %10x %10d\n", usbtrace_names[events[i].type], events[i].id, events[i].arg);
+	}
+}
+
+
+static void usbtrace_usage(const char *progname)
+{
+	printf("Usage: %s [options]\n", progname);
+	printf("\t-m <mask>\tset the trace event mask (urb 0x1, link 0x2, irq 0x4, done 0x8, signal 0x10, respond 0x20)\n");
+	printf("\t-q\tdo not dump the trace\n");
+}
+
+
+int main(int argc, char **argv)
+{
+	usb_trace_t trace = { 0 };
+	usb_trace_header_t header;
+	usbtrace_event_t *events;
+	char *dump;
+	size_t size;
+	unsigned r, count = 0;
+	int c, quiet = 0;
+
+	while ((c = getopt(argc, argv, "m:qh")) != -1) {
+		switch (c) {
+		case 'm':
+			trace.mask = strtoul(optarg, NULL, 0);
+			trace.set = 1;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			usbtrace_usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (hostproxy_init() < 0 || hostproxy_trace(&trace, &header, sizeof(header)) < 0) {
+		fprintf(stderr, "usbtrace: hostsrv not available\n");
+		return 1;
+	}
+
+	if (quiet)
+		return 0;
+
+	trace.set = 0;
+	size = sizeof(header) + USB_TRACE_RINGS * header.size * sizeof(usb_trace_event_t);
+
+	if ((dump = malloc(size)) == NULL || (events = malloc(USB_TRACE_RINGS * header.size * sizeof(*events))) == NULL) {
+		fprintf(stderr, "usbtrace: out of memory\n");
+		return 1;
+	}
+
+	if (hostproxy_trace(&trace, dump, size) < 0) {
+		fprintf(stderr, "usbtrace: dump failed\n");
+		return 1;
+	}
+
+	memcpy(&header, dump, sizeof(header));
+
+	/* Every thread has its own ring, merged by stamp */
+	for (r = 0; r < header.rings; ++r)
+		count += usbtrace_collect(&header, (usb_trace_event_t *)(dump + sizeof(header)) + r * header.size, r, events + count);
+
+	qsort(events, count, sizeof(*events), usbtrace_cmp);
+	printf("mask %#x, %u events\n", header.mask, count);
+	usbtrace_print(&header, events, count);
+
+	free(events);
+	free(dump);
+
+	return 0;
+}
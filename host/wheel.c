@@ -0,0 +1,120 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Server - hierarchical timer wheel
+ *
+ * host/wheel.c
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <stddef.h>
+#include <sys/list.h>
+
+#include "wheel.h"
+
+
+void wheel_init(wheel_t *wheel, unsigned now)
+{
+	unsigned level, slot;
+
+	wheel->now = now;
+	wheel->count = 0;
+
+	for (level = 0; level < WHEEL_LEVELS; ++level) {
+		for (slot = 0; slot < WHEEL_SLOTS; ++slot)
+			wheel->slots[level][slot] = NULL;
+	}
+}
+
+
+static void wheel_insert(wheel_t *wheel, wheel_timer_t *timer)
+{
+	unsigned delta = timer->expires - wheel->now, level = 0;
+
+	/* Level n holds timers due within WHEEL_SLOTS^(n + 1) ticks */
+	while (level < WHEEL_LEVELS - 1 && delta >= 1u << (WHEEL_BITS * (level + 1)))
+		level++;
+
+	timer->slot = &wheel->slots[level][(timer->expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+	LIST_ADD(timer->slot, timer);
+}
+
+
+void wheel_add(wheel_t *wheel, wheel_timer_t *timer, unsigned expires)
+{
+	unsigned delta = expires - wheel->now;
+
+	if (!delta || delta > WHEEL_MAX_TICKS)
+		delta = (int)delta <= 0 ? 1 : WHEEL_MAX_TICKS;
+
+	timer->expires = wheel->now + delta;
+	wheel_insert(wheel, timer);
+	wheel->count++;
+}
+
+
+void wheel_remove(wheel_t *wheel, wheel_timer_t *timer)
+{
+	LIST_REMOVE(timer->slot, timer);
+	timer->slot = NULL;
+	wheel->count--;
+}
+
+
+/* Redistributes a slot of an upper level to the levels below, returns its index */
+static unsigned wheel_cascade(wheel_t *wheel, unsigned level)
+{
+	unsigned index = (wheel->now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+	wheel_timer_t *timer, *list = wheel->slots[level][index];
+
+	wheel->slots[level][index] = NULL;
+
+	while ((timer = list) != NULL) {
+		LIST_REMOVE(&list, timer);
+		wheel_insert(wheel, timer);
+	}
+
+	return index;
+}
+
+
+void wheel_advance(wheel_t *wheel, unsigned now, void (*expire)(wheel_timer_t *))
+{
+	wheel_timer_t *timer, *list;
+	unsigned level, index;
+
+	/* Nothing to expire, an idle wheel costs nothing however long it slept */
+	if (!wheel->count) {
+		wheel->now = now;
+		return;
+	}
+
+	while (wheel->now != now) {
+		wheel->now++;
+
+		index = wheel->now & (WHEEL_SLOTS - 1);
+		for (level = 1; !index && level < WHEEL_LEVELS; ++level)
+			index = wheel_cascade(wheel, level);
+
+		index = wheel->now & (WHEEL_SLOTS - 1);
+		list = wheel->slots[0][index];
+		wheel->slots[0][index] = NULL;
+
+		while ((timer = list) != NULL) {
+			LIST_REMOVE(&list, timer);
+			timer->slot = NULL;
+			wheel->count--;
+			expire(timer);
+		}
+
+		if (!wheel->count) {
+			wheel->now = now;
+			break;
+		}
+	}
+}
@@ -0,0 +1,62 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Server - hierarchical timer wheel
+ *
+ * host/wheel.h
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _USB_HOST_WHEEL_H_
+#define _USB_HOST_WHEEL_H_
+
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+/* Longer timeouts are clamped */
+#define WHEEL_MAX_TICKS ((1u << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+
+typedef struct _wheel_timer_t {
+	struct _wheel_timer_t *next, *prev;
+	struct _wheel_timer_t **slot;
+	unsigned expires;
+} wheel_timer_t;
+
+
+typedef struct {
+	unsigned now;
+	unsigned count;
+	wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} wheel_t;
+
+
+/* Wheels are not locked, callers serialise access. Ticks wrap around */
+void wheel_init(wheel_t *wheel, unsigned now);
+
+
+/* Timer must not be armed, it expires at the first tick at or after expires */
+void wheel_add(wheel_t *wheel, wheel_timer_t *timer, unsigned expires);
+
+
+void wheel_remove(wheel_t *wheel, wheel_timer_t *timer);
+
+
+static inline int wheel_armed(wheel_timer_t *timer)
+{
+	return timer->slot != NULL;
+}
+
+
+/* Moves time forward to now, calling expire for every expired timer. Timers may be re-armed from expire */
+void wheel_advance(wheel_t *wheel, unsigned now, void (*expire)(wheel_timer_t *));
+
+
+#endif